@@ -37,22 +37,6 @@
 
 
 
-/******************************************
-    *cluster nodes
-    *
-******************************************/
-
-#define CLUSTER_NODES_ID                                                    0
-#define CLUSTER_NODES_ADDR                                                  1
-#define CLUSTER_NODES_ROLE                                                  2
-#define CLUSTER_NODES_SID                                                   3
-#define CLUSTER_NODES_CONNECTED                                             7
-#define CLUSTER_NODES_LENGTH                                                8
-#define CLUSTER_NODES_SLAVE_LEN                                             7
-
-
-
-
 #define MSG_TYPE_CODEC(ACTION)                                                                      \
     ACTION( UNKNOWN )                                                                               \
     ACTION( REQ_MC_GET )                       /* memcache retrieval requests */                    \
@@ -91,6 +75,8 @@
     ACTION( REQ_REDIS_SORT )                                                                        \
     ACTION( REQ_REDIS_TTL )                                                                         \
     ACTION( REQ_REDIS_TYPE )                                                                        \
+    ACTION( REQ_REDIS_UNLINK )                                                                      \
+    ACTION( REQ_REDIS_TOUCH )                                                                       \
     ACTION( REQ_REDIS_APPEND )                 /* redis requests - string */                        \
     ACTION( REQ_REDIS_BITCOUNT )                                                                    \
     ACTION( REQ_REDIS_BITPOS )                                                                    \
@@ -106,6 +92,7 @@
     ACTION( REQ_REDIS_INCRBYFLOAT )                                                                 \
     ACTION( REQ_REDIS_MGET )                                                                        \
     ACTION( REQ_REDIS_MSET )                                                                        \
+    ACTION( REQ_REDIS_MSETNX )                                                                      \
     ACTION( REQ_REDIS_PSETEX )                                                                      \
     ACTION( REQ_REDIS_RESTORE )                                                                     \
     ACTION( REQ_REDIS_SET )                                                                         \
@@ -185,6 +172,7 @@
     ACTION( REQ_REDIS_PING )                   /* redis requests - ping/quit */                     \
     ACTION( REQ_REDIS_QUIT)                                                                         \
     ACTION( REQ_REDIS_AUTH)                                                                         \
+    ACTION( REQ_REDIS_HOTKEYS )                /* answered by the proxy */                          \
     ACTION( REQ_REDIS_SELECT)                  /* only during init */                               \
     ACTION( RSP_REDIS_STATUS )                 /* redis response */                                 \
     ACTION( RSP_REDIS_ERROR )                                                                       \
@@ -207,6 +195,7 @@
     ACTION( RSP_REDIS_INTEGER )                                                                     \
     ACTION( RSP_REDIS_BULK )                                                                        \
     ACTION( RSP_REDIS_MULTIBULK )                                                                   \
+    ACTION( RSP_REDIS_PUSH )                   /* resp3 out of band push */                         \
     ACTION( SENTINEL )                                                                              \
 
 
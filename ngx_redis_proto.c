@@ -1,11 +1,11 @@
 #include "ngx_redis_proto.h"
-#include <hiredis/hiredis.h>
-#include <stdbool.h>
 #include "common.h"
 
-static ngx_int_t
-ngx_redis_mget_slotid(redisReply* replyInfo, size_t argc,  ngx_array_t *slotids);
-static ngx_int_t ngx_redis_mget(ngx_stream_session_t *s, redisReply *replyInfo, size_t argc, ngx_int_t slotid);
+#if (defined __GNUC__ && defined __SSE2__)
+#define REDIS_HAVE_SSE2  1
+#include <immintrin.h>
+#endif
+
 
 /* CRC16 implementation according to CCITT standards.
  *
@@ -59,1461 +59,1600 @@ static unsigned short crc16tab[256] =
 };
 
 
+/*
+ * crc16_slice[k][i] is the crc of byte i followed by k zero bytes, so
+ * eight bytes fold into the crc with eight independent lookups instead
+ * of a chain of eight dependent ones; filled from crc16tab on first use
+ */
+static uint16_t  crc16_slice[8][256];
+
+
+typedef uint16_t (*redis_crc16_pt)(const u_char *p, size_t len);
+
+static uint16_t crc16_resolve(const u_char *p, size_t len);
+
+static redis_crc16_pt  crc16_handler = crc16_resolve;
+
 
 static uint16_t
-crc16(const char *buf, int len) {
-    int counter;
-    uint16_t crc = 0;
-    for (counter = 0; counter < len; counter++)
-            crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *buf++)&0x00FF];
+crc16_slice8(uint16_t crc, const u_char *p, size_t len)
+{
+    while (len >= 8) {
+        crc = crc16_slice[7][(crc >> 8) ^ p[0]]
+              ^ crc16_slice[6][(crc & 0xff) ^ p[1]]
+              ^ crc16_slice[5][p[2]] ^ crc16_slice[4][p[3]]
+              ^ crc16_slice[3][p[4]] ^ crc16_slice[2][p[5]]
+              ^ crc16_slice[1][p[6]] ^ crc16_slice[0][p[7]];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = (crc << 8) ^ crc16tab[((crc >> 8) ^ *p++) & 0xff];
+    }
+
     return crc;
 }
 
 
+static uint16_t
+crc16_table(const u_char *p, size_t len)
+{
+    return crc16_slice8(0, p, len);
+}
+
+
+#if (REDIS_HAVE_SSE2)
+
+/*
+ * long keys are folded 16 bytes at a time with carry-less multiplies:
+ * a block A followed by B is A * x^128 + B, and A * x^128 mod P is
+ * A.hi * (x^192 mod P) + A.lo * (x^128 mod P), which is at most 80 bits
+ * wide; the last 128-bit remainder has the crc of everything folded, so
+ * it goes through the tables together with the unaligned tail
+ */
+#define CRC16_X128  0xaefc                  /* x^128 mod 0x11021 */
+#define CRC16_X192  0x650b                  /* x^192 mod 0x11021 */
+#define CRC16_CLMUL_MIN  64
+
+__attribute__((target("pclmul,ssse3")))
+static uint16_t
+crc16_clmul(const u_char *p, size_t len)
+{
+    u_char    rest[16];
+    uint16_t  crc;
+    __m128i   swap, k, x, y;
+
+    if (len < CRC16_CLMUL_MIN) {
+        return crc16_slice8(0, p, len);
+    }
+
+    /* the first byte of a block is its most significant one */
+    swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                        8, 9, 10, 11, 12, 13, 14, 15);
+    k = _mm_set_epi64x(CRC16_X192, CRC16_X128);
+
+    x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), swap);
+    p += 16;
+    len -= 16;
+
+    while (len >= 16) {
+        y = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), swap);
+
+        x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+                                        _mm_clmulepi64_si128(x, k, 0x00)),
+                          y);
+        p += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *) rest, _mm_shuffle_epi8(x, swap));
+
+    crc = crc16_slice8(0, rest, 16);
+
+    return crc16_slice8(crc, p, len);
+}
+
+#endif
+
+
+static uint16_t
+crc16_resolve(const u_char *p, size_t len)
+{
+    ngx_uint_t  i, k;
+
+    for (i = 0; i < 256; i++) {
+        crc16_slice[0][i] = crc16tab[i];
+
+        for (k = 1; k < 8; k++) {
+            crc16_slice[k][i] = (uint16_t) (crc16_slice[k - 1][i] << 8)
+                                ^ crc16tab[crc16_slice[k - 1][i] >> 8];
+        }
+    }
+
+#if (REDIS_HAVE_SSE2)
+    __builtin_cpu_init();
+
+    crc16_handler = (__builtin_cpu_supports("pclmul")
+                     && __builtin_cpu_supports("ssse3"))
+                    ? crc16_clmul : crc16_table;
+#else
+    crc16_handler = crc16_table;
+#endif
+
+    return crc16_handler(p, len);
+}
+
+
+static ngx_inline uint16_t
+crc16(const u_char *buf, size_t len)
+{
+    return crc16_handler(buf, len);
+}
+
+
 /* We have 16384 hash slots. The hash slot of a given key is obtained
  * as the least significant 14 bits of the crc16 of the key.
  *
  * However if the key contains the {...} pattern, only the part between
  * { and } is hashed. This may be useful in the future to force certain
  * keys to be in the same node (assuming no resharding is in progress). */
-static unsigned int
-key_hash_slot(char *key, int keylen) {
-    int s, e; /* start-end indexes of { and } */
+static ngx_inline uint16_t
+key_hash_slot(const u_char *key, size_t keylen)
+{
+    const u_char  *s, *e;
 
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
+    s = memchr(key, '{', keylen);
 
-    /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+    if (s != NULL) {
+        s++;
+        e = memchr(s, '}', key + keylen - s);
 
-    /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
+        /* nothing between {} ? Hash the whole key. */
+        if (e != NULL && e != s) {
+            return crc16(s, e - s) & 0x3FFF;
+        }
+    }
+
+    return crc16(key, keylen) & 0x3FFF;
+}
 
-    /* No '}' or nothing betweeen {} ? Hash the whole key. */
-    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
 
-    /* If we are here there is both a { and a } on its right. Hash
-     * what is in the middle between { and }. */
-    return crc16(key+s+1,e-s-1) & 0x3FFF;
+/*
+ * the slots of keys[0], keys[step], ... keys[(n - 1) * step], whose bytes
+ * are at base + pos; every key of a request is hashed here exactly once
+ */
+void
+redis_key_hash_slot_batch(u_char *base, ngx_stream_redis_arg_t *keys,
+    ngx_uint_t n, ngx_uint_t step, uint16_t *slots)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+        slots[i] = key_hash_slot(base + keys->pos, keys->len);
+        keys += step;
+    }
 }
 
-static size_t
-redis_get_num_size(uint64_t i)
+
+/* FNV-1a, wide enough to tell keys apart in tables that keep no key bytes */
+uint64_t
+redis_key_hash(u_char *key, size_t len)
 {
-    size_t          n = 0;
+    uint64_t  h;
 
-    do {
-        i = i / 10;
-        n++;
-    } while (i > 0);
+    h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= *key++;
+        h *= 0x100000001b3ULL;
+    }
 
-    return n;
+    return h;
 }
 
-static ngx_int_t
-redis_parse_bulk(char *rdata, ssize_t rdata_len)
+
+/*
+ * every command the proxy forwards or answers; the keys of a request are
+ * read off its entry, so supporting a command is adding a line here.
+ * ZINTERSTORE and ZUNIONSTORE are routed by their destination key, the
+ * node rejects source keys in other slots itself
+ */
+#define redis_command(name, type, first, last, step, flags, keys, aggr)     \
+    { ngx_string(name), MSG_REQ_REDIS_##type, first, last, step,           \
+      NGX_STREAM_REDIS_CMD_##flags, NGX_STREAM_REDIS_KEYS_##keys,          \
+      NGX_STREAM_REDIS_AGGR_##aggr }
+
+static ngx_stream_redis_command_t  redis_commands[] = {
+    redis_command("del",             DEL,              1, -1, 1, WRITE,    SPLIT, SUM),
+    redis_command("exists",          EXISTS,           1, -1, 1, READONLY, SPLIT, SUM),
+    redis_command("expire",          EXPIRE,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("expireat",        EXPIREAT,         1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("pexpire",         PEXPIRE,          1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("pexpireat",       PEXPIREAT,        1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("persist",         PERSIST,          1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("pttl",            PTTL,             1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("sort",            SORT,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("ttl",             TTL,              1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("type",            TYPE,             1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("unlink",          UNLINK,           1, -1, 1, WRITE,    SPLIT, SUM),
+    redis_command("touch",           TOUCH,            1, -1, 1, READONLY, SPLIT, SUM),
+
+    redis_command("append",          APPEND,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("bitcount",        BITCOUNT,         1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("bitpos",          BITPOS,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("decr",            DECR,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("decrby",          DECRBY,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("dump",            DUMP,             1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("get",             GET,              1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("getbit",          GETBIT,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("getrange",        GETRANGE,         1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("getset",          GETSET,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("incr",            INCR,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("incrby",          INCRBY,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("incrbyfloat",     INCRBYFLOAT,      1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("mget",            MGET,             1, -1, 1, READONLY, SPLIT, ARRAY),
+    redis_command("mset",            MSET,             1, -1, 2, WRITE,    SPLIT, OK),
+    redis_command("msetnx",          MSETNX,           1, -1, 2, WRITE,    SLOT,  NONE),
+    redis_command("psetex",          PSETEX,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("restore",         RESTORE,          1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("set",             SET,              1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("setbit",          SETBIT,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("setex",           SETEX,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("setnx",           SETNX,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("setrange",        SETRANGE,         1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("strlen",          STRLEN,           1,  1, 1, READONLY, SLOT,  NONE),
+
+    redis_command("hdel",            HDEL,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("hexists",         HEXISTS,          1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hget",            HGET,             1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hgetall",         HGETALL,          1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hincrby",         HINCRBY,          1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("hincrbyfloat",    HINCRBYFLOAT,     1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("hkeys",           HKEYS,            1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hlen",            HLEN,             1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hmget",           HMGET,            1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hmset",           HMSET,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("hset",            HSET,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("hsetnx",          HSETNX,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("hscan",           HSCAN,            1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("hvals",           HVALS,            1,  1, 1, READONLY, SLOT,  NONE),
+
+    redis_command("lindex",          LINDEX,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("linsert",         LINSERT,          1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("llen",            LLEN,             1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("lpop",            LPOP,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("lpush",           LPUSH,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("lpushx",          LPUSHX,           1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("lrange",          LRANGE,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("lrem",            LREM,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("lset",            LSET,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("ltrim",           LTRIM,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("rpop",            RPOP,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("rpoplpush",       RPOPLPUSH,        1,  2, 1, WRITE,    SLOT,  NONE),
+    redis_command("rpush",           RPUSH,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("rpushx",          RPUSHX,           1,  1, 1, WRITE,    SLOT,  NONE),
+
+    redis_command("pfadd",           PFADD,            1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("pfcount",         PFCOUNT,          1, -1, 1, READONLY, SLOT,  NONE),
+    redis_command("pfmerge",         PFMERGE,          1, -1, 1, WRITE,    SLOT,  NONE),
+
+    redis_command("sadd",            SADD,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("scard",           SCARD,            1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("sdiff",           SDIFF,            1, -1, 1, READONLY, SLOT,  NONE),
+    redis_command("sdiffstore",      SDIFFSTORE,       1, -1, 1, WRITE,    SLOT,  NONE),
+    redis_command("sinter",          SINTER,           1, -1, 1, READONLY, SLOT,  NONE),
+    redis_command("sinterstore",     SINTERSTORE,      1, -1, 1, WRITE,    SLOT,  NONE),
+    redis_command("sismember",       SISMEMBER,        1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("smembers",        SMEMBERS,         1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("smove",           SMOVE,            1,  2, 1, WRITE,    SLOT,  NONE),
+    redis_command("spop",            SPOP,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("srandmember",     SRANDMEMBER,      1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("srem",            SREM,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("sunion",          SUNION,           1, -1, 1, READONLY, SLOT,  NONE),
+    redis_command("sunionstore",     SUNIONSTORE,      1, -1, 1, WRITE,    SLOT,  NONE),
+    redis_command("sscan",           SSCAN,            1,  1, 1, READONLY, SLOT,  NONE),
+
+    redis_command("zadd",            ZADD,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zcard",           ZCARD,            1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zcount",          ZCOUNT,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zincrby",         ZINCRBY,          1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zinterstore",     ZINTERSTORE,      1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zlexcount",       ZLEXCOUNT,        1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrange",          ZRANGE,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrangebylex",     ZRANGEBYLEX,      1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrangebyscore",   ZRANGEBYSCORE,    1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrank",           ZRANK,            1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrem",            ZREM,             1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zremrangebyrank", ZREMRANGEBYRANK,  1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zremrangebylex",  ZREMRANGEBYLEX,   1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zremrangebyscore",ZREMRANGEBYSCORE, 1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zrevrange",       ZREVRANGE,        1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrevrangebyscore",ZREVRANGEBYSCORE, 1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zrevrank",        ZREVRANK,         1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zscore",          ZSCORE,           1,  1, 1, READONLY, SLOT,  NONE),
+    redis_command("zunionstore",     ZUNIONSTORE,      1,  1, 1, WRITE,    SLOT,  NONE),
+    redis_command("zscan",           ZSCAN,            1,  1, 1, READONLY, SLOT,  NONE),
+
+    redis_command("eval",            EVAL,             3,  0, 1, WRITE,    SLOT,  NONE),
+    redis_command("evalsha",         EVALSHA,          3,  0, 1, WRITE,    SLOT,  NONE),
+
+    redis_command("ping",            PING,             0,  0, 0, LOCAL,    NONE,  NONE),
+    redis_command("quit",            QUIT,             0,  0, 0, LOCAL,    NONE,  NONE),
+    redis_command("auth",            AUTH,             0,  0, 0, LOCAL,    NONE,  NONE),
+    redis_command("hotkeys",         HOTKEYS,          0,  0, 0, LOCAL,    NONE,  NONE),
+};
+
+
+/*
+ * the multiplier is picked so that no two names above, nor the usual
+ * candidates for the table, share a bucket, so a lookup is one hash and
+ * one compare; a name that does collide later costs a probe, not a miss
+ */
+#define REDIS_COMMAND_HASH_MUL      7663
+#define REDIS_COMMAND_HASH_SIZE     1024
+
+/* 1 + index into redis_commands, 0 for an empty bucket */
+static uint8_t     redis_command_index[REDIS_COMMAND_HASH_SIZE];
+static ngx_uint_t  redis_command_indexed;
+
+
+static ngx_inline ngx_uint_t
+redis_command_hash(const u_char *m, size_t len)
 {
-    //$3\r\nabc\r\n
-    int                             len = 1;
-    int                             bulklen;
-    char                            *rest;
+    uint32_t  h;
 
-    bulklen = strtol(rdata, &rest, 0);
-    if ( bulklen == -1 ) {
-        return NGX_OK;
+    h = 0;
+
+    while (len--) {
+        h = h * REDIS_COMMAND_HASH_MUL + (*m++ | 0x20);
     }
 
-    len += redis_get_num_size(bulklen);
-    rest += 2, len += 2;
-    rest += (bulklen + 2), len += (bulklen + 2);
+    return (h >> 8) & (REDIS_COMMAND_HASH_SIZE - 1);
+}
+
 
-    if ( len > rdata_len ) {
-        return NGX_AGAIN;
+static void
+redis_command_init(void)
+{
+    ngx_uint_t  i, k;
+
+    for (i = 0; i < sizeof(redis_commands) / sizeof(redis_commands[0]); i++) {
+        k = redis_command_hash(redis_commands[i].name.data,
+                               redis_commands[i].name.len);
+
+        while (redis_command_index[k]) {
+            k = (k + 1) & (REDIS_COMMAND_HASH_SIZE - 1);
+        }
+
+        redis_command_index[k] = (uint8_t) (i + 1);
     }
 
-    return NGX_OK;
+    redis_command_indexed = 1;
 }
 
-static ngx_int_t
-redis_parse_multibulk(char *rdata, ssize_t rdata_len)
+
+const ngx_stream_redis_command_t *
+redis_command_lookup(u_char *m, size_t len)
 {
-    //*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$7\r\nmyvalue\r\n
-    int                             len = 1;
-    int                             multibulkSize,i,bulklen;
-    char                            *rest;
-
-    multibulkSize = strtol(rdata, &rest, 0);
-
-    len += 2;
-    rest += 2;
-    i = 0;
-    while (i < multibulkSize)       /* For each element in multibulk data */
-    {
-        if ( len > rdata_len ) {
-            return NGX_AGAIN;
-        }
+    ngx_uint_t                   k;
+    ngx_stream_redis_command_t  *cmd;
+
+    if (!redis_command_indexed) {
+        redis_command_init();
+    }
+
+    k = redis_command_hash(m, len);
 
-        rest++,len++;                           /* Step through $ */
-        bulklen = strtol(rest, &rest, 0); /* Get an element length */
-        if (bulklen == -1)                /* If the element length is -1 then element is NULL */
+    while (redis_command_index[k]) {
+        cmd = &redis_commands[redis_command_index[k] - 1];
+
+        if (cmd->name.len == len
+            && ngx_strncasecmp(cmd->name.data, m, len) == 0)
         {
-          i++;
-          continue;
+            return cmd;
         }
 
-        len += redis_get_num_size(bulklen);
-        rest += 2, len += 2;                                    /* Step through "\r\n" */
-        rest += (bulklen + 2), len += (bulklen + 2);            /* Jump to the end of data bypassing "\r\n" */
+        k = (k + 1) & (REDIS_COMMAND_HASH_SIZE - 1);
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * terminator scanning shared by the request and reply parsers; the
+ * vector versions never load past last, the tail is done bytewise, and
+ * the implementation is picked on first use from what the CPU supports
+ */
+
+typedef u_char *(*redis_scan_pt)(u_char *p, u_char *last, u_char c);
+
+static u_char *redis_scan_resolve(u_char *p, u_char *last, u_char c);
+
+static redis_scan_pt  redis_scan_handler = redis_scan_resolve;
 
-        i++;
+
+static u_char *
+redis_scan_scalar(u_char *p, u_char *last, u_char c)
+{
+    while (p < last) {
+
+        if (*p == c) {
+            return p;
+        }
+
+        p++;
     }
 
-    return NGX_OK;
+    return NULL;
 }
 
 
+#if (REDIS_HAVE_SSE2)
 
-ngx_int_t
-redis_proto_decode(char *rdata, ssize_t len)
+static u_char *
+redis_scan_sse2(u_char *p, u_char *last, u_char c)
 {
-    switch (*rdata)
-    {
-        case '-' :
-        case '+' :
-        case ':' :
-            return NGX_OK;
-        case '$' :
-            return redis_parse_bulk(++rdata, len);
-        case '*' :
-            return redis_parse_multibulk(++rdata, len);
-        default :
-            return NGX_ERROR;
+    int       mask;
+    __m128i   needle, chunk;
+
+    needle = _mm_set1_epi8((char) c);
+
+    while (last - p >= 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
     }
+
+    return redis_scan_scalar(p, last, c);
 }
 
 
-static msg_type_t
-redis_command_req(const char* m, size_t len)
+__attribute__((target("avx2")))
+static u_char *
+redis_scan_avx2(u_char *p, u_char *last, u_char c)
 {
-    msg_type_t type = MSG_UNKNOWN;
+    int       mask;
+    __m256i   needle, chunk;
 
-     switch (len) {
-        case 3:
-            if (str3icmp(m, 'g', 'e', 't')) {
-                type = MSG_REQ_REDIS_GET;
-                break;
-            }
+    needle = _mm256_set1_epi8((char) c);
 
-            if (str3icmp(m, 's', 'e', 't')) {
-                type = MSG_REQ_REDIS_SET;
-                break;
-            }
+    while (last - p >= 32) {
+        chunk = _mm256_loadu_si256((const __m256i *) p);
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
 
-            if (str3icmp(m, 't', 't', 'l')) {
-                type = MSG_REQ_REDIS_TTL;
-                break;
-            }
+        if (mask) {
+            return p + __builtin_ctz((unsigned int) mask);
+        }
 
-            if (str3icmp(m, 'd', 'e', 'l')) {
-                type = MSG_REQ_REDIS_DEL;
-                break;
-            }
+        p += 32;
+    }
 
-            break;
+    return redis_scan_sse2(p, last, c);
+}
 
-        case 4:
-            if (str4icmp(m, 'p', 't', 't', 'l')) {
-                type = MSG_REQ_REDIS_PTTL;
-                break;
-            }
+#endif
 
-            if (str4icmp(m, 'd', 'e', 'c', 'r')) {
-                type = MSG_REQ_REDIS_DECR;
-                break;
-            }
 
-            if (str4icmp(m, 'd', 'u', 'm', 'p')) {
-                type = MSG_REQ_REDIS_DUMP;
-                break;
-            }
+static u_char *
+redis_scan_resolve(u_char *p, u_char *last, u_char c)
+{
+#if (REDIS_HAVE_SSE2)
+    __builtin_cpu_init();
 
-            if (str4icmp(m, 'h', 'd', 'e', 'l')) {
-                type = MSG_REQ_REDIS_HDEL;
-                break;
-            }
+    redis_scan_handler = __builtin_cpu_supports("avx2") ? redis_scan_avx2
+                                                        : redis_scan_sse2;
+#else
+    redis_scan_handler = redis_scan_scalar;
+#endif
 
-            if (str4icmp(m, 'h', 'g', 'e', 't')) {
-                type = MSG_REQ_REDIS_HGET;
-                break;
-            }
+    return redis_scan_handler(p, last, c);
+}
 
-            if (str4icmp(m, 'h', 'l', 'e', 'n')) {
-                type = MSG_REQ_REDIS_HLEN;
-                break;
-            }
 
-            if (str4icmp(m, 'h', 's', 'e', 't')) {
-                type = MSG_REQ_REDIS_HSET;
-                break;
-            }
+/* like ngx_strlchr(), the first c in [p, last) or NULL */
+u_char *
+redis_scan(u_char *p, u_char *last, u_char c)
+{
+    /* most lines are short, a vector load would not pay off */
 
-            if (str4icmp(m, 'i', 'n', 'c', 'r')) {
-                type = MSG_REQ_REDIS_INCR;
-                break;
-            }
+    if (last - p < 16) {
+        return redis_scan_scalar(p, last, c);
+    }
 
-            if (str4icmp(m, 'l', 'l', 'e', 'n')) {
-                type = MSG_REQ_REDIS_LLEN;
-                break;
-            }
+    return redis_scan_handler(p, last, c);
+}
 
-            if (str4icmp(m, 'l', 'p', 'o', 'p')) {
-                type = MSG_REQ_REDIS_LPOP;
-                break;
-            }
 
-            if (str4icmp(m, 'l', 'r', 'e', 'm')) {
-                type = MSG_REQ_REDIS_LREM;
-                break;
-            }
+/*
+ * consumes a run of decimal digits into *n, returns the first byte that
+ * is not a digit or last, NULL if the value grows past max; length
+ * prefixes are a few bytes long, so this stays a tight scalar loop
+ */
+static ngx_inline u_char *
+redis_scan_number(u_char *p, u_char *last, size_t *n, size_t max)
+{
+    size_t  value;
 
-            if (str4icmp(m, 'l', 's', 'e', 't')) {
-                type = MSG_REQ_REDIS_LSET;
-                break;
-            }
+    value = *n;
 
-            if (str4icmp(m, 'r', 'p', 'o', 'p')) {
-                type = MSG_REQ_REDIS_RPOP;
-                break;
-            }
+    while (p < last && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
 
-            if (str4icmp(m, 's', 'a', 'd', 'd')) {
-                type = MSG_REQ_REDIS_SADD;
-                break;
-            }
+        if (value > max) {
+            return NULL;
+        }
+    }
 
-            if (str4icmp(m, 's', 'p', 'o', 'p')) {
-                type = MSG_REQ_REDIS_SPOP;
-                break;
-            }
+    *n = value;
 
-            if (str4icmp(m, 's', 'r', 'e', 'm')) {
-                type = MSG_REQ_REDIS_SREM;
-                break;
-            }
+    return p;
+}
 
-            if (str4icmp(m, 't', 'y', 'p', 'e')) {
-                type = MSG_REQ_REDIS_TYPE;
-                break;
-            }
 
-            if (str4icmp(m, 'm', 'g', 'e', 't')) {
-                type = MSG_REQ_REDIS_MGET;
-                break;
-            }
-            if (str4icmp(m, 'm', 's', 'e', 't')) {
-                type = MSG_REQ_REDIS_MSET;
-                break;
-            }
+#define REDIS_REQ_MAX_ARGS          (1024 * 1024)
+#define REDIS_REQ_MAX_BULK          (512 * 1024 * 1024)
 
-            if (str4icmp(m, 'z', 'a', 'd', 'd')) {
-                type = MSG_REQ_REDIS_ZADD;
-                break;
-            }
 
-            if (str4icmp(m, 'z', 'r', 'e', 'm')) {
-                type = MSG_REQ_REDIS_ZREM;
-                break;
-            }
+/*
+ * frames one request starting at b->pos; the parser keeps its state and
+ * the offset reached in p, so bytes scanned on an earlier read are never
+ * looked at again, and argument offsets are relative to b->pos so that
+ * they survive buffer compaction
+ */
+static ngx_int_t
+redis_parse_req_frame(ngx_buf_t *b, ngx_stream_redis_parser_t *p)
+{
+    u_char                  ch, *pos, *last;
+    size_t                  n;
+    ngx_stream_redis_arg_t *arg;
 
-            if (str4icmp(m, 'e', 'v', 'a', 'l')) {
-                type = MSG_REQ_REDIS_EVAL;
-                break;
-            }
+    enum {
+        sw_start = 0,
+        sw_argc,
+        sw_argc_lf,
+        sw_bulk,
+        sw_bulk_len,
+        sw_bulk_len_lf,
+        sw_bulk_data,
+        sw_bulk_cr,
+        sw_bulk_lf,
+        sw_inline,
+        sw_inline_arg
+    } state;
 
-            if (str4icmp(m, 's', 'o', 'r', 't')) {
-                type = MSG_REQ_REDIS_SORT;
+    state = p->state;
+    pos = b->pos + p->offset;
+    last = b->last;
+
+    while (pos < last) {
+
+        ch = *pos;
+
+        switch (state) {
+
+        case sw_start:
+            p->nargs = 0;
+            p->number = 0;
+            p->args.nelts = 0;
+
+            if (ch == '*') {
+                state = sw_argc;
                 break;
             }
 
-            if (str4icmp(m, 'p', 'i', 'n', 'g')) {
-                type = MSG_REQ_REDIS_PING;
-                break;
+            // inline 命令按空格切分参数
+            state = sw_inline;
+            continue;
+
+        case sw_argc:
+            pos = redis_scan_number(pos, last, &p->number, REDIS_REQ_MAX_ARGS);
+            if (pos == NULL) {
+                return NGX_ERROR;
             }
 
-            if (str4icmp(m, 'q', 'u', 'i', 't')) {
-                type = MSG_REQ_REDIS_QUIT;
-                break;
+            if (pos == last) {
+                continue;
             }
 
-            if (str4icmp(m, 'a', 'u', 't', 'h')) {
-                type = MSG_REQ_REDIS_AUTH;
-                break;
+            if (*pos != CR || p->number == 0) {
+                return NGX_ERROR;
             }
 
+            p->nargs = p->number;
+            state = sw_argc_lf;
             break;
 
-        case 5:
-            if (str5icmp(m, 'h', 'k', 'e', 'y', 's')) {
-                type = MSG_REQ_REDIS_HKEYS;
-                break;
+        case sw_argc_lf:
+            if (ch != LF) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 'h', 'm', 'g', 'e', 't')) {
-                type = MSG_REQ_REDIS_HMGET;
-                break;
-            }
+            state = sw_bulk;
+            break;
 
-            if (str5icmp(m, 'h', 'm', 's', 'e', 't')) {
-                type = MSG_REQ_REDIS_HMSET;
-                break;
+        case sw_bulk:
+            if (ch != '$') {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 'h', 'v', 'a', 'l', 's')) {
-                type = MSG_REQ_REDIS_HVALS;
-                break;
-            }
+            p->number = 0;
+            state = sw_bulk_len;
+            break;
 
-            if (str5icmp(m, 'h', 's', 'c', 'a', 'n')) {
-                type = MSG_REQ_REDIS_HSCAN;
-                break;
+        case sw_bulk_len:
+            pos = redis_scan_number(pos, last, &p->number, REDIS_REQ_MAX_BULK);
+            if (pos == NULL) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 'l', 'p', 'u', 's', 'h')) {
-                type = MSG_REQ_REDIS_LPUSH;
-                break;
+            if (pos == last) {
+                continue;
             }
 
-            if (str5icmp(m, 'l', 't', 'r', 'i', 'm')) {
-                type = MSG_REQ_REDIS_LTRIM;
-                break;
+            if (*pos != CR) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 'r', 'p', 'u', 's', 'h')) {
-                type = MSG_REQ_REDIS_RPUSH;
-                break;
-            }
+            state = sw_bulk_len_lf;
+            break;
 
-            if (str5icmp(m, 's', 'c', 'a', 'r', 'd')) {
-                type = MSG_REQ_REDIS_SCARD;
-                break;
+        case sw_bulk_len_lf:
+            if (ch != LF) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 's', 'd', 'i', 'f', 'f')) {
-                type = MSG_REQ_REDIS_SDIFF;
-                break;
+            arg = ngx_array_push(&p->args);
+            if (arg == NULL) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 's', 'e', 't', 'e', 'x')) {
-                type = MSG_REQ_REDIS_SETEX;
-                break;
-            }
+            arg->pos = pos + 1 - b->pos;
+            arg->len = p->number;
 
-            if (str5icmp(m, 's', 'e', 't', 'n', 'x')) {
-                type = MSG_REQ_REDIS_SETNX;
-                break;
-            }
+            state = sw_bulk_data;
+            break;
 
-            if (str5icmp(m, 's', 'm', 'o', 'v', 'e')) {
-                type = MSG_REQ_REDIS_SMOVE;
-                break;
-            }
+        case sw_bulk_data:
+            // 参数内容整段跳过, 不逐字节扫描
+            n = last - pos;
 
-            if (str5icmp(m, 's', 's', 'c', 'a', 'n')) {
-                type = MSG_REQ_REDIS_SSCAN;
-                break;
+            if (n < p->number) {
+                p->number -= n;
+                pos = last;
+                continue;
             }
 
-            if (str5icmp(m, 'z', 'c', 'a', 'r', 'd')) {
-                type = MSG_REQ_REDIS_ZCARD;
-                break;
-            }
+            pos += p->number;
+            state = sw_bulk_cr;
+            continue;
 
-            if (str5icmp(m, 'z', 'r', 'a', 'n', 'k')) {
-                type = MSG_REQ_REDIS_ZRANK;
-                break;
+        case sw_bulk_cr:
+            if (ch != CR) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 'z', 's', 'c', 'a', 'n')) {
-                type = MSG_REQ_REDIS_ZSCAN;
-                break;
+            state = sw_bulk_lf;
+            break;
+
+        case sw_bulk_lf:
+            if (ch != LF) {
+                return NGX_ERROR;
             }
 
-            if (str5icmp(m, 'p', 'f', 'a', 'd', 'd')) {
-                type = MSG_REQ_REDIS_PFADD;
-                break;
+            if (p->args.nelts == p->nargs) {
+                pos++;
+                goto done;
             }
 
+            state = sw_bulk;
             break;
 
-        case 6:
-            if (str6icmp(m, 'a', 'p', 'p', 'e', 'n', 'd')) {
-                type = MSG_REQ_REDIS_APPEND;
-                break;
+        case sw_inline:
+            if (ch == LF) {
+                if (p->args.nelts == 0) {
+                    return NGX_ERROR;
+                }
+
+                pos++;
+                goto done;
             }
 
-            if (str6icmp(m, 'b', 'i', 't', 'p', 'o', 's')) {
-                type = MSG_REQ_REDIS_BITPOS;
+            if (ch == ' ' || ch == CR) {
                 break;
             }
 
-            if (str6icmp(m, 'd', 'e', 'c', 'r', 'b', 'y')) {
-                type = MSG_REQ_REDIS_DECRBY;
-                break;
+            arg = ngx_array_push(&p->args);
+            if (arg == NULL) {
+                return NGX_ERROR;
             }
 
-            if (str6icmp(m, 'e', 'x', 'i', 's', 't', 's')) {
-                type = MSG_REQ_REDIS_EXISTS;
-                break;
-            }
+            arg->pos = pos - b->pos;
+            arg->len = 0;
 
-            if (str6icmp(m, 'e', 'x', 'p', 'i', 'r', 'e')) {
-                type = MSG_REQ_REDIS_EXPIRE;
-                break;
-            }
+            state = sw_inline_arg;
+            continue;
 
-            if (str6icmp(m, 'g', 'e', 't', 'b', 'i', 't')) {
-                type = MSG_REQ_REDIS_GETBIT;
-                break;
+        case sw_inline_arg:
+            if (ch == ' ' || ch == CR || ch == LF) {
+                state = sw_inline;
+                continue;
             }
 
-            if (str6icmp(m, 'g', 'e', 't', 's', 'e', 't')) {
-                type = MSG_REQ_REDIS_GETSET;
-                break;
-            }
+            arg = (ngx_stream_redis_arg_t *) p->args.elts + p->args.nelts - 1;
+            arg->len++;
+            break;
+        }
 
-            if (str6icmp(m, 'p', 's', 'e', 't', 'e', 'x')) {
-                type = MSG_REQ_REDIS_PSETEX;
-                break;
-            }
+        pos++;
+    }
 
-            if (str6icmp(m, 'h', 's', 'e', 't', 'n', 'x')) {
-                type = MSG_REQ_REDIS_HSETNX;
-                break;
-            }
+    p->state = state;
+    p->offset = pos - b->pos;
 
-            if (str6icmp(m, 'i', 'n', 'c', 'r', 'b', 'y')) {
-                type = MSG_REQ_REDIS_INCRBY;
-                break;
-            }
+    return NGX_AGAIN;
 
-            if (str6icmp(m, 'l', 'i', 'n', 'd', 'e', 'x')) {
-                type = MSG_REQ_REDIS_LINDEX;
-                break;
-            }
+done:
 
-            if (str6icmp(m, 'l', 'p', 'u', 's', 'h', 'x')) {
-                type = MSG_REQ_REDIS_LPUSHX;
-                break;
-            }
+    p->state = sw_start;
+    p->offset = pos - b->pos;
 
-            if (str6icmp(m, 'l', 'r', 'a', 'n', 'g', 'e')) {
-                type = MSG_REQ_REDIS_LRANGE;
-                break;
-            }
+    return NGX_OK;
+}
 
-            if (str6icmp(m, 'r', 'p', 'u', 's', 'h', 'x')) {
-                type = MSG_REQ_REDIS_RPUSHX;
-                break;
-            }
 
-            if (str6icmp(m, 's', 'e', 't', 'b', 'i', 't')) {
-                type = MSG_REQ_REDIS_SETBIT;
-                break;
-            }
+static ngx_inline ngx_int_t
+redis_arg_slot(ngx_buf_t *b, ngx_stream_redis_parser_t *p, ngx_uint_t i)
+{
+    ngx_stream_redis_arg_t  *arg;
 
-            if (str6icmp(m, 's', 'i', 'n', 't', 'e', 'r')) {
-                type = MSG_REQ_REDIS_SINTER;
-                break;
-            }
+    arg = (ngx_stream_redis_arg_t *) p->args.elts + i;
 
-            if (str6icmp(m, 's', 't', 'r', 'l', 'e', 'n')) {
-                type = MSG_REQ_REDIS_STRLEN;
-                break;
-            }
+    return key_hash_slot(b->pos + arg->pos, arg->len);
+}
 
-            if (str6icmp(m, 's', 'u', 'n', 'i', 'o', 'n')) {
-                type = MSG_REQ_REDIS_SUNION;
-                break;
-            }
 
-            if (str6icmp(m, 'z', 'c', 'o', 'u', 'n', 't')) {
-                type = MSG_REQ_REDIS_ZCOUNT;
-                break;
-            }
+/*
+ * hashes the keys at first, first + step, ... below last into p->slots;
+ * the slot of a multi-key command is the slot of its first key, and
+ * ctx->crossslot is set when the keys do not all hash to it
+ */
+static ngx_int_t
+redis_parse_keys(ngx_stream_redis_proxy_ctx_t *ctx, ngx_uint_t first,
+    ngx_uint_t last, ngx_uint_t step)
+{
+    uint16_t                    *slots;
+    ngx_uint_t                   i, n;
+    ngx_stream_redis_parser_t   *p;
 
-            if (str6icmp(m, 'z', 'r', 'a', 'n', 'g', 'e')) {
-                type = MSG_REQ_REDIS_ZRANGE;
-                break;
-            }
+    p = &ctx->parser;
 
-            if (str6icmp(m, 'z', 's', 'c', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_ZSCORE;
-                break;
-            }
+    n = (last - first + step - 1) / step;
+
+    p->slots.nelts = 0;
 
+    slots = ngx_array_push_n(&p->slots, n);
+    if (slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    redis_key_hash_slot_batch(ctx->buffer_in->pos,
+                              (ngx_stream_redis_arg_t *) p->args.elts + first,
+                              n, step, slots);
+
+    ctx->slotid = slots[0];
+
+    for (i = 1; i < n; i++) {
+        if (slots[i] != slots[0]) {
+            ctx->crossslot = 1;
             break;
+        }
+    }
 
-        case 7:
-            if (str7icmp(m, 'p', 'e', 'r', 's', 'i', 's', 't')) {
-                type = MSG_REQ_REDIS_PERSIST;
-                break;
-            }
+    return NGX_OK;
+}
 
-            if (str7icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e')) {
-                type = MSG_REQ_REDIS_PEXPIRE;
-                break;
-            }
 
-            if (str7icmp(m, 'h', 'e', 'x', 'i', 's', 't', 's')) {
-                type = MSG_REQ_REDIS_HEXISTS;
-                break;
-            }
+ngx_int_t
+redis_parse_req(ngx_stream_session_t *s)
+{
+    ngx_int_t                           rc, nkeys, first, last;
+    ngx_uint_t                          argc;
+    ngx_buf_t                           *b;
+    ngx_stream_redis_arg_t              *args;
+    ngx_stream_redis_parser_t           *p;
+    ngx_stream_redis_proxy_ctx_t        *ctx;
+    const ngx_stream_redis_command_t    *cmd;
 
-            if (str7icmp(m, 'h', 'g', 'e', 't', 'a', 'l', 'l')) {
-                type = MSG_REQ_REDIS_HGETALL;
-                break;
-            }
+    ctx = (ngx_stream_redis_proxy_ctx_t *)ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
 
-            if (str7icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                type = MSG_REQ_REDIS_HINCRBY;
-                break;
-            }
+    b = ctx->buffer_in;
+    p = &ctx->parser;
+
+    rc = redis_parse_req_frame(b, p);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ctx->request_end = b->pos + p->offset;
+    p->offset = 0;
+
+    ctx->slotid = -1;
+    ctx->crossslot = 0;
+    p->nkeys = 0;
+
+    args = p->args.elts;
+    argc = p->args.nelts;
+
+    cmd = redis_command_lookup(b->pos + args[0].pos, args[0].len);
+    if (cmd == NULL) {
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "[redis_proxy] unsupported command \"%*s\"",
+                       args[0].len, b->pos + args[0].pos);
+        ctx->type = MSG_UNKNOWN;
+        return NGX_ERROR;
+    }
+
+    ctx->command = cmd;
+    ctx->type = cmd->type;
+
+    if (cmd->first == 0) {
+        //PING || QUIT || AUTH || HOTKEYS
+        return NGX_OK;
+    }
+
+    first = cmd->first;
+
+    if (cmd->last == 0) {
+        //EVAL script numkeys key... 按第一个 key 路由, 没有 key 时任选节点
+        if ((ngx_int_t) argc < first) {
+            return NGX_ERROR;
+        }
+
+        nkeys = ngx_atoi(b->pos + args[first - 1].pos, args[first - 1].len);
+        if (nkeys == NGX_ERROR || nkeys > (ngx_int_t) argc - first) {
+            return NGX_ERROR;
+        }
+
+        if (nkeys == 0) {
+            return NGX_OK;
+        }
+
+        last = first + nkeys - 1;
+
+    } else if (cmd->last < 0) {
+        last = argc + cmd->last;
+
+    } else {
+        last = cmd->last;
+    }
+
+    if (last >= (ngx_int_t) argc || last < first) {
+        return NGX_ERROR;
+    }
+
+    //MSET key value... 不能缺少最后一个 value
+    if ((last - first + 1) % cmd->step) {
+        return NGX_ERROR;
+    }
+
+    p->keys = first;
+    p->nkeys = (last - first) / cmd->step + 1;
+
+    if (first == last) {
+        ctx->slotid = redis_arg_slot(b, p, first);
+        return NGX_OK;
+    }
+
+    return redis_parse_keys(ctx, first, last + 1, cmd->step);
+}
+
+
+static msg_type_t
+redis_resp_error(u_char *data, u_char *last)
+{
+    ssize_t                   cmd_len;
+    u_char                    *p, *m;
+    msg_type_t                type;
+
+    m = data;
+    type = MSG_RSP_REDIS_ERROR;
+
+    p = redis_scan(data, last, ' ');
+    if ( p == NULL ) {
+        p = redis_scan(data, last, CR);
+        if ( p == NULL ) {
+            return type;
+        }
+    }
 
-            if (str7icmp(m, 'l', 'i', 'n', 's', 'e', 'r', 't')) {
-                type = MSG_REQ_REDIS_LINSERT;
+    cmd_len = p - data;
+
+    switch (cmd_len) {
+        case 4:
+            /*-ASK 1 127.0.0.1 */
+            if (str4cmp(m, '-', 'A', 'S', 'K')) {
+                type = MSG_RSP_REDIS_ERROR_ASK;
                 break;
             }
 
-            if (str7icmp(m, 'z', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                type = MSG_REQ_REDIS_ZINCRBY;
+            /*
+            * -ERR no such key\r\n
+            * -ERR syntax error\r\n
+            * -ERR source and destination objects are the same\r\n
+            * -ERR index out of range\r\n
+            */
+            if (str4cmp(m, '-', 'E', 'R', 'R')) {
+                type = MSG_RSP_REDIS_ERROR_ERR;
                 break;
             }
 
-            if (str7icmp(m, 'e', 'v', 'a', 'l', 's', 'h', 'a')) {
-                type = MSG_REQ_REDIS_EVALSHA;
+            /* -OOM command not allowed when used memory > 'maxmemory'.\r\n */
+            if (str4cmp(m, '-', 'O', 'O', 'M')) {
+                type = MSG_RSP_REDIS_ERROR_OOM;
                 break;
             }
 
-            if (str7icmp(m, 'r', 'e', 's', 't', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_RESTORE;
+            break;
+
+        case 5:
+            /* -BUSY Redis is busy running a script. You can only call SCRIPT KILL or SHUTDOWN NOSAVE.\r\n" */
+            if (str5cmp(m, '-', 'B', 'U', 'S', 'Y')) {
+                type = MSG_RSP_REDIS_ERROR_BUSY;
                 break;
             }
 
-            if (str7icmp(m, 'p', 'f', 'c', 'o', 'u', 'n', 't')) {
-                type = MSG_REQ_REDIS_PFCOUNT;
+            break;
+
+        case 6:
+            /* -MOVED 3999 127.0.0.1:6381 */
+            if (str6cmp(m, '-', 'M', 'O', 'V', 'E', 'D')) {
+                type = MSG_RSP_REDIS_ERROR_MOVED;
                 break;
             }
 
-            if (str7icmp(m, 'p', 'f', 'm', 'e', 'r', 'g', 'e')) {
-                type = MSG_REQ_REDIS_PFMERGE;
+            break;
+
+        case 7:
+            /* -NOAUTH Authentication required.\r\n */
+            if (str7cmp(m, '-', 'N', 'O', 'A', 'U', 'T', 'H')) {
+                type = MSG_RSP_REDIS_ERROR_NOAUTH;
                 break;
             }
 
             break;
 
         case 8:
-            if (str8icmp(m, 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                type = MSG_REQ_REDIS_EXPIREAT;
+            /* rsp: "-LOADING Redis is loading the dataset in memory\r\n" */
+            if (str8cmp(m, '-', 'L', 'O', 'A', 'D', 'I', 'N', 'G')) {
+                type = MSG_RSP_REDIS_ERROR_LOADING;
                 break;
             }
 
-            if (str8icmp(m, 'b', 'i', 't', 'c', 'o', 'u', 'n', 't')) {
-                type = MSG_REQ_REDIS_BITCOUNT;
+            /* -BUSYKEY Target key name already exists.\r\n */
+            if (str8cmp(m, '-', 'B', 'U', 'S', 'Y', 'K', 'E', 'Y')) {
+                type = MSG_RSP_REDIS_ERROR_BUSYKEY;
                 break;
             }
 
-            if (str8icmp(m, 'g', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                type = MSG_REQ_REDIS_GETRANGE;
+            /* "-MISCONF Redis is configured to save RDB snapshots, but is currently not able to persist on disk. Commands that may modify the data set are disabled. Please check Redis logs for details about the error.\r\n" */
+            if (str8cmp(m, '-', 'M', 'I', 'S', 'C', 'O', 'N', 'F')) {
+                type = MSG_RSP_REDIS_ERROR_MISCONF;
                 break;
             }
 
-            if (str8icmp(m, 's', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                type = MSG_REQ_REDIS_SETRANGE;
+            break;
+
+        case 9:
+            /*-TRYAGAIN */
+            if (str9cmp(m, '-', 'T', 'R', 'Y', 'A', 'G', 'A', 'I', 'N')) {
+                type = MSG_RSP_REDIS_ERROR_TRYAGAIN;
                 break;
             }
 
-            if (str8icmp(m, 's', 'm', 'e', 'm', 'b', 'e', 'r', 's')) {
-                type = MSG_REQ_REDIS_SMEMBERS;
+            /* -NOSCRIPT No matching script. Please use EVAL.\r\n */
+            if (str9cmp(m, '-', 'N', 'O', 'S', 'C', 'R', 'I', 'P', 'T')) {
+                type = MSG_RSP_REDIS_ERROR_NOSCRIPT;
                 break;
             }
 
-            if (str8icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'k')) {
-                type = MSG_REQ_REDIS_ZREVRANK;
+            /* -READONLY You can't write against a read only slave.\r\n */
+            if (str9cmp(m, '-', 'R', 'E', 'A', 'D', 'O', 'N', 'L', 'Y')) {
+                type = MSG_RSP_REDIS_ERROR_READONLY;
                 break;
             }
 
             break;
 
-        case 9:
-            if (str9icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                type = MSG_REQ_REDIS_PEXPIREAT;
+        case 10:
+            /* -WRONGTYPE Operation against a key holding the wrong kind of value\r\n */
+            if (str10cmp(m, '-', 'W', 'R', 'O', 'N', 'G', 'T', 'Y', 'P', 'E')) {
+                type = MSG_RSP_REDIS_ERROR_WRONGTYPE;
                 break;
             }
 
-            if (str9icmp(m, 'r', 'p', 'o', 'p', 'l', 'p', 'u', 's', 'h')) {
-                type = MSG_REQ_REDIS_RPOPLPUSH;
+            /* -EXECABORT Transaction discarded because of previous errors.\r\n" */
+            if (str10cmp(m, '-', 'E', 'X', 'E', 'C', 'A', 'B', 'O', 'R', 'T')) {
+                type = MSG_RSP_REDIS_ERROR_EXECABORT;
                 break;
             }
 
-            if (str9icmp(m, 's', 'i', 's', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                type = MSG_REQ_REDIS_SISMEMBER;
-                break;
-            }
+            break;
 
-            if (str9icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e')) {
-                type = MSG_REQ_REDIS_ZREVRANGE;
+        case 11:
+            /* -MASTERDOWN Link with MASTER is down and slave-serve-stale-data is set to 'no'.\r\n */
+            if (str11cmp(m, '-', 'M', 'A', 'S', 'T', 'E', 'R', 'D', 'O', 'W', 'N')) {
+                type = MSG_RSP_REDIS_ERROR_MASTERDOWN;
                 break;
             }
 
-            if (str9icmp(m, 'z', 'l', 'e', 'x', 'c', 'o', 'u', 'n', 't')) {
-                type = MSG_REQ_REDIS_ZLEXCOUNT;
+            /* -NOREPLICAS Not enough good slaves to write.\r\n */
+            if (str11cmp(m, '-', 'N', 'O', 'R', 'E', 'P', 'L', 'I', 'C', 'A', 'S')) {
+                type = MSG_RSP_REDIS_ERROR_NOREPLICAS;
                 break;
             }
 
             break;
+    }
 
-        case 10:
-            if (str10icmp(m, 's', 'd', 'i', 'f', 'f', 's', 't', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_SDIFFSTORE;
-                break;
+    return type;
+}
+
+
+
+/*
+ * frames one reply starting at b->pos; like the request parser it resumes
+ * from p->offset, and open aggregates are tracked on an explicit stack
+ * instead of by recursion, so a reply arriving in many reads is scanned
+ * once; RESP3 types are framed too, attributes are passed through with
+ * the value they annotate
+ */
+ngx_int_t
+redis_parse_rsp(ngx_buf_t *b, redis_rsp_parser_t *p, u_char **end,
+    msg_type_t *type)
+{
+    u_char                             ch, *pos, *last, *value;
+    size_t                             n;
+
+    enum {
+        sw_type = 0,
+        sw_line,
+        sw_line_lf,
+        sw_len,
+        sw_len_lf,
+        sw_data,
+        sw_data_cr,
+        sw_data_lf
+    } state;
+
+    state = p->state;
+    pos = b->pos + p->offset;
+    last = b->last;
+
+    while (pos < last) {
+
+        ch = *pos;
+
+        switch (state) {
+
+        case sw_type:
+            p->type = ch;
+            p->number = 0;
+            p->negative = 0;
+
+            if (p->depth == 0 && ch != '|') {
+                p->start = pos - b->pos;
             }
 
-        case 11:
-            if (str11icmp(m, 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                type = MSG_REQ_REDIS_INCRBYFLOAT;
+            switch (ch) {
+
+            case '+':
+            case '-':
+            case ':':
+            case '_':
+            case ',':
+            case '#':
+            case '(':
+                state = sw_line;
                 break;
-            }
 
-            if (str11icmp(m, 's', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_SINTERSTORE;
+            case '$':
+            case '!':
+            case '=':
+            case '*':
+            case '%':
+            case '~':
+            case '>':
+            case '|':
+                state = sw_len;
                 break;
+
+            default:
+                return NGX_ERROR;
             }
 
-            if (str11icmp(m, 's', 'r', 'a', 'n', 'd', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                type = MSG_REQ_REDIS_SRANDMEMBER;
-                break;
+            break;
+
+        case sw_line:
+            value = redis_scan(pos, last, CR);
+            if (value == NULL) {
+                pos = last;
+                continue;
             }
 
-            if (str11icmp(m, 's', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_SUNIONSTORE;
-                break;
+            pos = value;
+            state = sw_line_lf;
+            break;
+
+        case sw_line_lf:
+            if (ch != LF) {
+                return NGX_ERROR;
             }
 
-            if (str11icmp(m, 'z', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_ZINTERSTORE;
+            goto value_done;
+
+        case sw_len:
+            if (ch == '-' && p->number == 0 && !p->negative) {
+                p->negative = 1;
                 break;
             }
 
-            if (str11icmp(m, 'z', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_ZUNIONSTORE;
-                break;
+            pos = redis_scan_number(pos, last, &p->number,
+                                    NGX_MAX_INT32_VALUE);
+            if (pos == NULL) {
+                return NGX_ERROR;
             }
 
-            if (str11icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                type = MSG_REQ_REDIS_ZRANGEBYLEX;
-                break;
+            if (pos == last) {
+                continue;
+            }
+
+            if (*pos != CR || (p->negative && p->number != 1)) {
+                return NGX_ERROR;
             }
 
+            state = sw_len_lf;
             break;
 
-        case 12:
-            if (str12icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                type = MSG_REQ_REDIS_HINCRBYFLOAT;
-                break;
+        case sw_len_lf:
+            if (ch != LF) {
+                return NGX_ERROR;
             }
 
+            if (p->negative) {
+                /* null bulk string or null array */
+                goto value_done;
+            }
 
-            break;
+            switch (p->type) {
 
-        case 13:
-            if (str13icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_ZRANGEBYSCORE;
+            case '$':
+            case '!':
+            case '=':
+                state = sw_data;
                 break;
-            }
 
-            break;
+            default:
+                if (p->number == 0) {
+                    goto value_done;
+                }
 
-        case 14:
-            if (str14icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                type = MSG_REQ_REDIS_ZREMRANGEBYLEX;
-                break;
-            }
+                if (p->depth == REDIS_RESP_MAX_DEPTH) {
+                    return NGX_ERROR;
+                }
 
-            break;
+                n = p->number;
 
-        case 15:
-            if (str15icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'r', 'a', 'n', 'k')) {
-                type = MSG_REQ_REDIS_ZREMRANGEBYRANK;
-                break;
+                if (p->type == '%' || p->type == '|') {
+                    n *= 2;
+                }
+
+                if (p->type == '|') {
+                    p->attrs |= (ngx_uint_t) 1 << p->depth;
+                } else {
+                    p->attrs &= ~((ngx_uint_t) 1 << p->depth);
+                }
+
+                p->left[p->depth++] = n;
+                state = sw_type;
             }
 
             break;
 
-        case 16:
-            if (str16icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_ZREMRANGEBYSCORE;
-                break;
+        case sw_data:
+            n = last - pos;
+
+            if (n < p->number) {
+                p->number -= n;
+                pos = last;
+                continue;
             }
 
-            if (str16icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                type = MSG_REQ_REDIS_ZREVRANGEBYSCORE;
-                break;
+            pos += p->number;
+            state = sw_data_cr;
+            continue;
+
+        case sw_data_cr:
+            if (ch != CR) {
+                return NGX_ERROR;
             }
 
+            state = sw_data_lf;
             break;
 
-        default:
-            break;
+        case sw_data_lf:
+            if (ch != LF) {
+                return NGX_ERROR;
+            }
+
+            goto value_done;
         }
 
-    return type;
-}
+        pos++;
+        continue;
 
+    value_done:
 
-/*
- * Return true, if the redis command take no key, otherwise
- * return false
- */
-static bool
-redis_argz(msg_type_t type)
-{
-   switch (type) {
-    case MSG_REQ_REDIS_PING:
-    case MSG_REQ_REDIS_QUIT:
-        return true;
+        pos++;
+        state = sw_type;
 
-    default:
-        break;
-    }
+        /* a finished value completes every aggregate it was the last of */
 
-    return false;
-}
+        for ( ;; ) {
 
+            if (p->depth == 0) {
+                if (p->type == '|') {
+                    /* the annotated reply follows */
+                    break;
+                }
 
-/*
- * Return true, if the redis command accepts no arguments, otherwise
- * return false
- */
-static bool
-redis_arg0(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_EXISTS:
-    case MSG_REQ_REDIS_PERSIST:
-    case MSG_REQ_REDIS_PTTL:
-    case MSG_REQ_REDIS_TTL:
-    case MSG_REQ_REDIS_TYPE:
-    case MSG_REQ_REDIS_DUMP:
-
-    case MSG_REQ_REDIS_DECR:
-    case MSG_REQ_REDIS_GET:
-    case MSG_REQ_REDIS_INCR:
-    case MSG_REQ_REDIS_STRLEN:
-
-    case MSG_REQ_REDIS_HGETALL:
-    case MSG_REQ_REDIS_HKEYS:
-    case MSG_REQ_REDIS_HLEN:
-    case MSG_REQ_REDIS_HVALS:
-
-    case MSG_REQ_REDIS_LLEN:
-    case MSG_REQ_REDIS_LPOP:
-    case MSG_REQ_REDIS_RPOP:
-
-    case MSG_REQ_REDIS_SCARD:
-    case MSG_REQ_REDIS_SMEMBERS:
-    case MSG_REQ_REDIS_SPOP:
-
-    case MSG_REQ_REDIS_ZCARD:
-    case MSG_REQ_REDIS_PFCOUNT:
-    case MSG_REQ_REDIS_AUTH:
-        return true;
+                goto done;
+            }
 
-    default:
-        break;
-    }
+            if (--p->left[p->depth - 1] != 0) {
+                break;
+            }
 
-    return false;
-}
+            p->depth--;
 
-/*
- * Return true, if the redis command accepts exactly 1 argument, otherwise
- * return false
- */
-static bool
-redis_arg1(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_EXPIRE:
-    case MSG_REQ_REDIS_EXPIREAT:
-    case MSG_REQ_REDIS_PEXPIRE:
-    case MSG_REQ_REDIS_PEXPIREAT:
-
-    case MSG_REQ_REDIS_APPEND:
-    case MSG_REQ_REDIS_DECRBY:
-    case MSG_REQ_REDIS_GETBIT:
-    case MSG_REQ_REDIS_GETSET:
-    case MSG_REQ_REDIS_INCRBY:
-    case MSG_REQ_REDIS_INCRBYFLOAT:
-    case MSG_REQ_REDIS_SETNX:
-
-    case MSG_REQ_REDIS_HEXISTS:
-    case MSG_REQ_REDIS_HGET:
-
-    case MSG_REQ_REDIS_LINDEX:
-    case MSG_REQ_REDIS_LPUSHX:
-    case MSG_REQ_REDIS_RPOPLPUSH:
-    case MSG_REQ_REDIS_RPUSHX:
-
-    case MSG_REQ_REDIS_SISMEMBER:
-
-    case MSG_REQ_REDIS_ZRANK:
-    case MSG_REQ_REDIS_ZREVRANK:
-    case MSG_REQ_REDIS_ZSCORE:
-        return true;
+            if (p->attrs & ((ngx_uint_t) 1 << p->depth)) {
+                p->type = '|';
+                p->attrs &= ~((ngx_uint_t) 1 << p->depth);
 
-    default:
-        break;
-    }
+                /* an attribute is not an element of its parent */
 
-    return false;
-}
+                if (p->depth == 0) {
+                    break;
+                }
 
-/*
- * Return true, if the redis command accepts exactly 2 arguments, otherwise
- * return false
- */
-static bool
-redis_arg2(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_GETRANGE:
-    case MSG_REQ_REDIS_PSETEX:
-    case MSG_REQ_REDIS_SETBIT:
-    case MSG_REQ_REDIS_SETEX:
-    case MSG_REQ_REDIS_SETRANGE:
-
-    case MSG_REQ_REDIS_HINCRBY:
-    case MSG_REQ_REDIS_HINCRBYFLOAT:
-    case MSG_REQ_REDIS_HSET:
-    case MSG_REQ_REDIS_HSETNX:
-
-    case MSG_REQ_REDIS_LRANGE:
-    case MSG_REQ_REDIS_LREM:
-    case MSG_REQ_REDIS_LSET:
-    case MSG_REQ_REDIS_LTRIM:
-
-    case MSG_REQ_REDIS_SMOVE:
-
-    case MSG_REQ_REDIS_ZCOUNT:
-    case MSG_REQ_REDIS_ZLEXCOUNT:
-    case MSG_REQ_REDIS_ZINCRBY:
-    case MSG_REQ_REDIS_ZREMRANGEBYLEX:
-    case MSG_REQ_REDIS_ZREMRANGEBYRANK:
-    case MSG_REQ_REDIS_ZREMRANGEBYSCORE:
-
-    case MSG_REQ_REDIS_RESTORE:
-        return true;
+                p->left[p->depth - 1]++;
+            }
 
-    default:
-        break;
+            p->type = 0;
+        }
     }
 
-    return false;
-}
+    p->state = state;
+    p->offset = pos - b->pos;
 
-/*
- * Return true, if the redis command accepts exactly 3 arguments, otherwise
- * return false
- */
-static bool
-redis_arg3(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_LINSERT:
-        return true;
+    return NGX_AGAIN;
 
-    default:
-        break;
-    }
+done:
 
-    return false;
-}
+    value = b->pos + p->start;
 
-/*
- * Return true, if the redis command accepts 0 or more arguments, otherwise
- * return false
- */
-static bool
-redis_argn(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_SORT:
-
-    case MSG_REQ_REDIS_BITCOUNT:
-    case MSG_REQ_REDIS_BITPOS:
-
-    case MSG_REQ_REDIS_SET:
-    case MSG_REQ_REDIS_HDEL:
-    case MSG_REQ_REDIS_HMGET:
-    case MSG_REQ_REDIS_HMSET:
-    case MSG_REQ_REDIS_HSCAN:
-
-    case MSG_REQ_REDIS_LPUSH:
-    case MSG_REQ_REDIS_RPUSH:
-
-    case MSG_REQ_REDIS_SADD:
-    case MSG_REQ_REDIS_SDIFF:
-    case MSG_REQ_REDIS_SDIFFSTORE:
-    case MSG_REQ_REDIS_SINTER:
-    case MSG_REQ_REDIS_SINTERSTORE:
-    case MSG_REQ_REDIS_SREM:
-    case MSG_REQ_REDIS_SUNION:
-    case MSG_REQ_REDIS_SUNIONSTORE:
-    case MSG_REQ_REDIS_SRANDMEMBER:
-    case MSG_REQ_REDIS_SSCAN:
-
-    case MSG_REQ_REDIS_PFADD:
-    case MSG_REQ_REDIS_PFMERGE:
-
-    case MSG_REQ_REDIS_ZADD:
-    case MSG_REQ_REDIS_ZINTERSTORE:
-    case MSG_REQ_REDIS_ZRANGE:
-    case MSG_REQ_REDIS_ZRANGEBYSCORE:
-    case MSG_REQ_REDIS_ZREM:
-    case MSG_REQ_REDIS_ZREVRANGE:
-    case MSG_REQ_REDIS_ZRANGEBYLEX:
-    case MSG_REQ_REDIS_ZREVRANGEBYSCORE:
-    case MSG_REQ_REDIS_ZUNIONSTORE:
-    case MSG_REQ_REDIS_ZSCAN:
-        return true;
+    *end = pos;
 
-    default:
-        break;
-    }
+    switch (*value) {
 
-    return false;
-}
-
-/*
- * Return true, if the redis command is a vector command accepting one or
- * more keys, otherwise return false
- */
-static bool
-redis_argx(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_MGET:
-    case MSG_REQ_REDIS_DEL:
-        return true;
-
-    default:
+    case '+':
+        *type = MSG_RSP_REDIS_STATUS;
         break;
-    }
 
-    return false;
-}
+    case '-':
+        *type = redis_resp_error(value, pos);
+        break;
 
-/*
- * Return true, if the redis command is a vector command accepting one or
- * more key-value pairs, otherwise return false
- */
-static bool
-redis_argkvx(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_MSET:
-        return true;
+    case '!':
+        *type = MSG_RSP_REDIS_ERROR;
+        break;
 
-    default:
+    case ':':
+        *type = MSG_RSP_REDIS_INTEGER;
         break;
-    }
 
-    return false;
-}
+    case '*':
+    case '%':
+    case '~':
+        *type = MSG_RSP_REDIS_MULTIBULK;
+        break;
 
-/*
- * Return true, if the redis command is either EVAL or EVALSHA. These commands
- * have a special format with exactly 2 arguments, followed by one or more keys,
- * followed by zero or more arguments (the documentation online seems to suggest
- * that at least one argument is required, but that shouldn't be the case).
- */
-static bool
-redis_argeval(msg_type_t type)
-{
-    switch (type) {
-    case MSG_REQ_REDIS_EVAL:
-    case MSG_REQ_REDIS_EVALSHA:
-        return true;
+    case '>':
+        *type = MSG_RSP_REDIS_PUSH;
+        break;
 
     default:
-        break;
+        *type = MSG_RSP_REDIS_BULK;
     }
 
-    return false;
-}
+    p->state = sw_type;
+    p->offset = 0;
+    p->depth = 0;
+    p->attrs = 0;
 
+    return NGX_OK;
+}
 
 
 ngx_int_t
-redis_parse_req(ngx_stream_session_t *s)
+redis_resp_int(u_char **pos, u_char *last, u_char type,
+    ngx_int_t *n)
 {
-    ngx_int_t                           rc;
-    int                                 ret;
-    void                                *reply;
-    char                                *data;
-    ssize_t                              len, argc;
-    ngx_buf_t                           *b;
-    redisReader                         *reader;
-    redisReply                          *replyInfo;
-    ngx_stream_redis_proxy_ctx_t        *ctx;
+    u_char                             *p, *cr;
 
-    ctx = (ngx_stream_redis_proxy_ctx_t *)ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        return NGX_ERROR;
-    }
-
-    b = ctx->buffer_in;
-    len = b->last - b->pos;
-    data = (char*) b->pos;
+    p = *pos;
 
-    if (str4icmp(data, 'P', 'I', 'N', 'G')) {
-        return REDIS_OK;
-    }
-
-    rc = redis_proto_decode(data, len);
-    if ( rc != NGX_OK ) {
-        return rc;
+    if (p == last) {
+        return NGX_AGAIN;
     }
 
-    reader = redisReaderCreate();
-    redisReaderFeed(reader,data, len);
-    ret = redisReaderGetReply(reader,&reply);
-    if ( ret == REDIS_ERR || ((redisReply*)reply)->type != REDIS_REPLY_ARRAY) {
-        redisReaderFree(reader);
+    if (*p != type) {
         return NGX_ERROR;
     }
-    // REDIS_OK
 
-    replyInfo = (redisReply*)reply;
-    argc = replyInfo->elements;
-    if  ( argc <= 0 ) {
-        redisReaderFree(reader);
-        return NGX_ERROR;
+    cr = redis_scan(p, last, CR);
+    if (cr == NULL || cr + 1 == last) {
+        return NGX_AGAIN;
     }
 
-    ctx->type = redis_command_req(replyInfo->element[0]->str, replyInfo->element[0]->len);
-    if (ctx->type == MSG_UNKNOWN) {
-        //("parsed unsupported command '%.*s'", p - m, m);
-        redisReaderFree(reader);
+    if (cr[1] != LF) {
         return NGX_ERROR;
     }
 
-    if (redis_argz(ctx->type)) {
-        //PING || QUIT
-        redisReaderFree(reader);
-        return NGX_OK;
-    }
+    if (cr - p == 3 && p[1] == '-' && p[2] == '1') {
+        *n = -1;
 
-    if (redis_arg0(ctx->type)) {
-        goto done;
+    } else {
+        *n = ngx_atoi(p + 1, cr - p - 1);
+        if (*n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
     }
 
-    if (redis_arg1(ctx->type)) {
-        goto done;
-    }
+    *pos = cr + 2;
 
-    if (redis_arg2(ctx->type)) {
-        goto done;
-    }
+    return NGX_OK;
+}
 
-    if (redis_arg3(ctx->type)) {
-        goto done;
-    }
 
-    if (redis_argn(ctx->type)) {
-        goto done;
-    }
+ngx_int_t
+redis_resp_bulk(u_char **pos, u_char *last, ngx_str_t *str)
+{
+    u_char                             *p;
+    ngx_int_t                           rc, len;
 
-    if (redis_argx(ctx->type)) {
-        //MGET key... || DEL key...
-        //char *key =  ((redisReply*)reply)->element[1]->str;
-        goto argx;
-    }
+    p = *pos;
 
-    if (redis_argkvx(ctx->type)) {
-        //MSET key...
-        //char *key =  ((redisReply*)reply)->element[1]->str;
-        return NGX_OK;
+    rc = redis_resp_int(&p, last, '$', &len);
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-    if (redis_argeval(ctx->type)) {
-        //EVAL || EVALSHA
-
+    if (len == -1) {
+        ngx_str_null(str);
+        *pos = p;
         return NGX_OK;
     }
 
-done:
-    ctx->slotid = key_hash_slot(replyInfo->element[1]->str, replyInfo->element[1]->len);
-    goto success;
-
-argx:
-    ctx->slotids = ngx_array_create(s->connection->pool, argc, sizeof(size_t));
-    if ( ctx->slotids == NULL ) {
-        goto failed;
-    }
-
-    ctx->client_buffers = ngx_array_create(s->connection->pool, argc, sizeof(ngx_str_t));
-    if ( ctx->client_buffers == NULL ) {
-        goto failed;
-    }
-
-    for ( ;; ) {
-        rc = ngx_redis_mget_slotid(replyInfo, argc,  ctx->slotids);
-        if ( rc < 0 ) {
-            return NGX_OK;
-        }
-
-        rc = ngx_redis_mget(s, replyInfo, argc, rc);
-        if ( rc != NGX_OK ) {
-            goto failed;
-        }
+    if (last - p < len + 2) {
+        return NGX_AGAIN;
     }
-    goto success;
 
-failed:
-    if (reply != NULL) {
-        freeReplyObject(reply);
-    }
-    if ( redisReaderFree != NULL ) {
-        redisReaderFree(reader);
+    if (p[len] != CR || p[len + 1] != LF) {
+        return NGX_ERROR;
     }
 
-    return NGX_ERROR;
+    str->data = p;
+    str->len = len;
 
-success:
-    if (reply != NULL) {
-        freeReplyObject(reply);
-    }
-    if ( redisReaderFree != NULL ) {
-        redisReaderFree(reader);
-    }
+    *pos = p + len + 2;
 
     return NGX_OK;
 }
 
-static ngx_int_t
-ngx_redis_mget_slotid(redisReply* replyInfo, size_t argc,  ngx_array_t *slotids)
-{
-    size_t                               found;
-    size_t                               i, j, slotid;
-    size_t                              *slotid_item;
-
-    for ( i = 1; i < argc; i++ ) {
-        slotid = key_hash_slot(replyInfo->element[i]->str, replyInfo->element[i]->len);
-
-        if (slotids->nelts == 0) {
-            return slotid;
-        }
-        found = 0;
-        for ( j = 0; j < slotids->nelts; j++ ) {
-            slotid_item = (size_t*) slotids->elts + j;
-            if (slotid == (*slotid_item)) {
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            return slotid;
-        }
-    }
-    return -1;
-}
 
-static ngx_int_t
-ngx_redis_mget(ngx_stream_session_t *s, redisReply *replyInfo, size_t argc, ngx_int_t slotid)
+/* argument i of the complete request [p, last), for a request sent already */
+ngx_int_t
+redis_req_arg(u_char *p, u_char *last, ngx_uint_t i, ngx_str_t *arg)
 {
-    size_t                              len = 0;
-    size_t                              i, *slotid_item;
-    ngx_str_t                           *key, *buffer;
-    ngx_array_t                         *keys;
-    ngx_stream_redis_proxy_ctx_t        *ctx;
-
-    ctx = (ngx_stream_redis_proxy_ctx_t *)ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        return NGX_ERROR;
-    }
+    ngx_int_t   n;
+    ngx_uint_t  k;
 
-    keys = ngx_array_create(s->connection->pool, argc, sizeof(ngx_str_t));
-    if ( keys == NULL ) {
+    if (redis_resp_int(&p, last, '*', &n) != NGX_OK || (ngx_int_t) i >= n) {
         return NGX_ERROR;
     }
 
-    for ( i=1; i < argc; i++ ) {
-        if ( slotid == key_hash_slot(replyInfo->element[i]->str, replyInfo->element[i]->len) ) {
-            key =  ngx_array_push(keys);
-            if (key == NULL) {
-                return NGX_ERROR;
-            }
-            key->len = replyInfo->element[i]->len;
-            key->data = (u_char*)replyInfo->element[i]->str;
+    for (k = 0; k <= i; k++) {
+        if (redis_resp_bulk(&p, last, arg) != NGX_OK) {
+            return NGX_ERROR;
         }
     }
 
-    //*3\r\n
-    len += 3;
-    len += redis_get_num_size(keys->nelts + 1);
-
-    //$3\r\nMGET\r\n
-    len += 5;
-    len += redis_get_num_size(replyInfo->element[0]->len);
-    len += replyInfo->element[0]->len;
-
-    for ( i = 0; i < keys->nelts; i++ ) {
-        key = (ngx_str_t*)keys->elts + i;
-        //$3\r\nabc\r\n
-        len += 5;
-        len += redis_get_num_size(key->len);
-        len += key->len;
-    }
+    return NGX_OK;
+}
 
-    slotid_item = ngx_array_push(ctx->slotids);
-    if ( slotid_item == NULL ) {
-        return NGX_ERROR;
-    }
-    *slotid_item = slotid;
 
-    buffer = (ngx_str_t *)ngx_array_push(ctx->client_buffers);
-    if ( buffer == NULL ) {
-        return NGX_ERROR;
-    }
-    buffer->len = len;
-    buffer->data = (u_char*)ngx_pcalloc(s->connection->pool, len);
-    if ( buffer->data == NULL  ) {
-        return NGX_ERROR;
-    }
-    ngx_sprintf(buffer->data,"*%d\r\n", (unsigned long) keys->nelts + 1);
+ngx_int_t
+redis_resp_skip(u_char **pos, u_char *last, ngx_uint_t depth)
+{
+    u_char                             *p, *cr;
+    ngx_int_t                           rc, n, i;
+    ngx_str_t                           str;
 
-    ngx_sprintf(buffer->data,"%s$%d\r\n", buffer->data, (unsigned long) replyInfo->element[0]->len);
-    ngx_sprintf(buffer->data,"%s%s\r\n", buffer->data, (char*)replyInfo->element[0]->str);
+    p = *pos;
 
-    for ( i = 0; i < keys->nelts; i++) {
-        key = (ngx_str_t*)keys->elts + i;
-        //$3\r\nabc\r\n
-        ngx_sprintf(buffer->data,"%s$%d\r\n", buffer->data,  (unsigned long) key->len);
-        ngx_sprintf(buffer->data,"%s%s\r\n", buffer->data,  (char*)key->data);
+    if (p == last) {
+        return NGX_AGAIN;
     }
 
-    ngx_array_destroy(keys);
+    switch (*p) {
 
-    return NGX_OK;
-}
-
-static void
-redis_resp_error(ngx_stream_redis_proxy_ctx_t *ctx, u_char  *data, ssize_t len)
-{
-    ssize_t                   cmd_len;
-    u_char                    *p, *m;
+    case '+':
+    case '-':
+    case ':':
+        cr = redis_scan(p, last, CR);
+        if (cr == NULL || cr + 1 == last) {
+            return NGX_AGAIN;
+        }
 
-    m = data;
-    p = (u_char *)ngx_strchr(data, ' ');
-    if ( p != NULL ) {
-        cmd_len = p - data;
-    }
+        *pos = cr + 2;
+        return NGX_OK;
 
-    switch (cmd_len) {
-        case 3:
-            /*-ASK 1 127.0.0.1 */
-            if (str4cmp(m, '-', 'A', 'S', 'K')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_ASK;
-                break;
-            }
+    case '$':
+        return redis_resp_bulk(pos, last, &str);
 
-            break;
+    case '*':
+        if (depth == REDIS_RESP_MAX_DEPTH) {
+            return NGX_ERROR;
+        }
 
-        case 4:
-            /*
-            * -ERR no such key\r\n
-            * -ERR syntax error\r\n
-            * -ERR source and destination objects are the same\r\n
-            * -ERR index out of range\r\n
-            */
-            if (str4cmp(m, '-', 'E', 'R', 'R')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_ERR;
-                break;
-            }
+        rc = redis_resp_int(&p, last, '*', &n);
+        if (rc != NGX_OK) {
+            return rc;
+        }
 
-            /* -OOM command not allowed when used memory > 'maxmemory'.\r\n */
-            if (str4cmp(m, '-', 'O', 'O', 'M')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_OOM;
-                break;
+        for (i = 0; i < n; i++) {
+            rc = redis_resp_skip(&p, last, depth + 1);
+            if (rc != NGX_OK) {
+                return rc;
             }
+        }
 
-            break;
+        *pos = p;
+        return NGX_OK;
 
-        case 5:
-            /* -BUSY Redis is busy running a script. You can only call SCRIPT KILL or SHUTDOWN NOSAVE.\r\n" */
-            if (str5cmp(m, '-', 'B', 'U', 'S', 'Y')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_BUSY;
-                break;
-            }
+    default:
+        return NGX_ERROR;
+    }
+}
 
-            break;
 
-        case 6:
-            /* -MOVED 3999 127.0.0.1:6381 */
-            if (str6cmp(m, '-', 'M', 'O', 'V', 'E', 'D')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_MOVED;
-                break;
-            }
+/*
+ * RESP encoder for the commands the proxy generates: the _len functions
+ * give the exact size of a frame so that a command is sized once and
+ * written once into its buffer
+ */
 
-            break;
 
-        case 7:
-            /* -NOAUTH Authentication required.\r\n */
-            if (str7cmp(m, '-', 'N', 'O', 'A', 'U', 'T', 'H')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_NOAUTH;
-                break;
-            }
+static ngx_uint_t
+redis_encode_digits(size_t n)
+{
+    ngx_uint_t  d;
 
-            break;
+    for (d = 1; n >= 10; d++) {
+        n /= 10;
+    }
 
-        case 8:
-            /* rsp: "-LOADING Redis is loading the dataset in memory\r\n" */
-            if (str8cmp(m, '-', 'L', 'O', 'A', 'D', 'I', 'N', 'G')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_LOADING;
-                break;
-            }
+    return d;
+}
 
-            /* -BUSYKEY Target key name already exists.\r\n */
-            if (str8cmp(m, '-', 'B', 'U', 'S', 'Y', 'K', 'E', 'Y')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_BUSYKEY;
-                break;
-            }
 
-            /* "-MISCONF Redis is configured to save RDB snapshots, but is currently not able to persist on disk. Commands that may modify the data set are disabled. Please check Redis logs for details about the error.\r\n" */
-            if (str8cmp(m, '-', 'M', 'I', 'S', 'C', 'O', 'N', 'F')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_MISCONF;
-                break;
-            }
+static u_char *
+redis_encode_number(u_char *p, u_char type, size_t n)
+{
+    u_char      *d;
+    ngx_uint_t   digits;
 
-            break;
+    digits = redis_encode_digits(n);
 
-        case 9:
-            /*-TRYAGAIN */
-            if (str9cmp(m, '-', 'T', 'R', 'Y', 'A', 'G', 'A', 'I', 'N')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_TRYAGAIN;
-                break;
-            }
+    *p++ = type;
 
-            /* -NOSCRIPT No matching script. Please use EVAL.\r\n */
-            if (str9cmp(m, '-', 'N', 'O', 'S', 'C', 'R', 'I', 'P', 'T')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_NOSCRIPT;
-                break;
-            }
+    d = p + digits;
 
-            /* -READONLY You can't write against a read only slave.\r\n */
-            if (str9cmp(m, '-', 'R', 'E', 'A', 'D', 'O', 'N', 'L', 'Y')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_READONLY;
-                break;
-            }
+    do {
+        *--d = (u_char) ('0' + n % 10);
+        n /= 10;
+    } while (n);
 
-            break;
+    p += digits;
 
-        case 10:
-            /* -WRONGTYPE Operation against a key holding the wrong kind of value\r\n */
-            if (str10cmp(m, '-', 'W', 'R', 'O', 'N', 'G', 'T', 'Y', 'P', 'E')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_WRONGTYPE;
-                break;
-            }
+    *p++ = CR; *p++ = LF;
 
-            /* -EXECABORT Transaction discarded because of previous errors.\r\n" */
-            if (str10cmp(m, '-', 'E', 'X', 'E', 'C', 'A', 'B', 'O', 'R', 'T')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_EXECABORT;
-                break;
-            }
+    return p;
+}
 
-            break;
 
-        case 11:
-            /* -MASTERDOWN Link with MASTER is down and slave-serve-stale-data is set to 'no'.\r\n */
-            if (str11cmp(m, '-', 'M', 'A', 'S', 'T', 'E', 'R', 'D', 'O', 'W', 'N')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_MASTERDOWN;
-                break;
-            }
+size_t
+redis_encode_array_len(ngx_uint_t n)
+{
+    return 1 + redis_encode_digits(n) + 2;
+}
 
-            /* -NOREPLICAS Not enough good slaves to write.\r\n */
-            if (str11cmp(m, '-', 'N', 'O', 'R', 'E', 'P', 'L', 'I', 'C', 'A', 'S')) {
-                ctx->type = MSG_RSP_REDIS_ERROR_NOREPLICAS;
-                break;
-            }
 
-            break;
-    }
+size_t
+redis_encode_bulk_len(size_t len)
+{
+    return 1 + redis_encode_digits(len) + 2 + len + 2;
 }
 
 
+u_char *
+redis_encode_array(u_char *p, ngx_uint_t n)
+{
+    return redis_encode_number(p, '*', n);
+}
 
-ngx_int_t
-redis_parse_rsp(ngx_stream_session_t *s)
+
+u_char *
+redis_encode_bulk(u_char *p, u_char *data, size_t len)
 {
-    ngx_int_t                           rc;
-    u_char                              *p, *m;
-    char                                ch;
-    u_char                              *data;
-    ssize_t                              len;
-    ngx_buf_t                           *b;
-    ngx_stream_upstream_t               *u;
-    ngx_stream_redis_proxy_ctx_t        *ctx;
+    p = redis_encode_number(p, '$', len);
+    p = ngx_cpymem(p, data, len);
 
-    ctx = (ngx_stream_redis_proxy_ctx_t *)ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        return NGX_ERROR;
-    }
+    *p++ = CR; *p++ = LF;
 
-    u = s->upstream;
-    b = &u->upstream_buf;
-    len = b->last - b->pos;
-    data = (u_char*) b->pos;
+    return p;
+}
 
-    rc = redis_proto_decode((char*)data, len);
-    if ( rc != NGX_OK ) {
-        return rc;
-    }
 
-    p = data;
-    m = data;
-    ch = *p;
+size_t
+redis_encode_command_len(ngx_str_t *args, ngx_uint_t n)
+{
+    size_t      len;
+    ngx_uint_t  i;
 
-    switch (ch) {
-        case '+':
-            ctx->type = MSG_RSP_REDIS_STATUS;
-            p = p - 1; /* go back by 1 byte */
-            return NGX_OK;
+    len = redis_encode_array_len(n);
 
-        case '-':
-            redis_resp_error(ctx, m, len);
-            p = p - 1; /* go back by 1 byte */
-            return NGX_OK;
+    for (i = 0; i < n; i++) {
+        len += redis_encode_bulk_len(args[i].len);
+    }
 
-        case ':':
-            ctx->type = MSG_RSP_REDIS_INTEGER;
-            p = p - 1; /* go back by 1 byte */
-            return NGX_OK;
+    return len;
+}
 
-        case '$':
-            ctx->type = MSG_RSP_REDIS_BULK;
-            p = p - 1; /* go back by 1 byte */
-            return NGX_OK;
 
-        case '*':
-            ctx->type = MSG_RSP_REDIS_MULTIBULK;
-            p = p - 1; /* go back by 1 byte */
-            return NGX_OK;
+/* a whole command of n arguments, binary safe */
+u_char *
+redis_encode_command(u_char *p, ngx_str_t *args, ngx_uint_t n)
+{
+    ngx_uint_t  i;
 
-        default:
-            return NGX_ERROR;
+    p = redis_encode_array(p, n);
+
+    for (i = 0; i < n; i++) {
+        p = redis_encode_bulk(p, args[i].data, args[i].len);
     }
-}
 
+    return p;
+}
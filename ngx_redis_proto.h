@@ -7,11 +7,62 @@
 
 #include "ngx_stream_redis_proxy_module.h"
 
+#define REDIS_RESP_MAX_DEPTH        16
+
+
+/* reply framer state, kept across reads of a partial reply */
+typedef struct {
+    ngx_uint_t                  state;
+    size_t                      offset;     /* bytes scanned */
+    size_t                      start;      /* the reply proper, after attributes */
+    size_t                      number;
+    ngx_uint_t                  depth;
+    ngx_uint_t                  attrs;      /* bit per depth: an attribute */
+    size_t                      left[REDIS_RESP_MAX_DEPTH];
+    u_char                      type;
+    unsigned                    negative:1;
+} redis_rsp_parser_t;
+
 ngx_int_t
 redis_parse_req(ngx_stream_session_t *s);
 
 ngx_int_t
-redis_parse_rsp(ngx_stream_session_t *s);
+redis_parse_rsp(ngx_buf_t *b, redis_rsp_parser_t *p, u_char **end,
+    msg_type_t *type);
+
+const ngx_stream_redis_command_t *
+redis_command_lookup(u_char *m, size_t len);
+
+u_char *
+redis_scan(u_char *p, u_char *last, u_char c);
+
+void
+redis_key_hash_slot_batch(u_char *base, ngx_stream_redis_arg_t *keys,
+    ngx_uint_t n, ngx_uint_t step, uint16_t *slots);
+uint64_t
+redis_key_hash(u_char *key, size_t len);
+
+ngx_int_t
+redis_resp_int(u_char **pos, u_char *last, u_char type, ngx_int_t *n);
+ngx_int_t
+redis_resp_bulk(u_char **pos, u_char *last, ngx_str_t *str);
+ngx_int_t
+redis_resp_skip(u_char **pos, u_char *last, ngx_uint_t depth);
+ngx_int_t
+redis_req_arg(u_char *p, u_char *last, ngx_uint_t i, ngx_str_t *arg);
+
+size_t
+redis_encode_array_len(ngx_uint_t n);
+size_t
+redis_encode_bulk_len(size_t len);
+size_t
+redis_encode_command_len(ngx_str_t *args, ngx_uint_t n);
+u_char *
+redis_encode_array(u_char *p, ngx_uint_t n);
+u_char *
+redis_encode_bulk(u_char *p, u_char *data, size_t len);
+u_char *
+redis_encode_command(u_char *p, ngx_str_t *args, ngx_uint_t n);
 
 #endif //__NGX_REDIS_PROTO_H__
 
@@ -0,0 +1,1102 @@
+
+#include "ngx_stream_redis_cache.h"
+#include "ngx_stream_redis_sketch.h"
+#include "ngx_stream_redis_hotkeys.h"
+
+
+#define NGX_STREAM_REDIS_CACHE_ENTRY           256     /* for sizing only */
+#define NGX_STREAM_REDIS_CACHE_BUCKETS_MIN     1024
+#define NGX_STREAM_REDIS_CACHE_BUCKETS_MAX     (1 << 20)
+#define NGX_STREAM_REDIS_CACHE_WINDOW          100     /* 1% of the budget */
+#define NGX_STREAM_REDIS_CACHE_WINDOW_MIN      65536
+#define NGX_STREAM_REDIS_TRACKER_BUFFER        16384
+#define NGX_STREAM_REDIS_TRACKER_RETRY         1000
+#define NGX_STREAM_REDIS_TRACKER_REFUSED       60000
+
+
+/*
+ * a cached reply to GET key, HGET key field or HGETALL key; the entries
+ * of a key share its bucket, so invalidating the key finds them all
+ */
+typedef struct {
+    ngx_queue_t                            bucket;
+    ngx_queue_t                            queue;      /* window or main */
+    uint64_t                               hash;       /* of the key */
+    uint64_t                               freq;       /* in the sketch */
+    ngx_msec_t                             expires;
+    ngx_stream_redis_node_t               *node;
+    msg_type_t                             type;
+    msg_type_t                             rsp_type;
+    size_t                                 size;       /* charged */
+    u_char                                *key;
+    size_t                                 key_len;
+    u_char                                *field;
+    size_t                                 field_len;
+    u_char                                *rsp;
+    size_t                                 rsp_len;
+    unsigned                               window:1;
+    unsigned                               referenced:1;
+} ngx_stream_redis_cache_entry_t;
+
+
+/*
+ * W-TinyLFU: a new entry spends its first moments in a small LRU window,
+ * the one pushed out of it enters the main area only when the sketch saw
+ * it more often than the entry CLOCK would evict for it; a burst of keys
+ * read once cannot flush the keys read all the time
+ */
+typedef struct {
+    ngx_queue_t                           *buckets;
+    uint32_t                              *seq;        /* invalidations */
+    ngx_uint_t                             mask;
+
+    ngx_queue_t                            window;     /* head newest */
+    size_t                                 window_size;
+    size_t                                 window_max;
+
+    ngx_queue_t                            main;       /* CLOCK ring */
+    ngx_queue_t                           *hand;
+    size_t                                 main_size;
+    size_t                                 main_max;
+
+    ngx_stream_redis_sketch_t              sketch;
+
+    u_char                                *setup;      /* HELLO, TRACKING */
+    size_t                                 setup_len;
+
+    ngx_stream_redis_cluster_conf_t       *conf;
+} ngx_stream_redis_cache_t;
+
+
+static ngx_stream_redis_cache_entry_t *ngx_stream_redis_cache_find(
+    ngx_stream_redis_cache_t *cache, uint64_t hash, msg_type_t type,
+    ngx_str_t *key, ngx_str_t *field);
+static uint64_t ngx_stream_redis_cache_freq(uint64_t hash, msg_type_t type,
+    ngx_str_t *field);
+static ngx_int_t ngx_stream_redis_cache_cacheable(
+    ngx_stream_redis_cache_t *cache, ngx_str_t *key);
+static void ngx_stream_redis_cache_admit(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_cache_entry_t *e);
+static ngx_stream_redis_cache_entry_t *ngx_stream_redis_cache_victim(
+    ngx_stream_redis_cache_t *cache);
+static void ngx_stream_redis_cache_remove(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_cache_entry_t *e);
+static void ngx_stream_redis_cache_drop(ngx_stream_redis_cache_t *cache,
+    u_char *key, size_t len);
+static void ngx_stream_redis_cache_flush(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_node_t *node);
+
+static void ngx_stream_redis_cache_track(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_node_t *node);
+static void ngx_stream_redis_tracker_write_handler(ngx_event_t *wev);
+static void ngx_stream_redis_tracker_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_stream_redis_tracker_process(
+    ngx_stream_redis_tracker_t *t);
+static void ngx_stream_redis_tracker_push(ngx_stream_redis_cache_t *cache,
+    u_char *p, u_char *last);
+static void ngx_stream_redis_tracker_close(ngx_stream_redis_tracker_t *t,
+    ngx_msec_t retry);
+
+
+static ngx_stream_redis_cache_t  *ngx_stream_redis_cache;
+
+
+#define ngx_stream_redis_cache_expired(e)                                     \
+    ((ngx_msec_int_t) ((e)->expires - ngx_current_msec) <= 0)
+
+
+ngx_int_t
+ngx_stream_redis_cache_init(ngx_cycle_t *cycle)
+{
+    size_t                            size;
+    u_char                           *p;
+    ngx_str_t                        *args, *prefixes;
+    ngx_uint_t                        i, n, nargs;
+    ngx_stream_redis_cache_t         *cache;
+    ngx_stream_redis_cluster_conf_t  *rccf;
+
+    rccf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_redis_proxy_module);
+
+    if (rccf == NULL || rccf->near_cache == 0) {
+        return NGX_OK;
+    }
+
+    cache = ngx_calloc(sizeof(ngx_stream_redis_cache_t), cycle->log);
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->conf = rccf;
+
+    for (n = NGX_STREAM_REDIS_CACHE_BUCKETS_MIN;
+         n < rccf->near_cache / NGX_STREAM_REDIS_CACHE_ENTRY
+         && n < NGX_STREAM_REDIS_CACHE_BUCKETS_MAX;
+         n <<= 1)
+    { /* void */ }
+
+    cache->mask = n - 1;
+
+    cache->buckets = ngx_alloc(n * sizeof(ngx_queue_t), cycle->log);
+    cache->seq = ngx_calloc(n * sizeof(uint32_t), cycle->log);
+
+    if (cache->buckets == NULL || cache->seq == NULL) {
+        goto failed;
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_queue_init(&cache->buckets[i]);
+    }
+
+    /* the sketch forgets half of what it saw every 10 entries' worth */
+    if (ngx_stream_redis_sketch_init(&cache->sketch, n, 10 * n, cycle->log)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    cache->window_max = rccf->near_cache / NGX_STREAM_REDIS_CACHE_WINDOW;
+
+    if (cache->window_max < NGX_STREAM_REDIS_CACHE_WINDOW_MIN) {
+        cache->window_max = ngx_min(NGX_STREAM_REDIS_CACHE_WINDOW_MIN,
+                                    rccf->near_cache / 2);
+    }
+
+    cache->main_max = rccf->near_cache - cache->window_max;
+
+    ngx_queue_init(&cache->window);
+    ngx_queue_init(&cache->main);
+    cache->hand = &cache->main;
+
+    /* HELLO 3, then CLIENT TRACKING ON BCAST [PREFIX prefix ...] */
+
+    n = rccf->near_cache_prefixes ? rccf->near_cache_prefixes->nelts : 0;
+
+    args = ngx_alloc((6 + 2 * n) * sizeof(ngx_str_t), cycle->log);
+    if (args == NULL) {
+        goto failed;
+    }
+
+    ngx_str_set(&args[0], "HELLO");
+    ngx_str_set(&args[1], "3");
+    ngx_str_set(&args[2], "CLIENT");
+    ngx_str_set(&args[3], "TRACKING");
+    ngx_str_set(&args[4], "ON");
+    ngx_str_set(&args[5], "BCAST");
+
+    nargs = 6;
+
+    prefixes = n ? rccf->near_cache_prefixes->elts : NULL;
+
+    for (i = 0; i < n; i++) {
+        ngx_str_set(&args[nargs], "PREFIX");
+        args[nargs + 1] = prefixes[i];
+        nargs += 2;
+    }
+
+    size = redis_encode_command_len(args, 2)
+           + redis_encode_command_len(args + 2, nargs - 2);
+
+    cache->setup = ngx_alloc(size, cycle->log);
+    if (cache->setup == NULL) {
+        ngx_free(args);
+        goto failed;
+    }
+
+    p = redis_encode_command(cache->setup, args, 2);
+    p = redis_encode_command(p, args + 2, nargs - 2);
+
+    cache->setup_len = p - cache->setup;
+
+    ngx_free(args);
+
+    ngx_stream_redis_cache = cache;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_stream_redis_sketch_free(&cache->sketch);
+
+    if (cache->buckets) {
+        ngx_free(cache->buckets);
+    }
+
+    if (cache->seq) {
+        ngx_free(cache->seq);
+    }
+
+    ngx_free(cache);
+
+    return NGX_ERROR;
+}
+
+
+void
+ngx_stream_redis_cache_exit(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                     i;
+    ngx_stream_redis_node_t       *node;
+    ngx_stream_redis_tracker_t    *t;
+    ngx_stream_redis_cache_t      *cache;
+    ngx_stream_redis_node_peer_t  *np;
+
+    cache = ngx_stream_redis_cache;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    for (i = 0; i < NGX_STREAM_REDIS_MAX_NODES; i++) {
+
+        node = ngx_stream_redis_cluster_node(i);
+        if (node == NULL) {
+            break;
+        }
+
+        np = ngx_stream_redis_cluster_node_peer(node);
+        if (np == NULL || np->tracker == NULL) {
+            continue;
+        }
+
+        t = np->tracker;
+
+        if (t->peer.connection) {
+            ngx_close_connection(t->peer.connection);
+        }
+
+        if (t->buf.start) {
+            ngx_free(t->buf.start);
+        }
+
+        ngx_free(t);
+        np->tracker = NULL;
+    }
+
+    ngx_stream_redis_cache_flush(cache, NULL);
+
+    ngx_stream_redis_sketch_free(&cache->sketch);
+    ngx_free(cache->buckets);
+    ngx_free(cache->seq);
+    ngx_free(cache->setup);
+    ngx_free(cache);
+
+    ngx_stream_redis_cache = NULL;
+}
+
+
+/*
+ * answers msg from the cache; on a miss of a cacheable command msg keeps
+ * the invalidation count of the key's bucket, so that a reply overtaken
+ * by a write to its key is not stored
+ */
+ngx_int_t
+ngx_stream_redis_cache_lookup(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p)
+{
+    u_char                          *rsp;
+    uint64_t                         hash, freq;
+    ngx_str_t                        key, field;
+    ngx_uint_t                       nargs;
+    ngx_stream_redis_arg_t          *args;
+    ngx_stream_redis_cache_t        *cache;
+    ngx_stream_redis_cache_entry_t  *e;
+
+    cache = ngx_stream_redis_cache;
+
+    if (cache == NULL || p->nkeys != 1) {
+        return NGX_DECLINED;
+    }
+
+    switch (msg->type) {
+
+    case MSG_REQ_REDIS_GET:
+    case MSG_REQ_REDIS_HGETALL:
+        nargs = 2;
+        break;
+
+    case MSG_REQ_REDIS_HGET:
+        nargs = 3;
+        break;
+
+    default:
+        return NGX_DECLINED;
+    }
+
+    if (p->args.nelts != nargs) {
+        /* the node answers with an error, which is not cached */
+        return NGX_DECLINED;
+    }
+
+    args = p->args.elts;
+
+    key.data = msg->start + args[1].pos;
+    key.len = args[1].len;
+
+    if (nargs == 3) {
+        field.data = msg->start + args[2].pos;
+        field.len = args[2].len;
+
+    } else {
+        ngx_str_null(&field);
+    }
+
+    if (!ngx_stream_redis_cache_cacheable(cache, &key)) {
+        return NGX_DECLINED;
+    }
+
+    hash = redis_key_hash(key.data, key.len);
+    freq = ngx_stream_redis_cache_freq(hash, msg->type, &field);
+
+    (void) ngx_stream_redis_sketch_add(&cache->sketch, freq);
+
+    e = ngx_stream_redis_cache_find(cache, hash, msg->type, &key, &field);
+
+    if (e != NULL && ngx_stream_redis_cache_expired(e)) {
+        ngx_stream_redis_cache_remove(cache, e);
+        e = NULL;
+    }
+
+    if (e != NULL
+        && e->node != ngx_stream_redis_cluster_node(
+                          ngx_stream_redis_cluster_slot_node(msg->slotid)))
+    {
+        /*
+         * the slot has moved, writes on its new master may reach no tracker
+         * of this worker; the reply cached from there starts tracking it
+         */
+        ngx_stream_redis_cache_remove(cache, e);
+        e = NULL;
+    }
+
+    if (e == NULL) {
+        msg->cache = 1;
+        msg->cache_seq = cache->seq[hash & cache->mask];
+        return NGX_DECLINED;
+    }
+
+    /* the reply is written later, the entry may be gone by then */
+
+    rsp = ngx_alloc(e->rsp_len, ngx_cycle->log);
+    if (rsp == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memcpy(rsp, e->rsp, e->rsp_len);
+
+    e->referenced = 1;
+
+    if (e->window) {
+        ngx_queue_remove(&e->queue);
+        ngx_queue_insert_head(&cache->window, &e->queue);
+    }
+
+    msg->rsp.start = rsp;
+    msg->rsp.pos = rsp;
+    msg->rsp.last = rsp + e->rsp_len;
+    msg->rsp.end = msg->rsp.last;
+    msg->rsp.temporary = 1;
+    msg->rsp_type = e->rsp_type;
+
+    msg->conn = NULL;
+
+    return NGX_OK;
+}
+
+
+/*
+ * keeps the reply of a cacheable command a master answered; near_cache_ttl
+ * bounds its life when no invalidation push drops it first
+ */
+void
+ngx_stream_redis_cache_store(ngx_stream_redis_msg_t *msg)
+{
+    size_t                           size, len;
+    u_char                          *p;
+    uint64_t                         hash;
+    ngx_str_t                        key, field;
+    ngx_queue_t                     *q;
+    ngx_stream_redis_cache_t        *cache;
+    ngx_stream_redis_cache_entry_t  *e;
+
+    cache = ngx_stream_redis_cache;
+
+    if (cache == NULL || !msg->cache) {
+        return;
+    }
+
+    msg->cache = 0;
+
+    if (msg->readonly || msg->node == NULL
+        || (msg->rsp_type != MSG_RSP_REDIS_BULK
+            && msg->rsp_type != MSG_RSP_REDIS_MULTIBULK))
+    {
+        return;
+    }
+
+    if (redis_req_arg(msg->start, msg->req.last, 1, &key) != NGX_OK) {
+        return;
+    }
+
+    if (msg->type == MSG_REQ_REDIS_HGET) {
+        if (redis_req_arg(msg->start, msg->req.last, 2, &field) != NGX_OK) {
+            return;
+        }
+
+    } else {
+        ngx_str_null(&field);
+    }
+
+    hash = redis_key_hash(key.data, key.len);
+
+    if (cache->seq[hash & cache->mask] != msg->cache_seq) {
+        /* written while the command was in flight */
+        return;
+    }
+
+    len = msg->rsp.last - msg->rsp.pos;
+    size = sizeof(ngx_stream_redis_cache_entry_t) + key.len + field.len + len;
+
+    if (size > cache->window_max) {
+        return;
+    }
+
+    e = ngx_stream_redis_cache_find(cache, hash, msg->type, &key, &field);
+    if (e != NULL) {
+        ngx_stream_redis_cache_remove(cache, e);
+    }
+
+    e = ngx_alloc(size, ngx_cycle->log);
+    if (e == NULL) {
+        return;
+    }
+
+    p = (u_char *) (e + 1);
+
+    e->hash = hash;
+    e->freq = ngx_stream_redis_cache_freq(hash, msg->type, &field);
+    e->expires = ngx_current_msec + cache->conf->near_cache_ttl;
+    e->node = msg->node;
+    e->type = msg->type;
+    e->rsp_type = msg->rsp_type;
+    e->size = size;
+
+    e->key = p;
+    e->key_len = key.len;
+    p = ngx_cpymem(p, key.data, key.len);
+
+    e->field = p;
+    e->field_len = field.len;
+    p = ngx_cpymem(p, field.data, field.len);
+
+    e->rsp = p;
+    e->rsp_len = len;
+    ngx_memcpy(p, msg->rsp.pos, len);
+
+    e->window = 1;
+    e->referenced = 0;
+
+    ngx_queue_insert_tail(&cache->buckets[hash & cache->mask], &e->bucket);
+    ngx_queue_insert_head(&cache->window, &e->queue);
+    cache->window_size += size;
+
+    while (cache->window_size > cache->window_max) {
+        q = ngx_queue_last(&cache->window);
+        ngx_stream_redis_cache_admit(cache,
+            ngx_queue_data(q, ngx_stream_redis_cache_entry_t, queue));
+    }
+
+    ngx_stream_redis_cache_track(cache, msg->node);
+}
+
+
+/* every key msg writes, the moment the proxy sees the command */
+void
+ngx_stream_redis_cache_invalidate(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p)
+{
+    ngx_uint_t               i;
+    ngx_stream_redis_arg_t  *arg;
+
+    if (ngx_stream_redis_cache == NULL) {
+        return;
+    }
+
+    arg = (ngx_stream_redis_arg_t *) p->args.elts + p->keys;
+
+    for (i = 0; i < p->nkeys; i++) {
+        ngx_stream_redis_cache_drop(ngx_stream_redis_cache,
+                                    msg->start + arg->pos, arg->len);
+        arg += msg->command->step;
+    }
+}
+
+
+static ngx_stream_redis_cache_entry_t *
+ngx_stream_redis_cache_find(ngx_stream_redis_cache_t *cache, uint64_t hash,
+    msg_type_t type, ngx_str_t *key, ngx_str_t *field)
+{
+    ngx_queue_t                     *q, *b;
+    ngx_stream_redis_cache_entry_t  *e;
+
+    b = &cache->buckets[hash & cache->mask];
+
+    for (q = ngx_queue_head(b);
+         q != ngx_queue_sentinel(b);
+         q = ngx_queue_next(q))
+    {
+        e = ngx_queue_data(q, ngx_stream_redis_cache_entry_t, bucket);
+
+        if (e->hash == hash
+            && e->type == type
+            && e->key_len == key->len
+            && e->field_len == field->len
+            && ngx_memcmp(e->key, key->data, key->len) == 0
+            && ngx_memcmp(e->field, field->data, field->len) == 0)
+        {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* HGET of two fields of one key are counted apart */
+static uint64_t
+ngx_stream_redis_cache_freq(uint64_t hash, msg_type_t type, ngx_str_t *field)
+{
+    hash ^= (uint64_t) type * 0x9e3779b97f4a7c15ULL;
+
+    if (field->len) {
+        hash ^= redis_key_hash(field->data, field->len) >> 1;
+    }
+
+    return hash;
+}
+
+
+static ngx_int_t
+ngx_stream_redis_cache_cacheable(ngx_stream_redis_cache_t *cache,
+    ngx_str_t *key)
+{
+    ngx_str_t   *prefixes;
+    ngx_uint_t   i;
+
+    if (cache->conf->near_cache_prefixes == NULL) {
+        return 1;
+    }
+
+    prefixes = cache->conf->near_cache_prefixes->elts;
+
+    for (i = 0; i < cache->conf->near_cache_prefixes->nelts; i++) {
+        if (key->len >= prefixes[i].len
+            && ngx_memcmp(key->data, prefixes[i].data, prefixes[i].len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * e leaves the window; it takes the place of what CLOCK would evict only
+ * if it is the more frequent of the two, or a hot key of the worker
+ */
+static void
+ngx_stream_redis_cache_admit(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_cache_entry_t *e)
+{
+    ngx_stream_redis_cache_entry_t  *victim;
+
+    if (e->size > cache->main_max) {
+        ngx_stream_redis_cache_remove(cache, e);
+        return;
+    }
+
+    if (cache->main_size + e->size > cache->main_max) {
+        victim = ngx_stream_redis_cache_victim(cache);
+
+        if (!ngx_stream_redis_cache_expired(victim)
+            && !ngx_stream_redis_hotkeys_hot(e->key, e->key_len)
+            && ngx_stream_redis_sketch_estimate(&cache->sketch, e->freq)
+               <= ngx_stream_redis_sketch_estimate(&cache->sketch,
+                                                   victim->freq))
+        {
+            ngx_stream_redis_cache_remove(cache, e);
+            return;
+        }
+
+        while (cache->main_size + e->size > cache->main_max) {
+            ngx_stream_redis_cache_remove(cache,
+                                       ngx_stream_redis_cache_victim(cache));
+        }
+    }
+
+    ngx_queue_remove(&e->queue);
+    cache->window_size -= e->size;
+
+    /* behind the hand, the last one it gets to */
+    ngx_queue_insert_tail(cache->hand, &e->queue);
+    cache->main_size += e->size;
+
+    e->window = 0;
+}
+
+
+/* the first entry under the hand not referenced since it last passed */
+static ngx_stream_redis_cache_entry_t *
+ngx_stream_redis_cache_victim(ngx_stream_redis_cache_t *cache)
+{
+    ngx_stream_redis_cache_entry_t  *e;
+
+    for ( ;; ) {
+
+        if (cache->hand == &cache->main) {
+            cache->hand = ngx_queue_next(cache->hand);
+        }
+
+        e = ngx_queue_data(cache->hand, ngx_stream_redis_cache_entry_t, queue);
+
+        if (!e->referenced || ngx_stream_redis_cache_expired(e)) {
+            return e;
+        }
+
+        e->referenced = 0;
+        cache->hand = ngx_queue_next(cache->hand);
+    }
+}
+
+
+static void
+ngx_stream_redis_cache_remove(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_cache_entry_t *e)
+{
+    if (e->window) {
+        cache->window_size -= e->size;
+
+    } else {
+        if (cache->hand == &e->queue) {
+            cache->hand = ngx_queue_next(cache->hand);
+        }
+
+        cache->main_size -= e->size;
+    }
+
+    ngx_queue_remove(&e->queue);
+    ngx_queue_remove(&e->bucket);
+
+    ngx_free(e);
+}
+
+
+static void
+ngx_stream_redis_cache_drop(ngx_stream_redis_cache_t *cache, u_char *key,
+    size_t len)
+{
+    uint64_t                         hash;
+    ngx_queue_t                     *q, *next, *b;
+    ngx_stream_redis_cache_entry_t  *e;
+
+    hash = redis_key_hash(key, len);
+
+    cache->seq[hash & cache->mask]++;
+
+    b = &cache->buckets[hash & cache->mask];
+
+    for (q = ngx_queue_head(b); q != ngx_queue_sentinel(b); q = next) {
+        next = ngx_queue_next(q);
+
+        e = ngx_queue_data(q, ngx_stream_redis_cache_entry_t, bucket);
+
+        if (e->hash == hash
+            && e->key_len == len
+            && ngx_memcmp(e->key, key, len) == 0)
+        {
+            ngx_stream_redis_cache_remove(cache, e);
+        }
+    }
+}
+
+
+/* the entries node served, all of them if node is NULL */
+static void
+ngx_stream_redis_cache_flush(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_node_t *node)
+{
+    ngx_uint_t                       i;
+    ngx_queue_t                     *q, *next, *queues[2];
+    ngx_stream_redis_cache_entry_t  *e;
+
+    queues[0] = &cache->window;
+    queues[1] = &cache->main;
+
+    for (i = 0; i < 2; i++) {
+
+        for (q = ngx_queue_head(queues[i]);
+             q != ngx_queue_sentinel(queues[i]);
+             q = next)
+        {
+            next = ngx_queue_next(q);
+
+            e = ngx_queue_data(q, ngx_stream_redis_cache_entry_t, queue);
+
+            if (node == NULL || e->node == node) {
+                ngx_stream_redis_cache_remove(cache, e);
+            }
+        }
+    }
+
+    /* replies in flight may predate the invalidations missed */
+    for (i = 0; i <= cache->mask; i++) {
+        cache->seq[i]++;
+    }
+}
+
+
+/* connects the tracking connection of node unless it is up or resting */
+static void
+ngx_stream_redis_cache_track(ngx_stream_redis_cache_t *cache,
+    ngx_stream_redis_node_t *node)
+{
+    u_char                        *p;
+    ngx_int_t                      rc;
+    ngx_connection_t              *c;
+    ngx_stream_redis_tracker_t    *t;
+    ngx_stream_redis_node_peer_t  *np;
+
+    np = ngx_stream_redis_cluster_node_peer(node);
+    if (np == NULL) {
+        return;
+    }
+
+    t = np->tracker;
+
+    if (t == NULL) {
+        t = ngx_calloc(sizeof(ngx_stream_redis_tracker_t), ngx_cycle->log);
+        if (t == NULL) {
+            return;
+        }
+
+        p = ngx_alloc(NGX_STREAM_REDIS_TRACKER_BUFFER, ngx_cycle->log);
+        if (p == NULL) {
+            ngx_free(t);
+            return;
+        }
+
+        t->buf.start = p;
+        t->buf.end = p + NGX_STREAM_REDIS_TRACKER_BUFFER;
+        t->buf.temporary = 1;
+
+        t->node = node;
+        t->name.data = node->addr;
+        t->name.len = node->addr_len;
+        t->retry = ngx_current_msec;
+
+        np->tracker = t;
+    }
+
+    if (t->peer.connection != NULL
+        || (ngx_msec_int_t) (ngx_current_msec - t->retry) < 0)
+    {
+        return;
+    }
+
+    if (ngx_stream_redis_cluster_node_addr(node) == NULL) {
+        t->retry = ngx_current_msec + NGX_STREAM_REDIS_TRACKER_REFUSED;
+        return;
+    }
+
+    t->buf.pos = t->buf.start;
+    t->buf.last = t->buf.start;
+    ngx_memzero(&t->rsp, sizeof(redis_rsp_parser_t));
+    t->sent = 0;
+    t->setup = 2;
+    t->tracking = 0;
+
+    ngx_memzero(&t->peer, sizeof(ngx_peer_connection_t));
+
+    t->peer.sockaddr = np->addr->sockaddr;
+    t->peer.socklen = np->addr->socklen;
+    t->peer.name = &t->name;
+    t->peer.get = ngx_event_get_peer;
+    t->peer.log = ngx_cycle->log;
+    t->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&t->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        t->peer.connection = NULL;
+        t->retry = ngx_current_msec + NGX_STREAM_REDIS_TRACKER_RETRY;
+        return;
+    }
+
+    c = t->peer.connection;
+
+    c->data = t;
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->read->handler = ngx_stream_redis_tracker_read_handler;
+    c->write->handler = ngx_stream_redis_tracker_write_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, cache->conf->refresh_timeout);
+        return;
+    }
+
+    ngx_stream_redis_tracker_write_handler(c->write);
+}
+
+
+static void
+ngx_stream_redis_tracker_write_handler(ngx_event_t *wev)
+{
+    ssize_t                      n;
+    ngx_connection_t            *c;
+    ngx_stream_redis_cache_t    *cache;
+    ngx_stream_redis_tracker_t  *t;
+
+    c = wev->data;
+    t = c->data;
+    cache = ngx_stream_redis_cache;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "[redis_proxy] tracking connect to %V timed out",
+                      &t->name);
+        ngx_stream_redis_tracker_close(t, NGX_STREAM_REDIS_TRACKER_RETRY);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    while (t->sent < cache->setup_len) {
+
+        n = c->send(c, cache->setup + t->sent, cache->setup_len - t->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_stream_redis_tracker_close(t, NGX_STREAM_REDIS_TRACKER_RETRY);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        t->sent += n;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_stream_redis_tracker_close(t, NGX_STREAM_REDIS_TRACKER_RETRY);
+    }
+}
+
+
+static void
+ngx_stream_redis_tracker_read_handler(ngx_event_t *rev)
+{
+    size_t                       size;
+    ssize_t                      n;
+    u_char                      *p;
+    ngx_buf_t                   *b;
+    ngx_connection_t            *c;
+    ngx_stream_redis_tracker_t  *t;
+
+    c = rev->data;
+    t = c->data;
+    b = &t->buf;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+
+            if (b->pos > b->start) {
+                b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+                b->pos = b->start;
+
+            } else {
+                /* an invalidation of many keys at once */
+
+                size = 2 * (b->end - b->start);
+
+                p = ngx_alloc(size, c->log);
+                if (p == NULL) {
+                    ngx_stream_redis_tracker_close(t,
+                                             NGX_STREAM_REDIS_TRACKER_RETRY);
+                    return;
+                }
+
+                b->last = ngx_cpymem(p, b->pos, b->last - b->pos);
+                ngx_free(b->start);
+
+                b->start = p;
+                b->pos = p;
+                b->end = p + size;
+            }
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "[redis_proxy] %V closed the tracking connection, "
+                          "near cache entries from it dropped", &t->name);
+            ngx_stream_redis_tracker_close(t, NGX_STREAM_REDIS_TRACKER_RETRY);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_stream_redis_tracker_process(t) != NGX_OK) {
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_redis_tracker_close(t, NGX_STREAM_REDIS_TRACKER_RETRY);
+    }
+}
+
+
+/* the replies to HELLO and CLIENT TRACKING, then invalidation pushes */
+static ngx_int_t
+ngx_stream_redis_tracker_process(ngx_stream_redis_tracker_t *t)
+{
+    u_char                    *end;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    msg_type_t                 type;
+    ngx_stream_redis_cache_t  *cache;
+
+    b = &t->buf;
+    cache = ngx_stream_redis_cache;
+
+    for ( ;; ) {
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+            return NGX_OK;
+        }
+
+        rc = redis_parse_rsp(b, &t->rsp, &end, &type);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_OK;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "[redis_proxy] %V sent an invalid push", &t->name);
+            ngx_stream_redis_tracker_close(t, NGX_STREAM_REDIS_TRACKER_RETRY);
+            return NGX_ERROR;
+        }
+
+        if (t->setup) {
+            t->setup--;
+
+            if (type >= MSG_RSP_REDIS_ERROR
+                && type <= MSG_RSP_REDIS_ERROR_NOREPLICAS)
+            {
+                /* before redis 6, entries live for near_cache_ttl */
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                              "[redis_proxy] %V refused client tracking: "
+                              "\"%*s\"", &t->name,
+                              end - b->pos - 2, b->pos);
+                ngx_stream_redis_tracker_close(t,
+                                           NGX_STREAM_REDIS_TRACKER_REFUSED);
+                return NGX_ERROR;
+            }
+
+            if (t->setup == 0) {
+                /* writes before now were not reported */
+                t->tracking = 1;
+                ngx_stream_redis_cache_flush(cache, t->node);
+
+                ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                               "[redis_proxy] tracking %V", &t->name);
+            }
+
+        } else if (type == MSG_RSP_REDIS_PUSH) {
+            ngx_stream_redis_tracker_push(cache, b->pos, end);
+        }
+
+        b->pos = end;
+    }
+}
+
+
+/*
+ *   >2 $10 invalidate *n $len key ...
+ *   >2 $10 invalidate _                   after FLUSHALL or FLUSHDB
+ */
+static void
+ngx_stream_redis_tracker_push(ngx_stream_redis_cache_t *cache, u_char *p,
+    u_char *last)
+{
+    ngx_int_t  i, n;
+    ngx_str_t  kind, key;
+
+    if (redis_resp_int(&p, last, '>', &n) != NGX_OK || n < 2) {
+        return;
+    }
+
+    if (redis_resp_bulk(&p, last, &kind) != NGX_OK
+        || kind.len != sizeof("invalidate") - 1
+        || ngx_strncasecmp(kind.data, (u_char *) "invalidate", kind.len) != 0)
+    {
+        return;
+    }
+
+    if (p < last && *p == '_') {
+        ngx_stream_redis_cache_flush(cache, NULL);
+        return;
+    }
+
+    if (redis_resp_int(&p, last, '*', &n) != NGX_OK) {
+        return;
+    }
+
+    if (n < 0) {
+        ngx_stream_redis_cache_flush(cache, NULL);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (redis_resp_bulk(&p, last, &key) != NGX_OK) {
+            return;
+        }
+
+        ngx_stream_redis_cache_drop(cache, key.data, key.len);
+    }
+}
+
+
+/*
+ * invalidations may have been missed, the entries of the node go; the
+ * next reply cached from it reconnects after retry
+ */
+static void
+ngx_stream_redis_tracker_close(ngx_stream_redis_tracker_t *t,
+    ngx_msec_t retry)
+{
+    if (t->peer.connection) {
+        ngx_close_connection(t->peer.connection);
+        t->peer.connection = NULL;
+    }
+
+    t->tracking = 0;
+    t->retry = ngx_current_msec + retry;
+
+    ngx_stream_redis_cache_flush(ngx_stream_redis_cache, t->node);
+}
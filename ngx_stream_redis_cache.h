@@ -0,0 +1,41 @@
+#ifndef NGX_STREAM_REDIS_CACHE_H
+#define NGX_STREAM_REDIS_CACHE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_redis_proxy_module.h"
+#include "ngx_redis_proto.h"
+
+
+/*
+ * a RESP3 connection to a master in CLIENT TRACKING BCAST mode, per
+ * worker; it only ever receives invalidation pushes
+ */
+struct ngx_stream_redis_tracker_s {
+    ngx_peer_connection_t                  peer;
+    ngx_str_t                              name;
+    ngx_stream_redis_node_t               *node;
+
+    ngx_buf_t                              buf;
+    redis_rsp_parser_t                     rsp;
+    size_t                                 sent;
+    ngx_uint_t                             setup;      /* replies due */
+    ngx_msec_t                             retry;      /* no connect before */
+
+    unsigned                               tracking:1;
+};
+
+
+ngx_int_t ngx_stream_redis_cache_init(ngx_cycle_t *cycle);
+void ngx_stream_redis_cache_exit(ngx_cycle_t *cycle);
+
+ngx_int_t ngx_stream_redis_cache_lookup(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p);
+void ngx_stream_redis_cache_store(ngx_stream_redis_msg_t *msg);
+void ngx_stream_redis_cache_invalidate(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p);
+
+
+#endif /* NGX_STREAM_REDIS_CACHE_H */
@@ -0,0 +1,2109 @@
+
+#include "ngx_stream_redis_cluster.h"
+#include "ngx_stream_redis_proxy_module.h"
+#include "ngx_redis_proto.h"
+
+
+#define NGX_STREAM_REDIS_REFRESH_BUFFER        16384
+#define NGX_STREAM_REDIS_REFRESH_MAX_BUFFER    (16 * 1024 * 1024)
+#define NGX_STREAM_REDIS_REFRESH_RETRY         1000
+#define NGX_STREAM_REDIS_REFRESH_DEBOUNCE      100
+#define NGX_STREAM_REDIS_SEQ_TRIES             4096
+
+
+typedef struct {
+    ngx_event_t                            timer;
+    ngx_peer_connection_t                  peer;
+    ngx_str_t                              name;
+    ngx_pool_t                            *pool;
+    ngx_buf_t                             *buf;
+    redis_rsp_parser_t                     rsp;
+    uint16_t                              *slots;
+    uint16_t                              *migrating;  /* NULL if unknown */
+    uint16_t                              *replicas;   /* per node */
+    uint8_t                               *nreplicas;  /* per master node */
+    ngx_uint_t                             framed;     /* replies in */
+    size_t                                 sent;
+    ngx_uint_t                             seed;
+    ngx_uint_t                             stale;
+    ngx_stream_redis_cluster_conf_t       *conf;
+} ngx_stream_redis_cluster_refresh_t;
+
+
+/*
+ * after a refresh, the worker that ran it asks every master with replicas
+ * for INFO replication, one master at a time
+ */
+typedef struct {
+    ngx_peer_connection_t                  peer;
+    ngx_str_t                              name;
+    ngx_pool_t                            *pool;
+    ngx_buf_t                             *buf;
+    redis_rsp_parser_t                     rsp;
+    size_t                                 sent;
+    ngx_uint_t                             next;       /* node to try next */
+    ngx_uint_t                             master;     /* node asked now */
+    ngx_stream_redis_cluster_conf_t       *conf;
+} ngx_stream_redis_cluster_lag_t;
+
+
+/* a slaveN line of INFO replication */
+typedef struct {
+    ngx_int_t                              node;
+    ngx_uint_t                             online;
+    off_t                                  offset;
+    ngx_msec_t                             lag;
+} ngx_stream_redis_cluster_slave_t;
+
+
+static ngx_int_t ngx_stream_redis_cluster_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_stream_redis_cluster_node_find(
+    ngx_stream_redis_cluster_t *cl, u_char *addr, size_t len);
+static void ngx_stream_redis_cluster_unlock_dead(
+    ngx_stream_redis_cluster_t *cl);
+
+static void ngx_stream_redis_cluster_refresh_handler(ngx_event_t *ev);
+static ngx_int_t ngx_stream_redis_cluster_refresh_start(
+    ngx_stream_redis_cluster_refresh_t *r);
+static ngx_int_t ngx_stream_redis_cluster_refresh_seed(
+    ngx_stream_redis_cluster_refresh_t *r);
+static void ngx_stream_redis_cluster_refresh_write_handler(ngx_event_t *wev);
+static void ngx_stream_redis_cluster_refresh_read_handler(ngx_event_t *rev);
+static void ngx_stream_redis_cluster_refresh_done(
+    ngx_stream_redis_cluster_refresh_t *r, ngx_int_t rc);
+static ngx_int_t ngx_stream_redis_cluster_parse_slots(
+    ngx_stream_redis_cluster_refresh_t *r);
+static ngx_int_t ngx_stream_redis_cluster_parse_node(
+    ngx_stream_redis_cluster_refresh_t *r, u_char **pos, u_char *last,
+    ngx_uint_t replica);
+static ngx_int_t ngx_stream_redis_cluster_parse_nodes(
+    ngx_stream_redis_cluster_refresh_t *r, u_char *pos, u_char *last);
+static ngx_int_t ngx_stream_redis_cluster_token(u_char **pos, u_char *last,
+    ngx_str_t *token);
+static ngx_uint_t ngx_stream_redis_cluster_apply(
+    ngx_stream_redis_cluster_t *cl, uint16_t *slots);
+static void ngx_stream_redis_cluster_apply_migrating(
+    ngx_stream_redis_cluster_t *cl, uint16_t *migrating);
+static void ngx_stream_redis_cluster_apply_replicas(
+    ngx_stream_redis_cluster_t *cl, uint16_t *replicas, uint8_t *nreplicas);
+
+static void ngx_stream_redis_cluster_lag_start(
+    ngx_stream_redis_cluster_conf_t *conf);
+static void ngx_stream_redis_cluster_lag_next(
+    ngx_stream_redis_cluster_lag_t *l);
+static void ngx_stream_redis_cluster_lag_write_handler(ngx_event_t *wev);
+static void ngx_stream_redis_cluster_lag_read_handler(ngx_event_t *rev);
+static void ngx_stream_redis_cluster_lag_done(
+    ngx_stream_redis_cluster_lag_t *l);
+static ngx_int_t ngx_stream_redis_cluster_parse_info(
+    ngx_stream_redis_cluster_lag_t *l, u_char *pos, u_char *last);
+
+
+static ngx_str_t                      ngx_stream_redis_cluster_zone_name =
+    ngx_string("redis_cluster");
+
+static ngx_stream_redis_cluster_t    *ngx_stream_redis_cluster;
+static ngx_stream_redis_node_peer_t  *ngx_stream_redis_cluster_peers;
+
+static ngx_stream_redis_cluster_refresh_t  ngx_stream_redis_cluster_refresh;
+static ngx_stream_redis_cluster_lag_t      ngx_stream_redis_cluster_lag;
+
+/*
+ * keys a node answered ASK for, per worker: a key once migrated stays on
+ * the importing node, so later commands for it skip the source node
+ */
+typedef struct {
+    uint64_t                               hash;
+    uint16_t                               slot;
+    uint16_t                               node;
+} ngx_stream_redis_ask_t;
+
+static ngx_stream_redis_ask_t  ngx_stream_redis_cluster_asks[NGX_STREAM_REDIS_ASK_CACHE];
+
+/* CLUSTER NODES is pipelined after CLUSTER SLOTS for the slot migrations */
+static u_char  ngx_stream_redis_cluster_slots_cmd[] =
+    "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n"
+    "*2\r\n$7\r\nCLUSTER\r\n$5\r\nNODES\r\n";
+
+static u_char  ngx_stream_redis_cluster_info_cmd[] =
+    "*2\r\n$4\r\nINFO\r\n$11\r\nreplication\r\n";
+
+
+#define ngx_stream_redis_cluster_write_lock(cl)                               \
+    ngx_spinlock(&(cl)->lock, ngx_pid, 1024);                                 \
+    (cl)->seq++;                                                              \
+    ngx_memory_barrier()
+
+#define ngx_stream_redis_cluster_write_unlock(cl)                             \
+    ngx_memory_barrier();                                                     \
+    (cl)->seq++;                                                              \
+    ngx_unlock(&(cl)->lock)
+
+
+ngx_int_t
+ngx_stream_redis_cluster_add_zone(ngx_conf_t *cf)
+{
+    size_t                              size;
+    ngx_shm_zone_t                     *shm_zone;
+
+    size = ngx_align(sizeof(ngx_stream_redis_cluster_t), ngx_pagesize)
+           + 8 * ngx_pagesize;
+
+    shm_zone = ngx_shared_memory_add(cf, &ngx_stream_redis_cluster_zone_name,
+                                     size, &ngx_stream_redis_cluster_zone_name);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (shm_zone->init == ngx_stream_redis_cluster_init_zone) {
+        /* every redis_proxy_pass shares the one zone */
+        return NGX_OK;
+    }
+
+    shm_zone->init = ngx_stream_redis_cluster_init_zone;
+    shm_zone->data = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_redis_cluster_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_uint_t                          i;
+    ngx_slab_pool_t                    *shpool;
+    ngx_stream_redis_cluster_t         *cl;
+
+    if (data) {
+        /* reload: keep the topology learned by the old workers */
+        shm_zone->data = data;
+        ngx_stream_redis_cluster = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    cl = ngx_slab_calloc(shpool, sizeof(ngx_stream_redis_cluster_t));
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < NGX_STREAM_REDIS_SLOTS; i++) {
+        cl->slots[i] = NGX_STREAM_REDIS_NODE_NONE;
+        cl->migrating[i] = NGX_STREAM_REDIS_NODE_NONE;
+    }
+
+    shpool->data = cl;
+    shm_zone->data = cl;
+    ngx_stream_redis_cluster = cl;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_stream_redis_cluster_init(ngx_cycle_t *cycle)
+{
+    ngx_stream_redis_cluster_conf_t     *rccf;
+    ngx_stream_redis_cluster_refresh_t  *r;
+
+    rccf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_redis_proxy_module);
+
+    if (ngx_stream_redis_cluster == NULL || rccf == NULL
+        || rccf->upstream == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_stream_redis_cluster_peers = ngx_pcalloc(cycle->pool,
+                         NGX_STREAM_REDIS_MAX_NODES
+                         * sizeof(ngx_stream_redis_node_peer_t));
+    if (ngx_stream_redis_cluster_peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    r = &ngx_stream_redis_cluster_refresh;
+
+    ngx_memzero(r, sizeof(ngx_stream_redis_cluster_refresh_t));
+
+    r->conf = rccf;
+    r->seed = ngx_worker;
+
+    r->timer.handler = ngx_stream_redis_cluster_refresh_handler;
+    r->timer.data = r;
+    r->timer.log = cycle->log;
+
+    /* this worker may replace one that crashed holding the lock */
+    ngx_stream_redis_cluster_unlock_dead(ngx_stream_redis_cluster);
+
+    /* never block the worker on the cluster, fetch from the event loop */
+    ngx_add_timer(&r->timer, 1);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_stream_redis_cluster_exit(ngx_cycle_t *cycle)
+{
+    ngx_stream_redis_cluster_refresh_t  *r;
+
+    r = &ngx_stream_redis_cluster_refresh;
+
+    if (r->timer.timer_set) {
+        ngx_del_timer(&r->timer);
+    }
+
+    if (r->peer.connection) {
+        ngx_stream_redis_cluster_refresh_done(r, NGX_ABORT);
+    }
+
+    if (ngx_stream_redis_cluster_lag.pool) {
+        ngx_stream_redis_cluster_lag_done(&ngx_stream_redis_cluster_lag);
+    }
+}
+
+
+/*
+ * ngx_spinlock() never gives up on a lock whose owner died, and a writer
+ * that died in the middle of an update leaves seq odd; the half written
+ * table is fixed by the next refresh
+ */
+static void
+ngx_stream_redis_cluster_unlock_dead(ngx_stream_redis_cluster_t *cl)
+{
+    ngx_atomic_uint_t                   pid;
+
+    pid = cl->lock;
+
+    if (pid == 0 || (ngx_pid_t) pid == ngx_pid) {
+        return;
+    }
+
+    if (kill((ngx_pid_t) pid, 0) != -1 || ngx_errno != NGX_ESRCH) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cl->lock, pid, ngx_pid)) {
+        return;
+    }
+
+    if (cl->seq & 1) {
+        ngx_memory_barrier();
+        cl->seq++;
+    }
+
+    cl->stale = 1;
+
+    ngx_unlock(&cl->lock);
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "[redis_proxy] released the cluster lock of dead "
+                  "process %P", (ngx_pid_t) pid);
+}
+
+
+static ngx_int_t
+ngx_stream_redis_cluster_node_find(ngx_stream_redis_cluster_t *cl,
+    u_char *addr, size_t len)
+{
+    ngx_uint_t                          i, n;
+    ngx_stream_redis_node_t            *node;
+
+    n = cl->nnodes;
+
+    ngx_memory_barrier();
+
+    for (i = 0; i < n; i++) {
+        node = &cl->nodes[i];
+
+        if (node->addr_len == len && ngx_memcmp(node->addr, addr, len) == 0) {
+            return i;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/*
+ * addr: 127.0.0.1:7000
+ *
+ * returns the index of the node, interning it on first use
+ */
+ngx_int_t
+ngx_stream_redis_cluster_node_add(u_char *addr, size_t len)
+{
+    ngx_int_t                           index;
+    ngx_stream_redis_node_t            *node;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || len == 0 || len > NGX_SOCKADDR_STRLEN) {
+        return NGX_ERROR;
+    }
+
+    index = ngx_stream_redis_cluster_node_find(cl, addr, len);
+    if (index != NGX_DECLINED) {
+        return index;
+    }
+
+    ngx_spinlock(&cl->lock, ngx_pid, 1024);
+
+    index = ngx_stream_redis_cluster_node_find(cl, addr, len);
+    if (index != NGX_DECLINED) {
+        ngx_unlock(&cl->lock);
+        return index;
+    }
+
+    if (cl->nnodes == NGX_STREAM_REDIS_MAX_NODES) {
+        ngx_unlock(&cl->lock);
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[redis_proxy] too many cluster nodes, \"%*s\" ignored",
+                      len, addr);
+        return NGX_ERROR;
+    }
+
+    node = &cl->nodes[cl->nnodes];
+
+    ngx_memcpy(node->addr, addr, len);
+    node->addr_len = len;
+    node->generation = cl->generation;
+
+    /* publish the entry before the new count */
+    ngx_memory_barrier();
+
+    index = cl->nnodes++;
+
+    ngx_unlock(&cl->lock);
+
+    return index;
+}
+
+
+ngx_int_t
+ngx_stream_redis_cluster_set_slots(ngx_uint_t first, ngx_uint_t last,
+    ngx_uint_t node)
+{
+    ngx_uint_t                          i;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || node >= cl->nnodes
+        || first > last || last >= NGX_STREAM_REDIS_SLOTS)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_stream_redis_cluster_write_lock(cl);
+
+    cl->generation++;
+    cl->nodes[node].generation = cl->generation;
+
+    for (i = first; i <= last; i++) {
+        cl->slots[i] = (uint16_t) node;
+
+        /* MOVED, the migration is over */
+        cl->migrating[i] = NGX_STREAM_REDIS_NODE_NONE;
+    }
+
+    ngx_stream_redis_cluster_write_unlock(cl);
+
+    return NGX_OK;
+}
+
+
+/* replaces the replicas of a master, n of them at most MAX_REPLICAS */
+ngx_int_t
+ngx_stream_redis_cluster_set_replicas(ngx_uint_t node, uint16_t *replicas,
+    ngx_uint_t n)
+{
+    ngx_uint_t                          i;
+    ngx_stream_redis_node_t            *master;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || node >= cl->nnodes) {
+        return NGX_ERROR;
+    }
+
+    master = &cl->nodes[node];
+
+    n = ngx_min(n, NGX_STREAM_REDIS_MAX_REPLICAS);
+
+    if (master->nreplicas == n
+        && (n == 0
+            || ngx_memcmp(master->replicas, replicas, n * sizeof(uint16_t))
+               == 0))
+    {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (replicas[i] >= cl->nnodes || replicas[i] == node) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_stream_redis_cluster_write_lock(cl);
+
+    if (n) {
+        ngx_memcpy(master->replicas, replicas, n * sizeof(uint16_t));
+    }
+
+    master->nreplicas = n;
+
+    ngx_stream_redis_cluster_write_unlock(cl);
+
+    return NGX_OK;
+}
+
+
+/*
+ * the index of the node serving slot, NGX_STREAM_REDIS_NODE_NONE if none;
+ * a single entry is never torn, so when writers keep seq busy for too long
+ * (or one died with seq odd) the entry is taken as it is, at worst it is
+ * the old owner and the node answers MOVED
+ */
+ngx_uint_t
+ngx_stream_redis_cluster_slot_node(ngx_uint_t slot)
+{
+    uint16_t                            n;
+    ngx_uint_t                          tries;
+    ngx_atomic_uint_t                   seq;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || slot >= NGX_STREAM_REDIS_SLOTS) {
+        return NGX_STREAM_REDIS_NODE_NONE;
+    }
+
+    for (tries = 0; tries < NGX_STREAM_REDIS_SEQ_TRIES; tries++) {
+        seq = cl->seq;
+
+        if (seq & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        n = cl->slots[slot];
+
+        ngx_memory_barrier();
+
+        if (cl->seq == seq) {
+            return n;
+        }
+    }
+
+    return *(volatile uint16_t *) &cl->slots[slot];
+}
+
+
+/* the node slot is being migrated to, NGX_STREAM_REDIS_NODE_NONE if none */
+ngx_uint_t
+ngx_stream_redis_cluster_migrating(ngx_uint_t slot)
+{
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || slot >= NGX_STREAM_REDIS_SLOTS) {
+        return NGX_STREAM_REDIS_NODE_NONE;
+    }
+
+    return *(volatile uint16_t *) &cl->migrating[slot];
+}
+
+
+/* an ASK reply for key: the slot is migrating and key is on node already */
+void
+ngx_stream_redis_cluster_ask_add(ngx_uint_t slot, u_char *key, size_t len,
+    ngx_uint_t node)
+{
+    uint64_t                            h;
+    ngx_stream_redis_ask_t             *a;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || slot >= NGX_STREAM_REDIS_SLOTS || node >= cl->nnodes) {
+        return;
+    }
+
+    if (cl->migrating[slot] != node) {
+        cl->migrating[slot] = (uint16_t) node;
+    }
+
+    if (key == NULL) {
+        return;
+    }
+
+    h = redis_key_hash(key, len);
+
+    a = &ngx_stream_redis_cluster_asks[h % NGX_STREAM_REDIS_ASK_CACHE];
+
+    a->hash = h;
+    a->slot = (uint16_t) slot;
+    a->node = (uint16_t) node;
+}
+
+
+/*
+ * the importing node for a key seen in an ASK reply, while its slot is
+ * still migrating there; NULL sends the command to the slot owner
+ */
+ngx_stream_redis_node_t *
+ngx_stream_redis_cluster_ask_route(ngx_uint_t slot, u_char *key, size_t len)
+{
+    uint64_t                            h;
+    ngx_uint_t                          node;
+    ngx_stream_redis_ask_t             *a;
+
+    node = ngx_stream_redis_cluster_migrating(slot);
+
+    if (node == NGX_STREAM_REDIS_NODE_NONE) {
+        return NULL;
+    }
+
+    h = redis_key_hash(key, len);
+
+    a = &ngx_stream_redis_cluster_asks[h % NGX_STREAM_REDIS_ASK_CACHE];
+
+    if (a->hash != h || a->slot != slot || a->node != node) {
+        return NULL;
+    }
+
+    return &ngx_stream_redis_cluster->nodes[node];
+}
+
+
+ngx_stream_redis_node_t *
+ngx_stream_redis_cluster_route(ngx_uint_t slot)
+{
+    ngx_uint_t  n;
+
+    n = ngx_stream_redis_cluster_slot_node(slot);
+
+    if (n == NGX_STREAM_REDIS_NODE_NONE) {
+        return NULL;
+    }
+
+    return &ngx_stream_redis_cluster->nodes[n];
+}
+
+
+ngx_stream_redis_node_t *
+ngx_stream_redis_cluster_node(ngx_uint_t node)
+{
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || node >= cl->nnodes) {
+        return NULL;
+    }
+
+    return &cl->nodes[node];
+}
+
+
+/*
+ * a node to send a command to while its slot is not covered yet, it answers
+ * with MOVED and the refresh fills the table
+ */
+ngx_stream_redis_node_t *
+ngx_stream_redis_cluster_any(void)
+{
+    ngx_int_t                           index;
+    ngx_uint_t                          i, k, naddrs;
+    ngx_stream_redis_cluster_t         *cl;
+    ngx_stream_upstream_server_t       *us;
+    ngx_stream_redis_cluster_refresh_t *r;
+
+    cl = ngx_stream_redis_cluster;
+    r = &ngx_stream_redis_cluster_refresh;
+
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    if (cl->nnodes) {
+        return &cl->nodes[ngx_random() % cl->nnodes];
+    }
+
+    if (r->conf == NULL) {
+        return NULL;
+    }
+
+    naddrs = 0;
+
+    us = r->conf->upstream->servers->elts;
+    for (i = 0; i < r->conf->upstream->servers->nelts; i++) {
+        naddrs += us[i].naddrs;
+    }
+
+    if (naddrs == 0) {
+        return NULL;
+    }
+
+    k = ngx_random() % naddrs;
+
+    for (i = 0; i < r->conf->upstream->servers->nelts; i++) {
+        if (k < us[i].naddrs) {
+            index = ngx_stream_redis_cluster_node_add(us[i].addrs[k].name.data,
+                                                      us[i].addrs[k].name.len);
+            if (index == NGX_ERROR) {
+                return NULL;
+            }
+
+            return &cl->nodes[index];
+        }
+
+        k -= us[i].naddrs;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * copies the replicas of master node, returns how many there are; none
+ * if no consistent copy could be taken, reads then go to the master
+ */
+ngx_uint_t
+ngx_stream_redis_cluster_replicas(ngx_stream_redis_node_t *node,
+    uint16_t *replicas)
+{
+    ngx_uint_t                          n, tries;
+    ngx_atomic_uint_t                   seq;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (cl == NULL || node == NULL) {
+        return 0;
+    }
+
+    for (tries = 0; tries < NGX_STREAM_REDIS_SEQ_TRIES; tries++) {
+        seq = cl->seq;
+
+        if (seq & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        n = ngx_min(node->nreplicas, NGX_STREAM_REDIS_MAX_REPLICAS);
+        ngx_memcpy(replicas, node->replicas, n * sizeof(uint16_t));
+
+        ngx_memory_barrier();
+
+        if (cl->seq == seq) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_stream_redis_node_peer_t *
+ngx_stream_redis_cluster_node_peer(ngx_stream_redis_node_t *node)
+{
+    if (ngx_stream_redis_cluster_peers == NULL || node == NULL) {
+        return NULL;
+    }
+
+    return &ngx_stream_redis_cluster_peers[node - ngx_stream_redis_cluster->nodes];
+}
+
+
+/*
+ * the socket address of node, parsed once per worker; a node named by
+ * hostname (cluster-preferred-endpoint-type hostname) is refused, it
+ * would block the worker in getaddrinfo()
+ */
+ngx_addr_t *
+ngx_stream_redis_cluster_node_addr(ngx_stream_redis_node_t *node)
+{
+    ngx_url_t                      u;
+    ngx_int_t                      rc;
+    ngx_addr_t                    *addr;
+    ngx_stream_redis_node_peer_t  *np;
+
+    np = ngx_stream_redis_cluster_node_peer(node);
+    if (np == NULL || np->bad_addr) {
+        return NULL;
+    }
+
+    if (np->addr) {
+        return np->addr;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url.data = node->addr;
+    u.url.len = node->addr_len;
+    u.default_port = 6379;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(ngx_cycle->pool, &u) != NGX_OK || u.host.len == 0) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[redis_proxy] invalid cluster node \"%*s\"",
+                      node->addr_len, node->addr);
+        np->bad_addr = 1;
+        return NULL;
+    }
+
+    if (u.naddrs) {
+        /* an IPv6 literal is converted even with no_resolve */
+        np->addr = &u.addrs[0];
+        return np->addr;
+    }
+
+    addr = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_addr_t));
+    if (addr == NULL) {
+        return NULL;
+    }
+
+    rc = ngx_parse_addr(ngx_cycle->pool, addr, u.host.data, u.host.len);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[redis_proxy] cluster node \"%*s\" is not an IP "
+                      "address, hostnames are not resolved, set "
+                      "cluster-preferred-endpoint-type to ip",
+                      node->addr_len, node->addr);
+        np->bad_addr = 1;
+        return NULL;
+    }
+
+    if (rc != NGX_OK) {
+        return NULL;
+    }
+
+    switch (addr->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        ((struct sockaddr_in6 *) addr->sockaddr)->sin6_port = htons(u.port);
+        break;
+#endif
+
+    default: /* AF_INET */
+        ((struct sockaddr_in *) addr->sockaddr)->sin_port = htons(u.port);
+        break;
+    }
+
+    addr->name.data = node->addr;
+    addr->name.len = node->addr_len;
+
+    np->addr = addr;
+
+    return addr;
+}
+
+
+static void
+ngx_stream_redis_cluster_refresh_handler(ngx_event_t *ev)
+{
+    ngx_stream_redis_cluster_refresh_t  *r;
+
+    r = ev->data;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    if (r->peer.connection) {
+        return;
+    }
+
+    ngx_stream_redis_cluster_unlock_dead(ngx_stream_redis_cluster);
+
+    if (ngx_stream_redis_cluster_refresh_start(r) == NGX_DECLINED) {
+        ngx_add_timer(&r->timer, ngx_stream_redis_cluster->stale
+                                 ? NGX_STREAM_REDIS_REFRESH_DEBOUNCE
+                                 : r->conf->refresh_interval);
+    }
+}
+
+
+/*
+ * called on every MOVED: a reshard moves thousands of slots at once, so
+ * instead of patching them one redirect at a time all sessions in all
+ * workers share a single full refresh, at most one per debounce period
+ */
+void
+ngx_stream_redis_cluster_refresh_stale(void)
+{
+    ngx_stream_redis_cluster_t          *cl;
+    ngx_stream_redis_cluster_refresh_t  *r;
+
+    cl = ngx_stream_redis_cluster;
+    r = &ngx_stream_redis_cluster_refresh;
+
+    if (cl == NULL || r->conf == NULL) {
+        return;
+    }
+
+    if (!cl->stale) {
+        ngx_atomic_cmp_set(&cl->stale, 0, 1);
+    }
+
+    if (r->peer.connection || ngx_exiting) {
+        return;
+    }
+
+    if (r->timer.timer_set
+        && r->timer.timer.key <= ngx_current_msec
+                                 + NGX_STREAM_REDIS_REFRESH_DEBOUNCE)
+    {
+        return;
+    }
+
+    ngx_add_timer(&r->timer, NGX_STREAM_REDIS_REFRESH_DEBOUNCE);
+}
+
+
+/*
+ * returns NGX_DECLINED if another worker owns the refresh or refreshed
+ * recently, otherwise refresh_done() rearms the timer
+ */
+static ngx_int_t
+ngx_stream_redis_cluster_refresh_start(ngx_stream_redis_cluster_refresh_t *r)
+{
+    ngx_int_t                           rc;
+    ngx_msec_t                          now;
+    ngx_uint_t                          i;
+    ngx_atomic_uint_t                   lock;
+    ngx_connection_t                   *c;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+    now = ngx_current_msec;
+
+    if (cl->refreshed
+        && now - cl->refreshed < (cl->stale ? NGX_STREAM_REDIS_REFRESH_DEBOUNCE
+                                            : r->conf->refresh_interval))
+    {
+        return NGX_DECLINED;
+    }
+
+    lock = cl->refresh_lock;
+
+    if (lock != 0 && now - cl->refresh_start < 2 * r->conf->refresh_timeout) {
+        return NGX_DECLINED;
+    }
+
+    /* a stale lock means its owner died in the middle of a refresh */
+
+    if (!ngx_atomic_cmp_set(&cl->refresh_lock, lock, ngx_pid)) {
+        return NGX_DECLINED;
+    }
+
+    cl->refresh_start = now;
+
+    /* a redirect arriving after this point sets it again */
+    r->stale = ngx_atomic_cmp_set(&cl->stale, 1, 0);
+
+    r->pool = ngx_create_pool(NGX_STREAM_REDIS_REFRESH_BUFFER, ngx_cycle->log);
+    if (r->pool == NULL) {
+        goto failed;
+    }
+
+    r->buf = ngx_create_temp_buf(r->pool, NGX_STREAM_REDIS_REFRESH_BUFFER);
+    if (r->buf == NULL) {
+        goto failed;
+    }
+
+    /* the new table is built off to the side and diffed on apply */
+    r->slots = ngx_palloc(r->pool, NGX_STREAM_REDIS_SLOTS * sizeof(uint16_t));
+    if (r->slots == NULL) {
+        goto failed;
+    }
+
+    for (i = 0; i < NGX_STREAM_REDIS_SLOTS; i++) {
+        r->slots[i] = NGX_STREAM_REDIS_NODE_NONE;
+    }
+
+    r->replicas = ngx_palloc(r->pool, NGX_STREAM_REDIS_MAX_NODES
+                                      * NGX_STREAM_REDIS_MAX_REPLICAS
+                                      * sizeof(uint16_t));
+    r->nreplicas = ngx_pcalloc(r->pool, NGX_STREAM_REDIS_MAX_NODES);
+
+    if (r->replicas == NULL || r->nreplicas == NULL) {
+        goto failed;
+    }
+
+    if (ngx_stream_redis_cluster_refresh_seed(r) != NGX_OK) {
+        goto failed;
+    }
+
+    r->migrating = NULL;
+    r->framed = 0;
+    r->sent = 0;
+    ngx_memzero(&r->rsp, sizeof(redis_rsp_parser_t));
+    r->peer.get = ngx_event_get_peer;
+    r->peer.log = ngx_cycle->log;
+    r->peer.log_error = NGX_ERROR_ERR;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "[redis_proxy] cluster refresh from %V", &r->name);
+
+    rc = ngx_event_connect_peer(&r->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        r->peer.connection = NULL;
+        goto failed;
+    }
+
+    c = r->peer.connection;
+
+    c->data = r;
+    c->pool = r->pool;
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->read->handler = ngx_stream_redis_cluster_refresh_read_handler;
+    c->write->handler = ngx_stream_redis_cluster_refresh_write_handler;
+
+    /* one deadline for connect, send and the whole reply */
+    ngx_add_timer(c->read, r->conf->refresh_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_stream_redis_cluster_refresh_write_handler(c->write);
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+
+    return NGX_OK;
+}
+
+
+/*
+ * walks the known nodes and then the configured upstream servers, so a
+ * failed seed is skipped on the next attempt
+ */
+static ngx_int_t
+ngx_stream_redis_cluster_refresh_seed(ngx_stream_redis_cluster_refresh_t *r)
+{
+    ngx_uint_t                          i, k, nnodes, naddrs;
+    ngx_addr_t                         *addr;
+    ngx_stream_redis_node_t            *node;
+    ngx_stream_redis_cluster_t         *cl;
+    ngx_stream_upstream_server_t       *us;
+
+    cl = ngx_stream_redis_cluster;
+
+    nnodes = cl->nnodes;
+    naddrs = 0;
+
+    us = r->conf->upstream->servers->elts;
+    for (i = 0; i < r->conf->upstream->servers->nelts; i++) {
+        naddrs += us[i].naddrs;
+    }
+
+    if (nnodes + naddrs == 0) {
+        return NGX_ERROR;
+    }
+
+    k = r->seed++ % (nnodes + naddrs);
+
+    if (k < nnodes) {
+        node = &cl->nodes[k];
+
+        addr = ngx_stream_redis_cluster_node_addr(node);
+        if (addr == NULL) {
+            return NGX_ERROR;
+        }
+
+        r->name.data = node->addr;
+        r->name.len = node->addr_len;
+        r->peer.sockaddr = addr->sockaddr;
+        r->peer.socklen = addr->socklen;
+        r->peer.name = &r->name;
+
+        return NGX_OK;
+    }
+
+    k -= nnodes;
+
+    for (i = 0; i < r->conf->upstream->servers->nelts; i++) {
+        if (k < us[i].naddrs) {
+            r->name = us[i].addrs[k].name;
+            r->peer.sockaddr = us[i].addrs[k].sockaddr;
+            r->peer.socklen = us[i].addrs[k].socklen;
+            r->peer.name = &r->name;
+            return NGX_OK;
+        }
+
+        k -= us[i].naddrs;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_stream_redis_cluster_refresh_write_handler(ngx_event_t *wev)
+{
+    size_t                               len;
+    ssize_t                              n;
+    ngx_connection_t                    *c;
+    ngx_stream_redis_cluster_refresh_t  *r;
+
+    c = wev->data;
+    r = c->data;
+
+    len = sizeof(ngx_stream_redis_cluster_slots_cmd) - 1;
+
+    while (r->sent < len) {
+
+        n = c->send(c, ngx_stream_redis_cluster_slots_cmd + r->sent,
+                    len - r->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        r->sent += n;
+    }
+}
+
+
+static void
+ngx_stream_redis_cluster_refresh_read_handler(ngx_event_t *rev)
+{
+    size_t                               size;
+    ssize_t                              n;
+    u_char                              *end;
+    ngx_int_t                            rc;
+    ngx_buf_t                           *b, *nb;
+    msg_type_t                           type;
+    ngx_connection_t                    *c;
+    ngx_stream_redis_cluster_refresh_t  *r;
+
+    c = rev->data;
+    r = c->data;
+    b = r->buf;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "[redis_proxy] cluster refresh from %V timed out",
+                      &r->name);
+        ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            size = 2 * (b->end - b->start);
+
+            if (size > NGX_STREAM_REDIS_REFRESH_MAX_BUFFER) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "[redis_proxy] cluster refresh reply too large");
+                ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+                return;
+            }
+
+            nb = ngx_create_temp_buf(r->pool, size);
+            if (nb == NULL) {
+                ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+                return;
+            }
+
+            nb->last = ngx_cpymem(nb->pos, b->pos, b->last - b->pos);
+
+            r->buf = nb;
+            b = nb;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "[redis_proxy] cluster refresh from %V: "
+                          "connection closed", &r->name);
+            ngx_stream_redis_cluster_refresh_done(r, NGX_ERROR);
+            return;
+        }
+
+        b->last += n;
+
+        /* frame first, a reply is parsed only once it is all in */
+
+        for ( ;; ) {
+            rc = redis_parse_rsp(b, &r->rsp, &end, &type);
+
+            if (rc == NGX_AGAIN) {
+                break;
+            }
+
+            if (rc == NGX_OK && r->framed++ == 0) {
+                rc = ngx_stream_redis_cluster_parse_slots(r);
+
+                if (rc == NGX_OK) {
+                    /* the buffer may grow, keep only the second reply */
+                    b->pos = end;
+                    ngx_memzero(&r->rsp, sizeof(redis_rsp_parser_t));
+
+                    if (b->pos == b->last) {
+                        b->pos = b->start;
+                        b->last = b->start;
+                        break;
+                    }
+
+                    continue;
+                }
+            }
+
+            if (rc == NGX_OK
+                && ngx_stream_redis_cluster_parse_nodes(r, b->pos, end)
+                   != NGX_OK)
+            {
+                /* the slots are good, the migrations stay as they were */
+                r->migrating = NULL;
+            }
+
+            ngx_stream_redis_cluster_refresh_done(r, rc);
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_stream_redis_cluster_refresh_done(ngx_stream_redis_cluster_refresh_t *r,
+    ngx_int_t rc)
+{
+    ngx_uint_t                          changed;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (rc == NGX_OK) {
+        changed = ngx_stream_redis_cluster_apply(cl, r->slots);
+
+        if (r->migrating) {
+            ngx_stream_redis_cluster_apply_migrating(cl, r->migrating);
+        }
+
+        ngx_stream_redis_cluster_apply_replicas(cl, r->replicas, r->nreplicas);
+
+        cl->refreshed = ngx_current_msec;
+
+        if (changed) {
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "[redis_proxy] cluster topology from %V: "
+                          "%ui slots changed", &r->name, changed);
+        }
+    }
+
+    if (r->peer.connection) {
+        ngx_close_connection(r->peer.connection);
+        r->peer.connection = NULL;
+    }
+
+    if (r->pool) {
+        ngx_destroy_pool(r->pool);
+        r->pool = NULL;
+    }
+
+    r->buf = NULL;
+    r->slots = NULL;
+    r->migrating = NULL;
+    r->replicas = NULL;
+    r->nreplicas = NULL;
+
+    if (rc != NGX_OK && r->stale) {
+        cl->stale = 1;
+    }
+
+    r->stale = 0;
+
+    ngx_atomic_cmp_set(&cl->refresh_lock, ngx_pid, 0);
+
+    if (rc == NGX_ABORT || ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_stream_redis_cluster_lag_start(r->conf);
+    }
+
+    ngx_add_timer(&r->timer, rc == NGX_OK
+                             ? r->conf->refresh_interval
+                             : ngx_min(r->conf->refresh_interval,
+                                       NGX_STREAM_REDIS_REFRESH_RETRY));
+}
+
+
+/*
+ * *3
+ *   :0
+ *   :5460
+ *   *3 $9 127.0.0.1 :7000 $40 <id>       master
+ *   *3 $9 127.0.0.1 :7003 $40 <id>       replicas...
+ *
+ * replicas in the fail state are not listed
+ */
+static ngx_int_t
+ngx_stream_redis_cluster_parse_slots(ngx_stream_redis_cluster_refresh_t *r)
+{
+    u_char                             *p, *last;
+    uint16_t                           *replicas;
+    ngx_int_t                           rc, n, m, first, end, node, replica;
+    ngx_int_t                           i, j, k;
+
+    p = r->buf->pos;
+    last = r->buf->last;
+
+    if (*p == '-') {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[redis_proxy] cluster refresh from %V: \"%*s\"",
+                      &r->name, last - p - 2, p);
+        return NGX_ERROR;
+    }
+
+    rc = redis_resp_int(&p, last, '*', &n);
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+
+        if (redis_resp_int(&p, last, '*', &m) != NGX_OK
+            || m < 3
+            || redis_resp_int(&p, last, ':', &first) != NGX_OK
+            || redis_resp_int(&p, last, ':', &end) != NGX_OK
+            || first < 0 || first > end || end >= NGX_STREAM_REDIS_SLOTS)
+        {
+            goto invalid;
+        }
+
+        node = ngx_stream_redis_cluster_parse_node(r, &p, last, 0);
+        if (node == NGX_ERROR) {
+            goto invalid;
+        }
+
+        /* a master with several ranges lists the same replicas each time */
+
+        replicas = (node == NGX_DECLINED)
+                   ? NULL : r->replicas + node * NGX_STREAM_REDIS_MAX_REPLICAS;
+        k = 0;
+
+        for (j = 3; j < m; j++) {
+            replica = ngx_stream_redis_cluster_parse_node(r, &p, last, 1);
+            if (replica == NGX_ERROR) {
+                goto invalid;
+            }
+
+            if (replicas != NULL && replica != NGX_DECLINED
+                && replica != node && k < NGX_STREAM_REDIS_MAX_REPLICAS)
+            {
+                replicas[k++] = (uint16_t) replica;
+            }
+        }
+
+        if (node == NGX_DECLINED) {
+            continue;
+        }
+
+        /* 0 is "not a master", the count is kept off by one */
+        r->nreplicas[node] = (uint8_t) (k + 1);
+
+        for (j = first; j <= end; j++) {
+            r->slots[j] = (uint16_t) node;
+        }
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "[redis_proxy] cluster refresh from %V: invalid reply",
+                  &r->name);
+
+    return NGX_ERROR;
+}
+
+
+/* *N $ip :port [$id ...] */
+static ngx_int_t
+ngx_stream_redis_cluster_parse_node(ngx_stream_redis_cluster_refresh_t *r,
+    u_char **pos, u_char *last, ngx_uint_t replica)
+{
+    u_char                             *p;
+    ngx_int_t                           i, n, port;
+    ngx_str_t                           ip;
+    u_char                              addr[NGX_SOCKADDR_STRLEN];
+
+    if (redis_resp_int(pos, last, '*', &n) != NGX_OK
+        || n < 2
+        || redis_resp_bulk(pos, last, &ip) != NGX_OK
+        || redis_resp_int(pos, last, ':', &port) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = 2; i < n; i++) {
+        if (redis_resp_skip(pos, last, 1) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ip.len == 0 && replica) {
+        /* the seed is the master of a replica with no address */
+        return NGX_DECLINED;
+    }
+
+    if (ip.len == 0) {
+        /* the node does not know its own address yet, use the seed host */
+        ip = r->name;
+
+        p = ip.data + ip.len;
+        while (p > ip.data && *(p - 1) != ':') {
+            p--;
+        }
+
+        if (p > ip.data) {
+            ip.len = p - 1 - ip.data;
+        }
+    }
+
+    if (ip.len + sizeof(":65535") - 1 > NGX_SOCKADDR_STRLEN) {
+        return NGX_DECLINED;
+    }
+
+    p = ngx_sprintf(addr, "%V:%i", &ip, port);
+
+    return ngx_stream_redis_cluster_node_add(addr, p - addr);
+}
+
+
+/*
+ * a bulk string with a line per node:
+ *
+ *   <id> <ip:port@cport[,hostname]> <flags> <master> <ping> <pong> <epoch>
+ *   <link> <slot or range>...
+ *
+ * a slot in migration is listed as [slot->-<target id>] by its owner and
+ * as [slot-<-<source id>] by the importing node
+ */
+static ngx_int_t
+ngx_stream_redis_cluster_parse_nodes(ngx_stream_redis_cluster_refresh_t *r,
+    u_char *pos, u_char *last)
+{
+    u_char                             *p, *end, *eol;
+    ngx_int_t                           slot, node;
+    ngx_str_t                           text, tok, *ids, *addrs;
+    ngx_uint_t                          i, j, n, nlines;
+
+    if (redis_resp_bulk(&pos, last, &text) != NGX_OK || text.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    end = text.data + text.len;
+
+    nlines = 1;
+    for (p = text.data; p < end; p++) {
+        if (*p == LF) {
+            nlines++;
+        }
+    }
+
+    ids = ngx_palloc(r->pool, 2 * nlines * sizeof(ngx_str_t));
+    r->migrating = ngx_palloc(r->pool,
+                              NGX_STREAM_REDIS_SLOTS * sizeof(uint16_t));
+
+    if (ids == NULL || r->migrating == NULL) {
+        return NGX_ERROR;
+    }
+
+    addrs = ids + nlines;
+
+    for (i = 0; i < NGX_STREAM_REDIS_SLOTS; i++) {
+        r->migrating[i] = NGX_STREAM_REDIS_NODE_NONE;
+    }
+
+    /* the ids first, a marker may name a node listed further down */
+
+    n = 0;
+
+    for (p = text.data; p < end; p = eol + 1) {
+        eol = ngx_strlchr(p, end, LF);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        if (ngx_stream_redis_cluster_token(&p, eol, &ids[n]) != NGX_OK
+            || ngx_stream_redis_cluster_token(&p, eol, &addrs[n]) != NGX_OK)
+        {
+            continue;
+        }
+
+        for (j = 0; j < addrs[n].len; j++) {
+            if (addrs[n].data[j] == '@' || addrs[n].data[j] == ',') {
+                addrs[n].len = j;
+                break;
+            }
+        }
+
+        n++;
+    }
+
+    for (i = 0, p = text.data; p < end; p = eol + 1) {
+        eol = ngx_strlchr(p, end, LF);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        if (ngx_stream_redis_cluster_token(&p, eol, &tok) != NGX_OK) {
+            continue;
+        }
+
+        /* addr, flags, master, ping, pong, epoch, link */
+
+        for (j = 0; j < 7; j++) {
+            if (ngx_stream_redis_cluster_token(&p, eol, &tok) != NGX_OK) {
+                break;
+            }
+        }
+
+        if (j == 0) {
+            /* skipped by the first pass too */
+            continue;
+        }
+
+        while (ngx_stream_redis_cluster_token(&p, eol, &tok) == NGX_OK) {
+
+            if (tok.len < sizeof("[0->-]") - 1 || tok.data[0] != '['
+                || tok.data[tok.len - 1] != ']')
+            {
+                continue;
+            }
+
+            for (j = 1; j < tok.len && tok.data[j] != '-'; j++) {
+                /* void */
+            }
+
+            slot = ngx_atoi(tok.data + 1, j - 1);
+
+            if (slot == NGX_ERROR || slot >= NGX_STREAM_REDIS_SLOTS
+                || j + 3 >= tok.len)
+            {
+                continue;
+            }
+
+            if (ngx_strncmp(tok.data + j, "->-", 3) == 0) {
+                text.data = tok.data + j + 3;
+                text.len = tok.len - j - 4;
+
+                for (node = 0; node < (ngx_int_t) n; node++) {
+                    if (ids[node].len == text.len
+                        && ngx_strncmp(ids[node].data, text.data, text.len)
+                           == 0)
+                    {
+                        break;
+                    }
+                }
+
+            } else if (ngx_strncmp(tok.data + j, "-<-", 3) == 0) {
+                node = i;
+
+            } else {
+                continue;
+            }
+
+            if (node == (ngx_int_t) n || addrs[node].len == 0
+                || addrs[node].data[0] == ':')
+            {
+                continue;
+            }
+
+            node = ngx_stream_redis_cluster_node_add(addrs[node].data,
+                                                     addrs[node].len);
+            if (node == NGX_ERROR) {
+                continue;
+            }
+
+            r->migrating[slot] = (uint16_t) node;
+        }
+
+        i++;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the next space separated token before last */
+static ngx_int_t
+ngx_stream_redis_cluster_token(u_char **pos, u_char *last, ngx_str_t *token)
+{
+    u_char  *p;
+
+    p = *pos;
+
+    while (p < last && (*p == ' ' || *p == CR)) {
+        p++;
+    }
+
+    token->data = p;
+
+    while (p < last && *p != ' ' && *p != CR) {
+        p++;
+    }
+
+    token->len = p - token->data;
+    *pos = p;
+
+    return token->len ? NGX_OK : NGX_DONE;
+}
+
+
+/*
+ * writes only the slot ranges whose owner changed; the table is left alone,
+ * and readers never retry, when nothing moved
+ */
+static ngx_uint_t
+ngx_stream_redis_cluster_apply(ngx_stream_redis_cluster_t *cl,
+    uint16_t *slots)
+{
+    ngx_uint_t                          i, changed;
+
+    changed = 0;
+
+    for (i = 0; i < NGX_STREAM_REDIS_SLOTS; i++) {
+        if (slots[i] != NGX_STREAM_REDIS_NODE_NONE && slots[i] != cl->slots[i]) {
+            changed++;
+        }
+    }
+
+    if (changed == 0) {
+        return 0;
+    }
+
+    ngx_stream_redis_cluster_write_lock(cl);
+
+    cl->generation++;
+
+    for (i = 0; i < NGX_STREAM_REDIS_SLOTS; i++) {
+        if (slots[i] != NGX_STREAM_REDIS_NODE_NONE && slots[i] != cl->slots[i]) {
+            cl->slots[i] = slots[i];
+            cl->nodes[slots[i]].generation = cl->generation;
+        }
+    }
+
+    ngx_stream_redis_cluster_write_unlock(cl);
+
+    return changed;
+}
+
+
+/* the migrations of the last refresh replace those learned from ASK */
+static void
+ngx_stream_redis_cluster_apply_migrating(ngx_stream_redis_cluster_t *cl,
+    uint16_t *migrating)
+{
+    if (ngx_memcmp(cl->migrating, migrating,
+                   NGX_STREAM_REDIS_SLOTS * sizeof(uint16_t))
+        == 0)
+    {
+        return;
+    }
+
+    /* readers take single entries, the slot table seqlock is not needed */
+
+    ngx_spinlock(&cl->lock, ngx_pid, 1024);
+
+    ngx_memcpy(cl->migrating, migrating,
+               NGX_STREAM_REDIS_SLOTS * sizeof(uint16_t));
+
+    ngx_unlock(&cl->lock);
+}
+
+
+/* a node not listed as a master this time has no replicas any more */
+static void
+ngx_stream_redis_cluster_apply_replicas(ngx_stream_redis_cluster_t *cl,
+    uint16_t *replicas, uint8_t *nreplicas)
+{
+    ngx_uint_t                          i, n;
+
+    n = cl->nnodes;
+
+    for (i = 0; i < n; i++) {
+        (void) ngx_stream_redis_cluster_set_replicas(i,
+                              replicas + i * NGX_STREAM_REDIS_MAX_REPLICAS,
+                              nreplicas[i] ? nreplicas[i] - 1 : 0);
+    }
+}
+
+
+static void
+ngx_stream_redis_cluster_lag_start(ngx_stream_redis_cluster_conf_t *conf)
+{
+    ngx_stream_redis_cluster_lag_t     *l;
+
+    l = &ngx_stream_redis_cluster_lag;
+
+    if ((conf->replica_max_lag == 0 && conf->replica_max_lag_bytes == 0)
+        || l->pool != NULL)
+    {
+        /* off, or the last round is still going */
+        return;
+    }
+
+    l->pool = ngx_create_pool(NGX_STREAM_REDIS_REFRESH_BUFFER, ngx_cycle->log);
+    if (l->pool == NULL) {
+        return;
+    }
+
+    l->buf = ngx_create_temp_buf(l->pool, NGX_STREAM_REDIS_REFRESH_BUFFER);
+    if (l->buf == NULL) {
+        ngx_stream_redis_cluster_lag_done(l);
+        return;
+    }
+
+    l->conf = conf;
+    l->next = 0;
+
+    ngx_stream_redis_cluster_lag_next(l);
+}
+
+
+/* connects to the next master with replicas, or ends the round */
+static void
+ngx_stream_redis_cluster_lag_next(ngx_stream_redis_cluster_lag_t *l)
+{
+    ngx_int_t                           rc;
+    ngx_uint_t                          i;
+    uint16_t                            replicas[NGX_STREAM_REDIS_MAX_REPLICAS];
+    ngx_addr_t                         *addr;
+    ngx_connection_t                   *c;
+    ngx_stream_redis_node_t            *node;
+    ngx_stream_redis_cluster_t         *cl;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (l->peer.connection) {
+        ngx_close_connection(l->peer.connection);
+        l->peer.connection = NULL;
+    }
+
+    for ( ;; ) {
+
+        if (ngx_exiting || ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        for (i = l->next; i < cl->nnodes; i++) {
+            if (ngx_stream_redis_cluster_replicas(&cl->nodes[i], replicas)) {
+                break;
+            }
+        }
+
+        if (i >= cl->nnodes) {
+            break;
+        }
+
+        l->master = i;
+        l->next = i + 1;
+
+        node = &cl->nodes[i];
+
+        addr = ngx_stream_redis_cluster_node_addr(node);
+        if (addr == NULL) {
+            continue;
+        }
+
+        l->name.data = node->addr;
+        l->name.len = node->addr_len;
+
+        ngx_memzero(&l->peer, sizeof(ngx_peer_connection_t));
+
+        l->peer.sockaddr = addr->sockaddr;
+        l->peer.socklen = addr->socklen;
+        l->peer.name = &l->name;
+        l->peer.get = ngx_event_get_peer;
+        l->peer.log = ngx_cycle->log;
+        l->peer.log_error = NGX_ERROR_ERR;
+
+        l->buf->pos = l->buf->start;
+        l->buf->last = l->buf->start;
+        l->sent = 0;
+        ngx_memzero(&l->rsp, sizeof(redis_rsp_parser_t));
+
+        rc = ngx_event_connect_peer(&l->peer);
+
+        if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+            l->peer.connection = NULL;
+            continue;
+        }
+
+        c = l->peer.connection;
+
+        c->data = l;
+        c->pool = l->pool;
+        c->log = ngx_cycle->log;
+        c->read->log = c->log;
+        c->write->log = c->log;
+
+        c->read->handler = ngx_stream_redis_cluster_lag_read_handler;
+        c->write->handler = ngx_stream_redis_cluster_lag_write_handler;
+
+        ngx_add_timer(c->read, l->conf->refresh_timeout);
+
+        if (rc == NGX_OK) {
+            ngx_stream_redis_cluster_lag_write_handler(c->write);
+        }
+
+        return;
+    }
+
+    ngx_stream_redis_cluster_lag_done(l);
+}
+
+
+static void
+ngx_stream_redis_cluster_lag_write_handler(ngx_event_t *wev)
+{
+    size_t                               len;
+    ssize_t                              n;
+    ngx_connection_t                    *c;
+    ngx_stream_redis_cluster_lag_t      *l;
+
+    c = wev->data;
+    l = c->data;
+
+    len = sizeof(ngx_stream_redis_cluster_info_cmd) - 1;
+
+    while (l->sent < len) {
+
+        n = c->send(c, ngx_stream_redis_cluster_info_cmd + l->sent,
+                    len - l->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_stream_redis_cluster_lag_next(l);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_redis_cluster_lag_next(l);
+            }
+
+            return;
+        }
+
+        l->sent += n;
+    }
+}
+
+
+/* a master that cannot be asked keeps the lag state of its replicas */
+static void
+ngx_stream_redis_cluster_lag_read_handler(ngx_event_t *rev)
+{
+    ssize_t                              n;
+    u_char                              *end;
+    ngx_int_t                            rc;
+    ngx_buf_t                           *b;
+    msg_type_t                           type;
+    ngx_connection_t                    *c;
+    ngx_stream_redis_cluster_lag_t      *l;
+
+    c = rev->data;
+    l = c->data;
+    b = l->buf;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "[redis_proxy] INFO replication from %V timed out",
+                      &l->name);
+        ngx_stream_redis_cluster_lag_next(l);
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            /* the replication section is a few lines per replica */
+            ngx_stream_redis_cluster_lag_next(l);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_stream_redis_cluster_lag_next(l);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_redis_cluster_lag_next(l);
+            return;
+        }
+
+        b->last += n;
+
+        rc = redis_parse_rsp(b, &l->rsp, &end, &type);
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        if (rc == NGX_OK) {
+            (void) ngx_stream_redis_cluster_parse_info(l, b->pos, end);
+        }
+
+        ngx_stream_redis_cluster_lag_next(l);
+        return;
+    }
+}
+
+
+static void
+ngx_stream_redis_cluster_lag_done(ngx_stream_redis_cluster_lag_t *l)
+{
+    if (l->peer.connection) {
+        ngx_close_connection(l->peer.connection);
+        l->peer.connection = NULL;
+    }
+
+    if (l->pool) {
+        ngx_destroy_pool(l->pool);
+        l->pool = NULL;
+    }
+
+    l->buf = NULL;
+}
+
+
+/*
+ * a bulk string of "field:value" lines:
+ *
+ *   role:master
+ *   slave0:ip=127.0.0.1,port=7003,state=online,offset=1234,lag=0
+ *   master_repl_offset:1299
+ *
+ * lag is the seconds since the replica last acknowledged, offset the bytes
+ * it has applied; a replica not listed is not connected to its master
+ */
+static ngx_int_t
+ngx_stream_redis_cluster_parse_info(ngx_stream_redis_cluster_lag_t *l,
+    u_char *pos, u_char *last)
+{
+    u_char                             *p, *eol, *f, *comma, *eq, *end;
+    off_t                               master_offset, bytes;
+    ngx_int_t                           n;
+    ngx_str_t                           text, ip, port, name, value;
+    ngx_uint_t                          i, k, nslaves, nreplicas, lagging;
+    ngx_uint_t                          master;
+    uint16_t                            replicas[NGX_STREAM_REDIS_MAX_REPLICAS];
+    u_char                              addr[NGX_SOCKADDR_STRLEN];
+    ngx_stream_redis_node_t            *node;
+    ngx_stream_redis_cluster_t         *cl;
+    ngx_stream_redis_cluster_slave_t    slaves[2 * NGX_STREAM_REDIS_MAX_REPLICAS];
+    ngx_stream_redis_cluster_slave_t   *s;
+
+    cl = ngx_stream_redis_cluster;
+
+    if (redis_resp_bulk(&pos, last, &text) != NGX_OK || text.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    end = text.data + text.len;
+
+    master = 0;
+    master_offset = -1;
+    nslaves = 0;
+
+    for (p = text.data; p < end; p = eol + 1) {
+        eol = ngx_strlchr(p, end, LF);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        f = (eol > p && *(eol - 1) == CR) ? eol - 1 : eol;
+
+        if (f - p == sizeof("role:master") - 1
+            && ngx_strncmp(p, "role:master", f - p) == 0)
+        {
+            master = 1;
+            continue;
+        }
+
+        if (f - p > (ssize_t) sizeof("master_repl_offset:") - 1
+            && ngx_strncmp(p, "master_repl_offset:",
+                           sizeof("master_repl_offset:") - 1) == 0)
+        {
+            p += sizeof("master_repl_offset:") - 1;
+            master_offset = ngx_atoof(p, f - p);
+            continue;
+        }
+
+        if (f - p < (ssize_t) sizeof("slave0:") - 1
+            || ngx_strncmp(p, "slave", sizeof("slave") - 1) != 0
+            || nslaves == 2 * NGX_STREAM_REDIS_MAX_REPLICAS)
+        {
+            continue;
+        }
+
+        p = ngx_strlchr(p, f, ':');
+        if (p == NULL) {
+            continue;
+        }
+
+        s = &slaves[nslaves];
+
+        s->online = 0;
+        s->offset = -1;
+        s->lag = NGX_MAX_INT32_VALUE;
+
+        ngx_str_null(&ip);
+        ngx_str_null(&port);
+
+        for (p++; p < f; p = comma + 1) {
+            comma = ngx_strlchr(p, f, ',');
+            if (comma == NULL) {
+                comma = f;
+            }
+
+            eq = ngx_strlchr(p, comma, '=');
+            if (eq == NULL) {
+                continue;
+            }
+
+            name.data = p;
+            name.len = eq - p;
+            value.data = eq + 1;
+            value.len = comma - eq - 1;
+
+            if (name.len == 2 && ngx_strncmp(name.data, "ip", 2) == 0) {
+                ip = value;
+
+            } else if (name.len == 4 && ngx_strncmp(name.data, "port", 4) == 0) {
+                port = value;
+
+            } else if (name.len == 5 && ngx_strncmp(name.data, "state", 5) == 0) {
+                s->online = (value.len == 6
+                             && ngx_strncmp(value.data, "online", 6) == 0);
+
+            } else if (name.len == 6 && ngx_strncmp(name.data, "offset", 6) == 0) {
+                s->offset = ngx_atoof(value.data, value.len);
+
+            } else if (name.len == 3 && ngx_strncmp(name.data, "lag", 3) == 0) {
+                n = ngx_atoi(value.data, value.len);
+                if (n != NGX_ERROR) {
+                    s->lag = (ngx_msec_t) n * 1000;
+                }
+            }
+        }
+
+        if (ip.len == 0 || port.len == 0
+            || ip.len + port.len + 1 > NGX_SOCKADDR_STRLEN)
+        {
+            continue;
+        }
+
+        p = ngx_cpymem(addr, ip.data, ip.len);
+        *p++ = ':';
+        p = ngx_cpymem(p, port.data, port.len);
+
+        s->node = ngx_stream_redis_cluster_node_find(cl, addr, p - addr);
+
+        if (s->node != NGX_DECLINED) {
+            nslaves++;
+        }
+    }
+
+    if (!master || master_offset < 0) {
+        /* failed over since the refresh, the next one sorts it out */
+        return NGX_DECLINED;
+    }
+
+    nreplicas = ngx_stream_redis_cluster_replicas(&cl->nodes[l->master],
+                                                  replicas);
+
+    for (i = 0; i < nreplicas; i++) {
+        node = &cl->nodes[replicas[i]];
+
+        s = NULL;
+
+        for (k = 0; k < nslaves; k++) {
+            if (slaves[k].node == (ngx_int_t) replicas[i]) {
+                s = &slaves[k];
+                break;
+            }
+        }
+
+        bytes = (s && s->offset >= 0) ? master_offset - s->offset : -1;
+
+        lagging = (s == NULL || !s->online || bytes < 0
+                   || (l->conf->replica_max_lag_bytes
+                       && bytes > (off_t) l->conf->replica_max_lag_bytes)
+                   || (l->conf->replica_max_lag
+                       && s->lag > l->conf->replica_max_lag));
+
+        if (node->lagging == lagging) {
+            continue;
+        }
+
+        if (lagging) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "[redis_proxy] replica %*s of %V is %O bytes, "
+                          "%M behind, no reads until it catches up",
+                          node->addr_len, node->addr, &l->name,
+                          bytes, s ? s->lag : (ngx_msec_t) 0);
+
+        } else {
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "[redis_proxy] replica %*s of %V caught up",
+                          node->addr_len, node->addr, &l->name);
+        }
+
+        node->lagging = lagging;
+    }
+
+    return NGX_OK;
+}
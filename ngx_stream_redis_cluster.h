@@ -0,0 +1,146 @@
+#ifndef NGX_STREAM_REDIS_CLUSTER_H
+#define NGX_STREAM_REDIS_CLUSTER_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+#define NGX_STREAM_REDIS_SLOTS                 16384
+#define NGX_STREAM_REDIS_MAX_NODES             1024
+#define NGX_STREAM_REDIS_NODE_NONE             0xffff
+#define NGX_STREAM_REDIS_ASK_CACHE             4096
+#define NGX_STREAM_REDIS_MAX_REPLICAS          8
+
+
+/*
+ * node entries live in the shared zone, they are interned by address and
+ * never reused, so a pointer to node->addr stays valid in every worker;
+ * the replicas of a master change with the slot table, under its seqlock
+ */
+typedef struct {
+    u_char                                 addr[NGX_SOCKADDR_STRLEN];
+    size_t                                 addr_len;
+    ngx_uint_t                             generation;
+
+    ngx_uint_t                             nreplicas;
+    uint16_t                               replicas[NGX_STREAM_REDIS_MAX_REPLICAS];
+
+    /* a replica too far behind its master, out of the read set */
+    ngx_uint_t                             lagging;
+} ngx_stream_redis_node_t;
+
+
+typedef struct ngx_stream_redis_tracker_s  ngx_stream_redis_tracker_t;
+
+
+/*
+ * per-worker, upstream connections are process local; fails counts
+ * transport errors only, a redirect is an answer from a healthy node
+ */
+typedef struct {
+    ngx_addr_t                            *addr;        /* parsed on first use */
+    unsigned                               bad_addr:1;  /* not an IP address */
+
+    ngx_queue_t                            conns;
+    ngx_uint_t                             nconns;
+
+    ngx_uint_t                             fails;
+    ngx_msec_t                             checked;     /* last failure or probe */
+
+    ngx_msec_t                             rtt;         /* EWMA, times 8 */
+    ngx_msec_t                             replied;     /* last rtt sample */
+
+    /* invalidations for the near cache, NULL until a reply is cached */
+    ngx_stream_redis_tracker_t            *tracker;
+} ngx_stream_redis_node_peer_t;
+
+
+/*
+ * writers serialize on lock and make seq odd while they update the table,
+ * readers take no lock and retry when seq was odd or has changed, a few
+ * thousand times at most; a lock left by a dead worker is released by
+ * the next worker to start or to refresh
+ */
+typedef struct {
+    ngx_atomic_t                           lock;
+    ngx_atomic_t                           seq;
+
+    /* pid of the worker running CLUSTER SLOTS, one refresh at a time */
+    ngx_atomic_t                           refresh_lock;
+    ngx_msec_t                             refresh_start;
+    ngx_msec_t                             refreshed;
+
+    /* a redirect was seen since the last refresh started */
+    ngx_atomic_t                           stale;
+
+    uint16_t                               slots[NGX_STREAM_REDIS_SLOTS];
+
+    /*
+     * the node a slot is being migrated to, from the markers of CLUSTER
+     * NODES and from ASK replies; single stores, read without the seqlock
+     */
+    uint16_t                               migrating[NGX_STREAM_REDIS_SLOTS];
+
+    ngx_uint_t                             generation;
+    ngx_uint_t                             nnodes;
+    ngx_stream_redis_node_t                nodes[NGX_STREAM_REDIS_MAX_NODES];
+} ngx_stream_redis_cluster_t;
+
+
+typedef struct {
+    ngx_stream_upstream_srv_conf_t        *upstream;      /* seed nodes */
+    ngx_msec_t                             refresh_interval;
+    ngx_msec_t                             refresh_timeout;
+
+    ngx_uint_t                             pool_max;
+    ngx_uint_t                             pool_min;
+    ngx_msec_t                             pool_idle_timeout;
+
+    ngx_uint_t                             max_fails;
+    ngx_msec_t                             fail_timeout;
+
+    /* both 0 turns the INFO replication sampling off */
+    ngx_msec_t                             replica_max_lag;
+    size_t                                 replica_max_lag_bytes;
+
+    /* per worker, 0 turns the near cache off */
+    size_t                                 near_cache;
+    ngx_msec_t                             near_cache_ttl;
+    ngx_array_t                           *near_cache_prefixes;
+
+    /* per worker, 0 turns hot key detection off */
+    ngx_uint_t                             hotkeys;
+    ngx_msec_t                             hotkeys_window;
+    ngx_uint_t                             hotkeys_threshold;
+} ngx_stream_redis_cluster_conf_t;
+
+
+ngx_int_t ngx_stream_redis_cluster_add_zone(ngx_conf_t *cf);
+ngx_int_t ngx_stream_redis_cluster_init(ngx_cycle_t *cycle);
+void ngx_stream_redis_cluster_exit(ngx_cycle_t *cycle);
+void ngx_stream_redis_cluster_refresh_stale(void);
+
+ngx_int_t ngx_stream_redis_cluster_node_add(u_char *addr, size_t len);
+ngx_int_t ngx_stream_redis_cluster_set_slots(ngx_uint_t first,
+    ngx_uint_t last, ngx_uint_t node);
+ngx_int_t ngx_stream_redis_cluster_set_replicas(ngx_uint_t node,
+    uint16_t *replicas, ngx_uint_t n);
+
+ngx_uint_t ngx_stream_redis_cluster_slot_node(ngx_uint_t slot);
+ngx_uint_t ngx_stream_redis_cluster_migrating(ngx_uint_t slot);
+void ngx_stream_redis_cluster_ask_add(ngx_uint_t slot, u_char *key,
+    size_t len, ngx_uint_t node);
+ngx_stream_redis_node_t *ngx_stream_redis_cluster_ask_route(ngx_uint_t slot,
+    u_char *key, size_t len);
+ngx_stream_redis_node_t *ngx_stream_redis_cluster_route(ngx_uint_t slot);
+ngx_stream_redis_node_t *ngx_stream_redis_cluster_node(ngx_uint_t node);
+ngx_stream_redis_node_t *ngx_stream_redis_cluster_any(void);
+ngx_uint_t ngx_stream_redis_cluster_replicas(ngx_stream_redis_node_t *node,
+    uint16_t *replicas);
+ngx_stream_redis_node_peer_t *ngx_stream_redis_cluster_node_peer(
+    ngx_stream_redis_node_t *node);
+ngx_addr_t *ngx_stream_redis_cluster_node_addr(ngx_stream_redis_node_t *node);
+
+
+#endif /* NGX_STREAM_REDIS_CLUSTER_H */
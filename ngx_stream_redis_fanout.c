@@ -0,0 +1,821 @@
+
+#include "ngx_stream_redis_fanout.h"
+#include "ngx_stream_redis_interface.h"
+#include "ngx_stream_redis_pool.h"
+#include "ngx_redis_proto.h"
+
+
+/*
+ * keys and groups are ordered by a packed 64-bit word: the node index in
+ * the top 16 bits, the slot in the next 16 and a key or group index in
+ * the low 32
+ */
+#define ngx_stream_redis_order(node, slot, i)                                 \
+    ((uint64_t) (node) << 48 | (uint64_t) (slot) << 32 | (uint32_t) (i))
+#define ngx_stream_redis_order_node(o)   ((ngx_uint_t) ((o) >> 48))
+#define ngx_stream_redis_order_slot(o)   ((ngx_uint_t) ((o) >> 32 & 0xffff))
+#define ngx_stream_redis_order_index(o)  ((uint32_t) (o))
+
+
+static int ngx_libc_cdecl ngx_stream_redis_fanout_cmp(const void *one,
+    const void *two);
+static ngx_int_t ngx_stream_redis_fanout_nodes(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p, uint64_t *order, ngx_uint_t n,
+    const ngx_stream_redis_command_t *cmd, ngx_uint_t nargs, ngx_uint_t held);
+static ngx_stream_redis_msg_t *ngx_stream_redis_fanout_child(
+    ngx_stream_redis_msg_t *msg, const ngx_stream_redis_command_t *cmd,
+    ngx_uint_t node, ngx_uint_t ngroups, ngx_uint_t nkeys, size_t len);
+static ngx_stream_redis_msg_t *ngx_stream_redis_fanout_build(
+    ngx_stream_redis_msg_t *msg, ngx_stream_redis_parser_t *p,
+    uint64_t *order, ngx_uint_t n, const ngx_stream_redis_command_t *cmd,
+    ngx_uint_t nargs);
+static ngx_stream_redis_msg_t *ngx_stream_redis_fanout_rebuild(
+    ngx_stream_redis_msg_t *from, uint64_t *order, ngx_uint_t n);
+static ngx_int_t ngx_stream_redis_fanout_collect(ngx_stream_redis_msg_t *msg,
+    ngx_uint_t aggregate, ngx_str_t *items, ngx_int_t *total);
+static ngx_int_t ngx_stream_redis_fanout_item(ngx_uint_t aggregate,
+    ngx_stream_redis_msg_t *child, ngx_stream_redis_group_t *g,
+    u_char *start, u_char *end, ngx_str_t *items, ngx_int_t *total);
+static ngx_int_t ngx_stream_redis_fanout_msetnx(ngx_stream_redis_msg_t *msg);
+static void ngx_stream_redis_fanout_reply(ngx_stream_redis_msg_t *msg,
+    u_char *rsp, size_t len, msg_type_t type);
+
+
+static u_char  ngx_stream_redis_fanout_ok[] = "+OK\r\n";
+static u_char  ngx_stream_redis_fanout_zero[] = ":0\r\n";
+static u_char  ngx_stream_redis_fanout_one[] = ":1\r\n";
+
+
+/*
+ * msg has keys in more than one slot; its keys are sorted by the node
+ * serving their slot and each node gets one sub-request on msg->children.
+ * a cluster refuses a multi-key command over several slots even when a
+ * single node serves them all, so a sub-request is a pipeline with one
+ * command per slot, written at once and answered by as many replies
+ *
+ * MSETNX is split in two phases: an EXISTS over all keys goes first and
+ * the MSET sub-requests are held back until it finds none of them; this
+ * is not atomic, a key written between the phases is overwritten
+ */
+ngx_int_t
+ngx_stream_redis_fanout_split(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p)
+{
+    uint16_t                          *slots;
+    uint64_t                          *order;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, n;
+    const ngx_stream_redis_command_t  *exists, *mset;
+
+    slots = p->slots.elts;
+    n = p->slots.nelts;
+
+    order = ngx_alloc(n * sizeof(uint64_t), ngx_cycle->log);
+    if (order == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        order[i] = ngx_stream_redis_order(
+                       ngx_stream_redis_cluster_slot_node(slots[i]),
+                       slots[i], i);
+    }
+
+    ngx_qsort(order, n, sizeof(uint64_t), ngx_stream_redis_fanout_cmp);
+
+    ngx_queue_init(&msg->children);
+    msg->nkeys = n;
+    msg->pending = 0;
+
+    if (msg->type == MSG_REQ_REDIS_MSETNX) {
+        exists = redis_command_lookup((u_char *) "exists",
+                                      sizeof("exists") - 1);
+        mset = redis_command_lookup((u_char *) "mset", sizeof("mset") - 1);
+
+        rc = ngx_stream_redis_fanout_nodes(msg, p, order, n, exists, 1, 0);
+
+        if (rc == NGX_OK) {
+            rc = ngx_stream_redis_fanout_nodes(msg, p, order, n, mset, 2, 1);
+        }
+
+    } else {
+        rc = ngx_stream_redis_fanout_nodes(msg, p, order, n, msg->command,
+                                           msg->command->step, 0);
+    }
+
+    ngx_free(order);
+
+    return rc;
+}
+
+
+/*
+ * one sub-request of cmd per node, with nargs arguments of each key;
+ * a held sub-request is not counted in pending and is not sent yet
+ */
+static ngx_int_t
+ngx_stream_redis_fanout_nodes(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p, uint64_t *order, ngx_uint_t n,
+    const ngx_stream_redis_command_t *cmd, ngx_uint_t nargs, ngx_uint_t held)
+{
+    ngx_uint_t               i, j;
+    ngx_stream_redis_msg_t  *child;
+
+    for (i = 0; i < n; i = j) {
+
+        for (j = i + 1;
+             j < n && ngx_stream_redis_order_node(order[j])
+                      == ngx_stream_redis_order_node(order[i]);
+             j++)
+        {
+            /* void */
+        }
+
+        child = ngx_stream_redis_fanout_build(msg, p, &order[i], j - i, cmd,
+                                              nargs);
+        if (child == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_queue_insert_tail(&msg->children, &child->queue);
+
+        if (held) {
+            child->held = 1;
+
+        } else {
+            msg->pending++;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_stream_redis_fanout_cmp(const void *one, const void *two)
+{
+    uint64_t  a, b;
+
+    a = *(const uint64_t *) one;
+    b = *(const uint64_t *) two;
+
+    return (a > b) - (a < b);
+}
+
+
+/* the groups, the key indexes and the request share one allocation */
+static ngx_stream_redis_msg_t *
+ngx_stream_redis_fanout_child(ngx_stream_redis_msg_t *msg,
+    const ngx_stream_redis_command_t *cmd, ngx_uint_t node,
+    ngx_uint_t ngroups, ngx_uint_t nkeys, size_t len)
+{
+    u_char                  *block;
+    ngx_stream_redis_msg_t  *child;
+
+    child = ngx_stream_redis_msg_alloc();
+    if (child == NULL) {
+        return NULL;
+    }
+
+    block = ngx_alloc(ngroups * sizeof(ngx_stream_redis_group_t)
+                      + nkeys * sizeof(uint32_t) + len,
+                      ngx_cycle->log);
+    if (block == NULL) {
+        ngx_stream_redis_msg_free(child);
+        return NULL;
+    }
+
+    child->orphan = block;
+
+    child->groups = (ngx_stream_redis_group_t *) block;
+    child->ngroups = ngroups;
+    child->nreplies = ngroups;
+
+    child->keys = (uint32_t *) (child->groups + ngroups);
+    child->nkeys = nkeys;
+
+    child->start = (u_char *) (child->keys + nkeys);
+    child->req.pos = child->start;
+    child->req.memory = 1;
+
+    child->parent = msg;
+    child->session = msg->session;
+    child->handler = msg->handler;
+    child->type = cmd->type;
+    child->command = cmd;
+
+    child->node = (node == NGX_STREAM_REDIS_NODE_NONE)
+                  ? ngx_stream_redis_cluster_any()
+                  : ngx_stream_redis_cluster_node(node);
+
+    return child;
+}
+
+
+/* the sub-request for the n keys of one node, from the client's request */
+static ngx_stream_redis_msg_t *
+ngx_stream_redis_fanout_build(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p, uint64_t *order, ngx_uint_t n,
+    const ngx_stream_redis_command_t *cmd, ngx_uint_t nargs)
+{
+    size_t                     len;
+    u_char                    *pos;
+    uint32_t                   idx;
+    ngx_uint_t                 i, k, e, s, arg, step, slot, ngroups, nkeys;
+    ngx_stream_redis_arg_t    *args, *a;
+    ngx_stream_redis_msg_t    *child;
+    ngx_stream_redis_group_t  *g;
+
+    args = p->args.elts;
+    step = msg->command->step;
+
+    ngroups = 0;
+    len = 0;
+
+    for (i = 0; i < n; i = e) {
+        slot = ngx_stream_redis_order_slot(order[i]);
+
+        for (e = i + 1;
+             e < n && ngx_stream_redis_order_slot(order[e]) == slot;
+             e++)
+        {
+            /* void */
+        }
+
+        ngroups++;
+        len += redis_encode_array_len(1 + (e - i) * nargs)
+               + redis_encode_bulk_len(cmd->name.len);
+
+        for (k = i; k < e; k++) {
+            arg = msg->command->first
+                  + ngx_stream_redis_order_index(order[k]) * step;
+
+            for (s = 0; s < nargs; s++) {
+                len += redis_encode_bulk_len(args[arg + s].len);
+            }
+        }
+    }
+
+    child = ngx_stream_redis_fanout_child(msg, cmd,
+                                          ngx_stream_redis_order_node(order[0]),
+                                          ngroups, n, len);
+    if (child == NULL) {
+        return NULL;
+    }
+
+    pos = child->start;
+    g = child->groups;
+    nkeys = 0;
+
+    for (i = 0; i < n; i = e) {
+        slot = ngx_stream_redis_order_slot(order[i]);
+
+        for (e = i + 1;
+             e < n && ngx_stream_redis_order_slot(order[e]) == slot;
+             e++)
+        {
+            /* void */
+        }
+
+        g->start = pos - child->start;
+        g->keys = nkeys;
+        g->nkeys = e - i;
+        g->slot = (uint16_t) slot;
+        g->resent = 0;
+
+        pos = redis_encode_array(pos, 1 + (e - i) * nargs);
+        pos = redis_encode_bulk(pos, cmd->name.data, cmd->name.len);
+
+        for (k = i; k < e; k++) {
+            idx = ngx_stream_redis_order_index(order[k]);
+            child->keys[nkeys++] = idx;
+
+            arg = msg->command->first + idx * step;
+
+            for (s = 0; s < nargs; s++) {
+                a = &args[arg + s];
+                pos = redis_encode_bulk(pos, msg->start + a->pos, a->len);
+            }
+        }
+
+        g->len = (pos - child->start) - g->start;
+        g++;
+    }
+
+    child->req.last = pos;
+    child->slotid = child->groups[0].slot;
+
+    return child;
+}
+
+
+/*
+ * a sub-request has all its replies; the groups answered by MOVED or
+ * TRYAGAIN are marked resent and their commands, which still stand on
+ * their own, go out again in new sub-requests grouped by their new node,
+ * those with a TRYAGAIN group after a delay; a group answered by ASK goes
+ * alone after ASKING, while the replies of the other groups are kept
+ */
+ngx_int_t
+ngx_stream_redis_fanout_redirect(ngx_stream_redis_msg_t *child)
+{
+    u_char                    *p, *last, *start;
+    uint64_t                  *order, one;
+    ngx_uint_t                 i, j, k, n, slot, asked, resent;
+    ngx_stream_redis_msg_t    *msg, *c, tmp;
+    ngx_stream_redis_group_t  *g;
+
+    msg = child->parent;
+
+    if (child->redirects >= NGX_STREAM_REDIS_MAX_REDIRECTS) {
+        return 0;
+    }
+
+    p = child->rsp.pos;
+    last = child->rsp.last;
+    n = 0;
+    asked = 0;
+
+    for (i = 0; i < child->ngroups; i++) {
+        g = &child->groups[i];
+        start = p;
+
+        if (redis_resp_skip(&p, last, 0) != NGX_OK) {
+            /* a single error for the whole sub-request */
+            break;
+        }
+
+        if (p - start > (ssize_t) sizeof("-MOVED ") - 1
+            && ngx_strncmp(start, "-MOVED ", sizeof("-MOVED ") - 1) == 0)
+        {
+            ngx_memzero(&tmp, sizeof(ngx_stream_redis_msg_t));
+
+            tmp.rsp.pos = start;
+            tmp.rsp.last = p;
+            tmp.rsp_type = MSG_RSP_REDIS_ERROR_MOVED;
+
+            if (ngx_stream_redis_process_response(&tmp) != NGX_OK) {
+                continue;
+            }
+
+            resent = 1;
+
+        } else if (p - start > (ssize_t) sizeof("-ASK ") - 1
+                   && ngx_strncmp(start, "-ASK ", sizeof("-ASK ") - 1) == 0)
+        {
+            /*
+             * ASKING holds for the next command only: the group goes
+             * alone to the importing node, the slot table is left as is
+             */
+            ngx_memzero(&tmp, sizeof(ngx_stream_redis_msg_t));
+
+            tmp.rsp.pos = start;
+            tmp.rsp.last = p;
+            tmp.rsp_type = MSG_RSP_REDIS_ERROR_ASK;
+
+            if (ngx_stream_redis_process_response(&tmp) != NGX_OK) {
+                continue;
+            }
+
+            one = ngx_stream_redis_order(0, g->slot, i);
+
+            c = ngx_stream_redis_fanout_rebuild(child, &one, 1);
+            if (c == NULL) {
+                continue;
+            }
+
+            c->node = tmp.node;
+            c->asking = 1;
+
+            ngx_queue_insert_tail(&msg->children, &c->queue);
+            msg->pending++;
+
+            g->resent = 2;
+            asked++;
+            continue;
+
+        } else if (p - start < (ssize_t) sizeof("-TRYAGAIN") - 1
+                   || ngx_strncmp(start, "-TRYAGAIN",
+                                  sizeof("-TRYAGAIN") - 1) != 0)
+        {
+            continue;
+
+        } else {
+            resent = 3;
+        }
+
+        g->resent = resent;
+        n++;
+    }
+
+    if (n == 0) {
+        return asked;
+    }
+
+    order = ngx_alloc(n * sizeof(uint64_t), ngx_cycle->log);
+    if (order == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0, j = 0; i < child->ngroups; i++) {
+        if (child->groups[i].resent == 1 || child->groups[i].resent == 3) {
+            slot = child->groups[i].slot;
+            order[j++] = ngx_stream_redis_order(
+                             ngx_stream_redis_cluster_slot_node(slot),
+                             slot, i);
+        }
+    }
+
+    ngx_qsort(order, n, sizeof(uint64_t), ngx_stream_redis_fanout_cmp);
+
+    n = 0;
+
+    for (i = 0; i < j; i = n) {
+
+        for (n = i + 1;
+             n < j && ngx_stream_redis_order_node(order[n])
+                      == ngx_stream_redis_order_node(order[i]);
+             n++)
+        {
+            /* void */
+        }
+
+        c = ngx_stream_redis_fanout_rebuild(child, &order[i], n - i);
+        if (c == NULL) {
+            /* the groups left keep their redirection as the reply */
+            for ( /* void */ ; i < j; i++) {
+                g = &child->groups[ngx_stream_redis_order_index(order[i])];
+                g->resent = 0;
+            }
+
+            ngx_free(order);
+            return NGX_ERROR;
+        }
+
+        /* a slot still migrating, sending it again at once is no use */
+        for (k = i; k < n; k++) {
+            g = &child->groups[ngx_stream_redis_order_index(order[k])];
+
+            if (g->resent == 3) {
+                c->tryagain = 1;
+                break;
+            }
+        }
+
+        ngx_queue_insert_tail(&msg->children, &c->queue);
+        msg->pending++;
+    }
+
+    ngx_free(order);
+
+    return j + asked;
+}
+
+
+/* a sub-request from the n groups of an earlier one that were redirected */
+static ngx_stream_redis_msg_t *
+ngx_stream_redis_fanout_rebuild(ngx_stream_redis_msg_t *from, uint64_t *order,
+    ngx_uint_t n)
+{
+    size_t                     len;
+    u_char                    *pos;
+    ngx_uint_t                 i, nkeys;
+    ngx_stream_redis_msg_t    *child;
+    ngx_stream_redis_group_t  *g, *og;
+
+    len = 0;
+    nkeys = 0;
+
+    for (i = 0; i < n; i++) {
+        og = &from->groups[ngx_stream_redis_order_index(order[i])];
+        len += og->len;
+        nkeys += og->nkeys;
+    }
+
+    child = ngx_stream_redis_fanout_child(from->parent, from->command,
+                                          ngx_stream_redis_order_node(order[0]),
+                                          n, nkeys, len);
+    if (child == NULL) {
+        return NULL;
+    }
+
+    pos = child->start;
+    nkeys = 0;
+
+    for (i = 0; i < n; i++) {
+        og = &from->groups[ngx_stream_redis_order_index(order[i])];
+        g = &child->groups[i];
+
+        g->start = pos - child->start;
+        g->len = og->len;
+        g->keys = nkeys;
+        g->nkeys = og->nkeys;
+        g->slot = og->slot;
+        g->resent = 0;
+
+        pos = ngx_cpymem(pos, from->start + og->start, og->len);
+
+        ngx_memcpy(&child->keys[nkeys], &from->keys[og->keys],
+                   og->nkeys * sizeof(uint32_t));
+        nkeys += og->nkeys;
+    }
+
+    child->req.last = pos;
+    child->slotid = child->groups[0].slot;
+    child->redirects = from->redirects + 1;
+
+    return child;
+}
+
+
+/*
+ * builds the reply of msg once every child has all its replies: the first
+ * error of any group is the reply, otherwise the replies of the groups
+ * are aggregated as the command says; NGX_AGAIN means that the held
+ * sub-requests of the next phase are to be sent
+ */
+ngx_int_t
+ngx_stream_redis_fanout_merge(ngx_stream_redis_msg_t *msg)
+{
+    u_char      *p;
+    ngx_int_t    rc, total;
+    ngx_str_t   *items;
+    ngx_uint_t   i, aggregate;
+
+    if (msg->type == MSG_REQ_REDIS_MSETNX) {
+        return ngx_stream_redis_fanout_msetnx(msg);
+    }
+
+    aggregate = msg->command->aggregate;
+    items = NULL;
+    total = 0;
+
+    if (aggregate == NGX_STREAM_REDIS_AGGR_ARRAY) {
+        items = ngx_alloc(msg->nkeys * sizeof(ngx_str_t), ngx_cycle->log);
+        if (items == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    rc = ngx_stream_redis_fanout_collect(msg, aggregate, items, &total);
+
+    if (rc != NGX_OK) {
+        goto done;
+    }
+
+    switch (aggregate) {
+
+    case NGX_STREAM_REDIS_AGGR_ARRAY:
+        p = ngx_alloc(redis_encode_array_len(msg->nkeys) + total,
+                      ngx_cycle->log);
+        if (p == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        msg->rsp.start = p;
+        msg->rsp.pos = p;
+
+        p = redis_encode_array(p, msg->nkeys);
+
+        for (i = 0; i < msg->nkeys; i++) {
+            p = ngx_cpymem(p, items[i].data, items[i].len);
+        }
+
+        msg->rsp.last = p;
+        msg->rsp.end = p;
+        msg->rsp.temporary = 1;
+        msg->rsp_type = MSG_RSP_REDIS_MULTIBULK;
+        break;
+
+    case NGX_STREAM_REDIS_AGGR_SUM:
+        p = ngx_alloc(sizeof(":\r\n") - 1 + NGX_INT_T_LEN, ngx_cycle->log);
+        if (p == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        msg->rsp.start = p;
+        msg->rsp.pos = p;
+        msg->rsp.last = ngx_sprintf(p, ":%i\r\n", total);
+        msg->rsp.end = msg->rsp.last;
+        msg->rsp.temporary = 1;
+        msg->rsp_type = MSG_RSP_REDIS_INTEGER;
+        break;
+
+    default: /* NGX_STREAM_REDIS_AGGR_OK */
+        ngx_stream_redis_fanout_reply(msg, ngx_stream_redis_fanout_ok,
+                                      sizeof(ngx_stream_redis_fanout_ok) - 1,
+                                      MSG_RSP_REDIS_STATUS);
+        break;
+    }
+
+done:
+
+    if (items) {
+        ngx_free(items);
+    }
+
+    return (rc == NGX_DECLINED) ? NGX_OK : rc;
+}
+
+
+/*
+ * walks the replies of the children not held back; NGX_DECLINED when
+ * one of them is an error, which is then the reply of msg
+ */
+static ngx_int_t
+ngx_stream_redis_fanout_collect(ngx_stream_redis_msg_t *msg,
+    ngx_uint_t aggregate, ngx_str_t *items, ngx_int_t *total)
+{
+    u_char                    *p, *last, *start;
+    ngx_uint_t                 i;
+    ngx_queue_t               *q;
+    ngx_stream_redis_msg_t    *child;
+    ngx_stream_redis_group_t  *g;
+
+    for (q = ngx_queue_head(&msg->children);
+         q != ngx_queue_sentinel(&msg->children);
+         q = ngx_queue_next(q))
+    {
+        child = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+
+        if (child->held) {
+            continue;
+        }
+
+        p = child->rsp.pos;
+        last = child->rsp.last;
+
+        for (i = 0; i < child->ngroups; i++) {
+            g = &child->groups[i];
+            start = p;
+
+            if (redis_resp_skip(&p, last, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (g->resent) {
+                continue;
+            }
+
+            if (*start == '-') {
+                /* children are freed with msg, after its reply is written */
+                ngx_stream_redis_fanout_reply(msg, start, p - start,
+                                              MSG_RSP_REDIS_ERROR);
+                return NGX_DECLINED;
+            }
+
+            if (ngx_stream_redis_fanout_item(aggregate, child, g, start, p,
+                                             items, total)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * takes in the reply [start, end) of group g: the elements of an MGET
+ * array go to the key indexes of the group, a count is added to *total,
+ * which is the length of the elements for an array
+ */
+static ngx_int_t
+ngx_stream_redis_fanout_item(ngx_uint_t aggregate,
+    ngx_stream_redis_msg_t *child, ngx_stream_redis_group_t *g,
+    u_char *start, u_char *end, ngx_str_t *items, ngx_int_t *total)
+{
+    u_char      *p, *e;
+    uint32_t     idx;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    p = start;
+
+    switch (aggregate) {
+
+    case NGX_STREAM_REDIS_AGGR_ARRAY:
+        if (redis_resp_int(&p, end, '*', &n) != NGX_OK
+            || n != (ngx_int_t) g->nkeys)
+        {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < g->nkeys; i++) {
+            e = p;
+
+            if (redis_resp_skip(&e, end, 1) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            idx = child->keys[g->keys + i];
+
+            items[idx].data = p;
+            items[idx].len = e - p;
+
+            *total += e - p;
+            p = e;
+        }
+
+        return NGX_OK;
+
+    case NGX_STREAM_REDIS_AGGR_SUM:
+        if (redis_resp_int(&p, end, ':', &n) != NGX_OK || n < 0) {
+            return NGX_ERROR;
+        }
+
+        *total += n;
+        return NGX_OK;
+
+    default: /* NGX_STREAM_REDIS_AGGR_OK */
+        return (*start == '+') ? NGX_OK : NGX_ERROR;
+    }
+}
+
+
+/*
+ * the EXISTS phase is over while MSET sub-requests are held back: a key
+ * that exists answers 0, otherwise the EXISTS sub-requests, all done and
+ * off any connection, are freed and the MSET ones released
+ */
+static ngx_int_t
+ngx_stream_redis_fanout_msetnx(ngx_stream_redis_msg_t *msg)
+{
+    ngx_int_t                rc, total;
+    ngx_uint_t               held;
+    ngx_queue_t             *q, *next;
+    ngx_stream_redis_msg_t  *child;
+
+    held = 0;
+
+    for (q = ngx_queue_head(&msg->children);
+         q != ngx_queue_sentinel(&msg->children);
+         q = ngx_queue_next(q))
+    {
+        child = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+        held |= child->held;
+    }
+
+    if (!held) {
+        rc = ngx_stream_redis_fanout_collect(msg, NGX_STREAM_REDIS_AGGR_OK,
+                                             NULL, NULL);
+        if (rc == NGX_OK) {
+            ngx_stream_redis_fanout_reply(msg, ngx_stream_redis_fanout_one,
+                                        sizeof(ngx_stream_redis_fanout_one) - 1,
+                                        MSG_RSP_REDIS_INTEGER);
+        }
+
+        return (rc == NGX_DECLINED) ? NGX_OK : rc;
+    }
+
+    total = 0;
+
+    rc = ngx_stream_redis_fanout_collect(msg, NGX_STREAM_REDIS_AGGR_SUM,
+                                         NULL, &total);
+    if (rc != NGX_OK) {
+        return (rc == NGX_DECLINED) ? NGX_OK : rc;
+    }
+
+    if (total) {
+        ngx_stream_redis_fanout_reply(msg, ngx_stream_redis_fanout_zero,
+                                      sizeof(ngx_stream_redis_fanout_zero) - 1,
+                                      MSG_RSP_REDIS_INTEGER);
+        return NGX_OK;
+    }
+
+    for (q = ngx_queue_head(&msg->children);
+         q != ngx_queue_sentinel(&msg->children);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        child = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+
+        if (child->held) {
+            child->held = 0;
+            msg->pending++;
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_stream_redis_msg_free(child);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_stream_redis_fanout_reply(ngx_stream_redis_msg_t *msg, u_char *rsp,
+    size_t len, msg_type_t type)
+{
+    msg->rsp.start = rsp;
+    msg->rsp.pos = rsp;
+    msg->rsp.last = rsp + len;
+    msg->rsp.end = msg->rsp.last;
+    msg->rsp.memory = 1;
+    msg->rsp_type = type;
+}
@@ -0,0 +1,17 @@
+#ifndef NGX_STREAM_REDIS_FANOUT_H
+#define NGX_STREAM_REDIS_FANOUT_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_redis_proxy_module.h"
+
+
+ngx_int_t ngx_stream_redis_fanout_split(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p);
+ngx_int_t ngx_stream_redis_fanout_redirect(ngx_stream_redis_msg_t *child);
+ngx_int_t ngx_stream_redis_fanout_merge(ngx_stream_redis_msg_t *msg);
+
+
+#endif /* NGX_STREAM_REDIS_FANOUT_H */
@@ -0,0 +1,346 @@
+
+#include "ngx_stream_redis_hotkeys.h"
+#include "ngx_stream_redis_sketch.h"
+#include "ngx_redis_proto.h"
+
+
+#define NGX_STREAM_REDIS_HOTKEYS_WIDTH         8192
+#define NGX_STREAM_REDIS_HOTKEY_LEN            128     /* longer ones cut */
+
+
+/* a heavy hitter, counted by the sketch since the key got its slot */
+typedef struct {
+    uint64_t                               hash;
+    uint32_t                               count;
+    size_t                                 len;        /* of the whole key */
+    unsigned                               hot:1;
+    u_char                                 key[NGX_STREAM_REDIS_HOTKEY_LEN];
+} ngx_stream_redis_hotkey_t;
+
+
+/*
+ * space-saving over the sketch: the K most frequent keys so far, a key
+ * not among them takes the place of the least frequent one as soon as
+ * its estimate is higher; every window both the sketch and the counts
+ * halve, so a key that cooled down drops out within a few windows
+ */
+typedef struct {
+    ngx_stream_redis_sketch_t              sketch;
+    ngx_stream_redis_hotkey_t             *top;
+    ngx_uint_t                             n;
+    ngx_uint_t                             min;        /* in top */
+    ngx_msec_t                             aged;
+    ngx_stream_redis_cluster_conf_t       *conf;
+} ngx_stream_redis_hotkeys_t;
+
+
+static void ngx_stream_redis_hotkeys_add(ngx_stream_redis_hotkeys_t *hk,
+    u_char *key, size_t len);
+static void ngx_stream_redis_hotkeys_age(ngx_stream_redis_hotkeys_t *hk);
+static void ngx_stream_redis_hotkeys_min(ngx_stream_redis_hotkeys_t *hk);
+
+
+static ngx_stream_redis_hotkeys_t  *ngx_stream_redis_hotkeys;
+
+
+ngx_int_t
+ngx_stream_redis_hotkeys_init(ngx_cycle_t *cycle)
+{
+    ngx_stream_redis_hotkeys_t       *hk;
+    ngx_stream_redis_cluster_conf_t  *rccf;
+
+    rccf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_redis_proxy_module);
+
+    if (rccf == NULL || rccf->hotkeys == 0) {
+        return NGX_OK;
+    }
+
+    hk = ngx_calloc(sizeof(ngx_stream_redis_hotkeys_t), cycle->log);
+    if (hk == NULL) {
+        return NGX_ERROR;
+    }
+
+    hk->top = ngx_alloc(rccf->hotkeys * sizeof(ngx_stream_redis_hotkey_t),
+                        cycle->log);
+    if (hk->top == NULL) {
+        ngx_free(hk);
+        return NGX_ERROR;
+    }
+
+    /* aged by the window, not by the number of samples */
+    if (ngx_stream_redis_sketch_init(&hk->sketch,
+                                     NGX_STREAM_REDIS_HOTKEYS_WIDTH, 0,
+                                     cycle->log)
+        != NGX_OK)
+    {
+        ngx_free(hk->top);
+        ngx_free(hk);
+        return NGX_ERROR;
+    }
+
+    hk->conf = rccf;
+    hk->aged = ngx_current_msec;
+
+    ngx_stream_redis_hotkeys = hk;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_stream_redis_hotkeys_exit(ngx_cycle_t *cycle)
+{
+    ngx_stream_redis_hotkeys_t  *hk;
+
+    hk = ngx_stream_redis_hotkeys;
+
+    if (hk == NULL) {
+        return;
+    }
+
+    ngx_stream_redis_sketch_free(&hk->sketch);
+    ngx_free(hk->top);
+    ngx_free(hk);
+
+    ngx_stream_redis_hotkeys = NULL;
+}
+
+
+/* every key of msg, as the request parser found them */
+void
+ngx_stream_redis_hotkeys_sample(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p)
+{
+    ngx_uint_t                   i;
+    ngx_stream_redis_arg_t      *arg;
+    ngx_stream_redis_hotkeys_t  *hk;
+
+    hk = ngx_stream_redis_hotkeys;
+
+    if (hk == NULL || p->nkeys == 0) {
+        return;
+    }
+
+    if (ngx_current_msec - hk->aged >= hk->conf->hotkeys_window) {
+        ngx_stream_redis_hotkeys_age(hk);
+    }
+
+    arg = (ngx_stream_redis_arg_t *) p->args.elts + p->keys;
+
+    for (i = 0; i < p->nkeys; i++) {
+        ngx_stream_redis_hotkeys_add(hk, msg->start + arg->pos, arg->len);
+        arg += msg->command->step;
+    }
+}
+
+
+/* key is among the top ones and reached the threshold in this window */
+ngx_uint_t
+ngx_stream_redis_hotkeys_hot(u_char *key, size_t len)
+{
+    uint64_t                     hash;
+    ngx_uint_t                   i;
+    ngx_stream_redis_hotkey_t   *e;
+    ngx_stream_redis_hotkeys_t  *hk;
+
+    hk = ngx_stream_redis_hotkeys;
+
+    if (hk == NULL) {
+        return 0;
+    }
+
+    hash = redis_key_hash(key, len);
+
+    for (i = 0; i < hk->n; i++) {
+        e = &hk->top[i];
+
+        if (e->hash == hash && e->len == len) {
+            return e->hot;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * HOTKEYS [count]: key, hits pairs of this worker, most frequent first;
+ * keys longer than NGX_STREAM_REDIS_HOTKEY_LEN are shown cut
+ */
+ngx_int_t
+ngx_stream_redis_hotkeys_reply(ngx_stream_redis_msg_t *msg, ngx_uint_t n)
+{
+    size_t                       size;
+    u_char                      *p;
+    ngx_uint_t                   i, k, order[NGX_STREAM_REDIS_HOTKEYS_MAX];
+    ngx_stream_redis_hotkey_t   *e;
+    ngx_stream_redis_hotkeys_t  *hk;
+
+    hk = ngx_stream_redis_hotkeys;
+
+    if (hk == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /* insertion sort, there are a few hundred at most */
+
+    for (i = 0; i < hk->n; i++) {
+
+        for (k = i; k > 0 && hk->top[order[k - 1]].count < hk->top[i].count;
+             k--)
+        {
+            order[k] = order[k - 1];
+        }
+
+        order[k] = i;
+    }
+
+    if (n == 0 || n > hk->n) {
+        n = hk->n;
+    }
+
+    size = redis_encode_array_len(2 * n);
+
+    for (i = 0; i < n; i++) {
+        e = &hk->top[order[i]];
+
+        size += redis_encode_bulk_len(ngx_min(e->len,
+                                              NGX_STREAM_REDIS_HOTKEY_LEN))
+                + sizeof(":\r\n") - 1 + NGX_INT32_LEN;
+    }
+
+    p = ngx_alloc(size, ngx_cycle->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    msg->rsp.start = p;
+    msg->rsp.pos = p;
+    msg->rsp.temporary = 1;
+
+    p = redis_encode_array(p, 2 * n);
+
+    for (i = 0; i < n; i++) {
+        e = &hk->top[order[i]];
+
+        p = redis_encode_bulk(p, e->key,
+                              ngx_min(e->len, NGX_STREAM_REDIS_HOTKEY_LEN));
+        p = ngx_sprintf(p, ":%uD\r\n", e->count);
+    }
+
+    msg->rsp.last = p;
+    msg->rsp.end = msg->rsp.start + size;
+
+    msg->conn = NULL;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_redis_hotkeys_add(ngx_stream_redis_hotkeys_t *hk, u_char *key,
+    size_t len)
+{
+    uint32_t                    count;
+    uint64_t                    hash;
+    ngx_uint_t                  i;
+    ngx_stream_redis_hotkey_t  *e;
+
+    hash = redis_key_hash(key, len);
+    count = ngx_stream_redis_sketch_add(&hk->sketch, hash);
+
+    for (i = 0; i < hk->n; i++) {
+        e = &hk->top[i];
+
+        if (e->hash == hash && e->len == len) {
+            goto found;
+        }
+    }
+
+    if (hk->n < hk->conf->hotkeys) {
+        e = &hk->top[hk->n++];
+
+    } else if (count > hk->top[hk->min].count) {
+        e = &hk->top[hk->min];
+
+    } else {
+        return;
+    }
+
+    e->hash = hash;
+    e->len = len;
+    e->count = count;
+    e->hot = 0;
+    ngx_memcpy(e->key, key, ngx_min(len, NGX_STREAM_REDIS_HOTKEY_LEN));
+
+    if (e == &hk->top[hk->min]) {
+        ngx_stream_redis_hotkeys_min(hk);
+
+    } else if (count < hk->top[hk->min].count) {
+        hk->min = e - hk->top;
+    }
+
+    goto hot;
+
+found:
+
+    if (count > e->count) {
+        e->count = count;
+
+        /* only the smallest one going up can change the minimum */
+        if (e == &hk->top[hk->min]) {
+            ngx_stream_redis_hotkeys_min(hk);
+        }
+    }
+
+hot:
+
+    if (!e->hot && e->count >= hk->conf->hotkeys_threshold) {
+        e->hot = 1;
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "[redis_proxy] hot key \"%*s\", %uD hits",
+                      ngx_min(len, NGX_STREAM_REDIS_HOTKEY_LEN), key,
+                      e->count);
+    }
+}
+
+
+static void
+ngx_stream_redis_hotkeys_age(ngx_stream_redis_hotkeys_t *hk)
+{
+    ngx_uint_t                  i;
+    ngx_stream_redis_hotkey_t  *e;
+
+    ngx_stream_redis_sketch_age(&hk->sketch);
+
+    for (i = 0; i < hk->n; i++) {
+        e = &hk->top[i];
+
+        e->count >>= 1;
+
+        if (e->count < hk->conf->hotkeys_threshold) {
+            e->hot = 0;
+        }
+    }
+
+    hk->aged = ngx_current_msec;
+
+    ngx_stream_redis_hotkeys_min(hk);
+}
+
+
+static void
+ngx_stream_redis_hotkeys_min(ngx_stream_redis_hotkeys_t *hk)
+{
+    ngx_uint_t  i;
+
+    hk->min = 0;
+
+    for (i = 1; i < hk->n; i++) {
+        if (hk->top[i].count < hk->top[hk->min].count) {
+            hk->min = i;
+        }
+    }
+}
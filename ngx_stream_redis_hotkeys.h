@@ -0,0 +1,24 @@
+#ifndef NGX_STREAM_REDIS_HOTKEYS_H
+#define NGX_STREAM_REDIS_HOTKEYS_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_redis_proxy_module.h"
+
+
+#define NGX_STREAM_REDIS_HOTKEYS_MAX           256
+
+
+ngx_int_t ngx_stream_redis_hotkeys_init(ngx_cycle_t *cycle);
+void ngx_stream_redis_hotkeys_exit(ngx_cycle_t *cycle);
+
+void ngx_stream_redis_hotkeys_sample(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p);
+ngx_uint_t ngx_stream_redis_hotkeys_hot(u_char *key, size_t len);
+ngx_int_t ngx_stream_redis_hotkeys_reply(ngx_stream_redis_msg_t *msg,
+    ngx_uint_t n);
+
+
+#endif /* NGX_STREAM_REDIS_HOTKEYS_H */
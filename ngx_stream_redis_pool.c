@@ -0,0 +1,1237 @@
+
+#include "ngx_stream_redis_pool.h"
+#include "ngx_redis_proto.h"
+
+
+#define NGX_STREAM_REDIS_POOL_BUFFER           16384
+#define NGX_STREAM_REDIS_POOL_BACKLOG          64
+#define NGX_STREAM_REDIS_POOL_IOVS             64
+#define NGX_STREAM_REDIS_MSG_CACHE             4096
+#define NGX_STREAM_REDIS_RTT_DECAY             1000
+
+
+static ngx_stream_redis_conn_t *ngx_stream_redis_conn_open(
+    ngx_stream_redis_node_t *node, ngx_stream_redis_node_peer_t *np,
+    ngx_msec_t connect_timeout, ngx_uint_t readonly);
+static void ngx_stream_redis_conn_connect_handler(ngx_event_t *ev);
+static void ngx_stream_redis_conn_read_handler(ngx_event_t *rev);
+static void ngx_stream_redis_conn_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_stream_redis_conn_connected(ngx_stream_redis_conn_t *cn);
+static ngx_int_t ngx_stream_redis_conn_test(ngx_stream_redis_conn_t *cn);
+static ngx_int_t ngx_stream_redis_conn_flush(ngx_stream_redis_conn_t *cn);
+static ngx_int_t ngx_stream_redis_conn_process(ngx_stream_redis_conn_t *cn);
+static ngx_int_t ngx_stream_redis_msg_append(ngx_stream_redis_msg_t *msg,
+    u_char *data, size_t len, ngx_log_t *log);
+static void ngx_stream_redis_conn_close(ngx_stream_redis_conn_t *cn,
+    ngx_int_t rc);
+static ngx_int_t ngx_stream_redis_node_down(ngx_stream_redis_node_peer_t *np);
+static ngx_int_t ngx_stream_redis_node_resting(
+    ngx_stream_redis_node_peer_t *np);
+static void ngx_stream_redis_node_rtt(ngx_stream_redis_node_peer_t *np,
+    ngx_msec_t rtt);
+static ngx_uint_t ngx_stream_redis_node_load(ngx_stream_redis_node_peer_t *np);
+static uint64_t ngx_stream_redis_pool_random(void);
+static void ngx_stream_redis_node_failed(ngx_stream_redis_node_t *node,
+    ngx_stream_redis_node_peer_t *np);
+
+
+static ngx_stream_redis_cluster_conf_t  *ngx_stream_redis_pool_conf;
+
+static ngx_queue_t                       ngx_stream_redis_msg_cache;
+static ngx_uint_t                        ngx_stream_redis_msg_ncache;
+
+/* xorshift64* state, per worker */
+static uint64_t                          ngx_stream_redis_pool_seed;
+
+static u_char  ngx_stream_redis_conn_lost[] =
+    "-ERR redis_proxy: connection to cluster node lost\r\n";
+
+static u_char  ngx_stream_redis_asking[] = "*1\r\n$6\r\nASKING\r\n";
+static u_char  ngx_stream_redis_readonly[] = "*1\r\n$8\r\nREADONLY\r\n";
+
+
+ngx_int_t
+ngx_stream_redis_pool_init(ngx_cycle_t *cycle)
+{
+    ngx_stream_redis_cluster_conf_t  *rccf;
+
+    rccf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_redis_proxy_module);
+
+    if (rccf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_init(&ngx_stream_redis_msg_cache);
+    ngx_stream_redis_msg_ncache = 0;
+
+    /* workers forked together must not pick the same replicas */
+    ngx_stream_redis_pool_seed = ((uint64_t) ngx_pid << 32)
+                                 ^ (uint64_t) ngx_time()
+                                 ^ ((uint64_t) ngx_current_msec << 16)
+                                 ^ 0x9e3779b97f4a7c15ULL;
+
+    ngx_stream_redis_pool_conf = rccf;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_stream_redis_pool_exit(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                     i;
+    ngx_queue_t                   *q;
+    ngx_stream_redis_node_t       *node;
+    ngx_stream_redis_node_peer_t  *np;
+
+    if (ngx_stream_redis_pool_conf == NULL) {
+        return;
+    }
+
+    for (i = 0; i < NGX_STREAM_REDIS_MAX_NODES; i++) {
+
+        node = ngx_stream_redis_cluster_node(i);
+        if (node == NULL) {
+            break;
+        }
+
+        np = ngx_stream_redis_cluster_node_peer(node);
+        if (np == NULL || np->conns.next == NULL) {
+            continue;
+        }
+
+        while (!ngx_queue_empty(&np->conns)) {
+            q = ngx_queue_head(&np->conns);
+            ngx_stream_redis_conn_close(
+                ngx_queue_data(q, ngx_stream_redis_conn_t, queue), NGX_ABORT);
+        }
+    }
+
+    while (!ngx_queue_empty(&ngx_stream_redis_msg_cache)) {
+        q = ngx_queue_head(&ngx_stream_redis_msg_cache);
+        ngx_queue_remove(q);
+        ngx_free(ngx_queue_data(q, ngx_stream_redis_msg_t, queue));
+    }
+
+    ngx_stream_redis_pool_conf = NULL;
+}
+
+
+/*
+ * messages are not allocated from the session pool, a message whose
+ * session went away still waits for its reply on the shared connection
+ */
+ngx_stream_redis_msg_t *
+ngx_stream_redis_msg_alloc(void)
+{
+    ngx_queue_t             *q;
+    ngx_stream_redis_msg_t  *msg;
+
+    if (!ngx_queue_empty(&ngx_stream_redis_msg_cache)) {
+        q = ngx_queue_head(&ngx_stream_redis_msg_cache);
+        ngx_queue_remove(q);
+        ngx_stream_redis_msg_ncache--;
+
+        msg = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+
+    } else {
+        msg = ngx_alloc(sizeof(ngx_stream_redis_msg_t), ngx_cycle->log);
+        if (msg == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_memzero(msg, sizeof(ngx_stream_redis_msg_t));
+
+    return msg;
+}
+
+
+/*
+ * sub-requests go with their parent, those still on a connection are left
+ * to it like the messages of a closed session
+ */
+void
+ngx_stream_redis_msg_free(ngx_stream_redis_msg_t *msg)
+{
+    ngx_queue_t             *q;
+    ngx_stream_redis_msg_t  *child;
+
+    if (msg->retry.timer_set) {
+        ngx_del_timer(&msg->retry);
+    }
+
+    while (msg->children.next && !ngx_queue_empty(&msg->children)) {
+        q = ngx_queue_head(&msg->children);
+        ngx_queue_remove(q);
+
+        child = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+        child->parent = NULL;
+
+        if (child->conn) {
+            ngx_stream_redis_pool_cancel(child);
+
+        } else {
+            ngx_stream_redis_msg_free(child);
+        }
+    }
+
+    if (msg->rsp.temporary) {
+        ngx_free(msg->rsp.start);
+    }
+
+    if (msg->orphan) {
+        ngx_free(msg->orphan);
+    }
+
+    if (ngx_stream_redis_msg_ncache >= NGX_STREAM_REDIS_MSG_CACHE) {
+        ngx_free(msg);
+        return;
+    }
+
+    ngx_queue_insert_head(&ngx_stream_redis_msg_cache, &msg->queue);
+    ngx_stream_redis_msg_ncache++;
+}
+
+
+/*
+ * queues msg on the least loaded connection to msg->node, a new connection
+ * is opened only when all of them have a backlog; the one picked is
+ * checked first when idle, the node may have closed it; writes are
+ * deferred to the posted write event so that commands of many sessions
+ * queued in one event loop pass leave in a single writev(); a read sent
+ * to a replica takes a READONLY connection; read_timeout bounds the wait
+ * for each reply
+ */
+ngx_int_t
+ngx_stream_redis_pool_send(ngx_stream_redis_msg_t *msg,
+    ngx_msec_t connect_timeout, ngx_msec_t read_timeout)
+{
+    ngx_queue_t                   *q;
+    ngx_connection_t              *c;
+    ngx_stream_redis_conn_t       *cn, *best;
+    ngx_stream_redis_node_peer_t  *np;
+
+    np = ngx_stream_redis_cluster_node_peer(msg->node);
+    if (np == NULL || ngx_stream_redis_pool_conf == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (np->conns.next == NULL) {
+        ngx_queue_init(&np->conns);
+    }
+
+    if (ngx_stream_redis_node_down(np)) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        best = NULL;
+
+        for (q = ngx_queue_head(&np->conns);
+             q != ngx_queue_sentinel(&np->conns);
+             q = ngx_queue_next(q))
+        {
+            cn = ngx_queue_data(q, ngx_stream_redis_conn_t, queue);
+
+            if (cn->readonly != msg->readonly) {
+                continue;
+            }
+
+            if (best == NULL || cn->nmsgs < best->nmsgs) {
+                best = cn;
+            }
+        }
+
+        if (best == NULL || best->nmsgs || !best->connected
+            || ngx_stream_redis_conn_test(best) == NGX_OK)
+        {
+            break;
+        }
+
+        /* closed by the node while idle, not a failure */
+        ngx_stream_redis_conn_close(best, NGX_OK);
+    }
+
+    if (best == NULL
+        || (best->nmsgs >= NGX_STREAM_REDIS_POOL_BACKLOG
+            && np->nconns < ngx_stream_redis_pool_conf->pool_max))
+    {
+        cn = ngx_stream_redis_conn_open(msg->node, np, connect_timeout,
+                                        msg->readonly);
+
+        if (cn != NULL) {
+            best = cn;
+
+        } else if (best == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    cn = best;
+    c = cn->peer.connection;
+
+    cn->read_timeout = read_timeout;
+
+    msg->conn = cn;
+    msg->req.pos = msg->start;
+    msg->sent = ngx_current_msec;
+
+    if (msg->asking) {
+        /* the static frame goes out in front of the request, not copied */
+        msg->ask.start = ngx_stream_redis_asking;
+        msg->ask.pos = msg->ask.start;
+        msg->ask.last = msg->ask.start + sizeof(ngx_stream_redis_asking) - 1;
+        msg->ask.end = msg->ask.last;
+        msg->ask.memory = 1;
+
+        msg->ask_reply = 1;
+    }
+
+    ngx_queue_insert_tail(&cn->send, &msg->link);
+    cn->nmsgs++;
+
+    if (cn->nmsgs == 1 && cn->connected) {
+        /* the idle timer gives way to the reply timeout */
+
+        if (read_timeout) {
+            ngx_add_timer(c->read, read_timeout);
+
+        } else if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+    }
+
+    if (cn->connected && !c->write->posted) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * the session of msg is going away; a message that has not been written
+ * at all is dropped, otherwise the connection keeps it until its reply
+ * arrives and frees it then
+ */
+void
+ngx_stream_redis_pool_cancel(ngx_stream_redis_msg_t *msg)
+{
+    size_t                    len;
+    u_char                   *p;
+    ngx_stream_redis_conn_t  *cn;
+
+    cn = msg->conn;
+
+    msg->session = NULL;
+
+    if (msg->req.pos == msg->req.last) {
+        /* in flight */
+        return;
+    }
+
+    if (msg->req.pos == msg->start && msg->ask.pos == msg->ask.last) {
+        ngx_queue_remove(&msg->link);
+        cn->nmsgs--;
+        ngx_stream_redis_msg_free(msg);
+        return;
+    }
+
+    if (msg->orphan) {
+        /* a generated request, the message owns it already */
+        return;
+    }
+
+    /* partially written, the rest still lives in the session buffer */
+
+    len = msg->req.last - msg->req.pos;
+
+    p = ngx_alloc(len, ngx_cycle->log);
+    if (p == NULL) {
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+        return;
+    }
+
+    ngx_memcpy(p, msg->req.pos, len);
+
+    msg->orphan = p;
+    msg->start = p;
+    msg->req.pos = p;
+    msg->req.last = p + len;
+}
+
+
+/*
+ * the node a read-only command for a slot of master goes to, one of its
+ * replicas unless read_from says otherwise or none of them is known or
+ * close enough behind the master; of two live replicas picked at random
+ * the less loaded one wins, so a replica slowed down by a fork loses
+ * traffic without starving
+ */
+ngx_stream_redis_node_t *
+ngx_stream_redis_pool_read_node(ngx_stream_redis_node_t *master,
+    ngx_uint_t read_from)
+{
+    ngx_uint_t                     i, n, k, m, a, b, lag;
+    uint16_t                       replicas[NGX_STREAM_REDIS_MAX_REPLICAS];
+    ngx_stream_redis_node_t       *node, *live[NGX_STREAM_REDIS_MAX_REPLICAS];
+    ngx_stream_redis_node_t       *resting[NGX_STREAM_REDIS_MAX_REPLICAS];
+    ngx_stream_redis_node_peer_t  *np;
+
+    n = ngx_stream_redis_cluster_replicas(master, replicas);
+
+    if (n == 0 || read_from == NGX_STREAM_REDIS_READ_MASTER) {
+        return master;
+    }
+
+    lag = ngx_stream_redis_pool_conf->replica_max_lag
+          || ngx_stream_redis_pool_conf->replica_max_lag_bytes;
+
+    k = 0;
+    m = 0;
+
+    for (i = 0; i < n; i++) {
+        node = ngx_stream_redis_cluster_node(replicas[i]);
+        np = ngx_stream_redis_cluster_node_peer(node);
+
+        if (np == NULL || (lag && node->lagging)) {
+            continue;
+        }
+
+        if (ngx_stream_redis_node_resting(np)) {
+            resting[m++] = node;
+
+        } else {
+            live[k++] = node;
+        }
+    }
+
+    if (k == 0) {
+        /* all of them failed recently or are too far behind */
+
+        if (read_from == NGX_STREAM_REDIS_READ_PREFER_REPLICAS || m == 0) {
+            return master;
+        }
+
+        return resting[ngx_stream_redis_pool_random() % m];
+    }
+
+    if (k == 1) {
+        return live[0];
+    }
+
+    a = ngx_stream_redis_pool_random() % k;
+    b = ngx_stream_redis_pool_random() % (k - 1);
+
+    if (b >= a) {
+        b++;
+    }
+
+    if (ngx_stream_redis_node_load(ngx_stream_redis_cluster_node_peer(live[b]))
+        < ngx_stream_redis_node_load(ngx_stream_redis_cluster_node_peer(live[a])))
+    {
+        a = b;
+    }
+
+    return live[a];
+}
+
+
+static ngx_stream_redis_conn_t *
+ngx_stream_redis_conn_open(ngx_stream_redis_node_t *node,
+    ngx_stream_redis_node_peer_t *np, ngx_msec_t connect_timeout,
+    ngx_uint_t readonly)
+{
+    u_char                   *p;
+    ngx_int_t                 rc;
+    ngx_connection_t         *c;
+    ngx_stream_redis_conn_t  *cn;
+
+    if (ngx_stream_redis_cluster_node_addr(node) == NULL) {
+        return NULL;
+    }
+
+    cn = ngx_alloc(sizeof(ngx_stream_redis_conn_t), ngx_cycle->log);
+    if (cn == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(cn, sizeof(ngx_stream_redis_conn_t));
+
+    p = ngx_alloc(NGX_STREAM_REDIS_POOL_BUFFER, ngx_cycle->log);
+    if (p == NULL) {
+        ngx_free(cn);
+        return NULL;
+    }
+
+    cn->buf.start = p;
+    cn->buf.pos = p;
+    cn->buf.last = p;
+    cn->buf.end = p + NGX_STREAM_REDIS_POOL_BUFFER;
+    cn->buf.temporary = 1;
+
+    cn->node = node;
+    cn->np = np;
+    cn->name.data = node->addr;
+    cn->name.len = node->addr_len;
+
+    if (readonly) {
+        cn->ro.start = ngx_stream_redis_readonly;
+        cn->ro.pos = cn->ro.start;
+        cn->ro.last = cn->ro.start + sizeof(ngx_stream_redis_readonly) - 1;
+        cn->ro.end = cn->ro.last;
+        cn->ro.memory = 1;
+
+        cn->readonly = 1;
+        cn->ro_reply = 1;
+    }
+
+    ngx_queue_init(&cn->send);
+    ngx_queue_init(&cn->inflight);
+
+    cn->peer.sockaddr = np->addr->sockaddr;
+    cn->peer.socklen = np->addr->socklen;
+    cn->peer.name = &cn->name;
+    cn->peer.get = ngx_event_get_peer;
+    cn->peer.log = ngx_cycle->log;
+    cn->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&cn->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "[redis_proxy] connect to %V failed", &cn->name);
+
+        ngx_free(cn->buf.start);
+        ngx_free(cn);
+
+        ngx_stream_redis_node_failed(node, np);
+
+        /* the node may have failed over */
+        ngx_stream_redis_cluster_refresh_stale();
+
+        return NULL;
+    }
+
+    c = cn->peer.connection;
+
+    c->data = cn;
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    ngx_queue_insert_tail(&np->conns, &cn->queue);
+    np->nconns++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "[redis_proxy] pool connect %V, %ui connections",
+                   &cn->name, np->nconns);
+
+    if (rc == NGX_AGAIN) {
+        c->read->handler = ngx_stream_redis_conn_connect_handler;
+        c->write->handler = ngx_stream_redis_conn_connect_handler;
+
+        ngx_add_timer(c->write, connect_timeout);
+
+        return cn;
+    }
+
+    if (ngx_stream_redis_conn_connected(cn) != NGX_OK) {
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+        return NULL;
+    }
+
+    return cn;
+}
+
+
+static void
+ngx_stream_redis_conn_connect_handler(ngx_event_t *ev)
+{
+    int                       err;
+    socklen_t                 len;
+    ngx_connection_t         *c;
+    ngx_stream_redis_conn_t  *cn;
+
+    c = ev->data;
+    cn = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "[redis_proxy] connect to %V timed out", &cn->name);
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+        return;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_stream_redis_conn_connected(cn) != NGX_OK) {
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+        return;
+    }
+
+    if (ngx_stream_redis_conn_flush(cn) != NGX_OK) {
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_redis_conn_connected(ngx_stream_redis_conn_t *cn)
+{
+    int                tcp_nodelay;
+    ngx_connection_t  *c;
+
+    c = cn->peer.connection;
+
+    if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+        tcp_nodelay = 1;
+
+        if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                       (const void *) &tcp_nodelay, sizeof(int)) == -1)
+        {
+            ngx_connection_error(c, ngx_socket_errno,
+                                 "setsockopt(TCP_NODELAY) failed");
+            return NGX_ERROR;
+        }
+
+        c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+    }
+
+    cn->connected = 1;
+
+    c->read->handler = ngx_stream_redis_conn_read_handler;
+    c->write->handler = ngx_stream_redis_conn_write_handler;
+
+    if (cn->nmsgs && cn->read_timeout) {
+        ngx_add_timer(c->read, cn->read_timeout);
+    }
+
+    if (!ngx_queue_empty(&cn->send) && !c->write->posted) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * an idle connection has nothing to read; EOF, an error or unexpected
+ * data that its read event has not been handled for yet all fail it
+ */
+static ngx_int_t
+ngx_stream_redis_conn_test(ngx_stream_redis_conn_t *cn)
+{
+    u_char             buf[1];
+    ssize_t            n;
+    ngx_connection_t  *c;
+
+    c = cn->peer.connection;
+
+    if (c->read->eof || c->read->error || cn->buf.pos != cn->buf.last) {
+        return NGX_ERROR;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        return NGX_OK;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_stream_redis_conn_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t         *c;
+    ngx_stream_redis_conn_t  *cn;
+
+    c = wev->data;
+    cn = c->data;
+
+    if (ngx_stream_redis_conn_flush(cn) != NGX_OK) {
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_redis_conn_flush(ngx_stream_redis_conn_t *cn)
+{
+    ngx_uint_t               n;
+    ngx_queue_t             *q;
+    ngx_chain_t             *out, **ll, *rv;
+    ngx_connection_t        *c;
+    ngx_stream_redis_msg_t  *msg;
+
+    c = cn->peer.connection;
+
+    while (!ngx_queue_empty(&cn->send)) {
+
+        out = NULL;
+        ll = &out;
+        n = 0;
+
+        if (cn->ro.pos != cn->ro.last) {
+            cn->ro_out.buf = &cn->ro;
+            cn->ro_out.next = NULL;
+
+            *ll = &cn->ro_out;
+            ll = &cn->ro_out.next;
+            n++;
+        }
+
+        for (q = ngx_queue_head(&cn->send);
+             q != ngx_queue_sentinel(&cn->send)
+             && n < NGX_STREAM_REDIS_POOL_IOVS;
+             q = ngx_queue_next(q), n++)
+        {
+            msg = ngx_queue_data(q, ngx_stream_redis_msg_t, link);
+
+            msg->out.buf = &msg->req;
+            msg->out.next = NULL;
+
+            if (msg->ask.pos != msg->ask.last) {
+                msg->ask_out.buf = &msg->ask;
+                msg->ask_out.next = &msg->out;
+
+                *ll = &msg->ask_out;
+
+            } else {
+                *ll = &msg->out;
+            }
+
+            ll = &msg->out.next;
+        }
+
+        rv = c->send_chain(c, out, 0);
+
+        if (rv == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+
+        while (!ngx_queue_empty(&cn->send)) {
+            q = ngx_queue_head(&cn->send);
+            msg = ngx_queue_data(q, ngx_stream_redis_msg_t, link);
+
+            if (msg->req.pos != msg->req.last) {
+                break;
+            }
+
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(&cn->inflight, q);
+        }
+
+        if (rv != NULL) {
+            break;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_redis_conn_read_handler(ngx_event_t *rev)
+{
+    size_t                    size;
+    ssize_t                   n;
+    u_char                   *p;
+    ngx_buf_t                *b;
+    ngx_uint_t                nmsgs;
+    ngx_connection_t         *c;
+    ngx_stream_redis_conn_t  *cn;
+
+    c = rev->data;
+    cn = c->data;
+    b = &cn->buf;
+
+    if (rev->timedout) {
+        rev->timedout = 0;
+
+        if (cn->nmsgs) {
+            /* a hung node, its commands fail and it counts as a failure */
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "[redis_proxy] %V timed out, %ui commands lost",
+                          &cn->name, cn->nmsgs);
+            ngx_stream_redis_conn_close(cn, NGX_ERROR);
+            return;
+        }
+
+        if (cn->np->nconns > ngx_stream_redis_pool_conf->pool_min) {
+            ngx_stream_redis_conn_close(cn, NGX_OK);
+            return;
+        }
+
+        /* keep pool_min connections however long they idle */
+        ngx_add_timer(rev, ngx_stream_redis_pool_conf->pool_idle_timeout);
+
+        return;
+    }
+
+    nmsgs = cn->nmsgs;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+
+            if (b->pos > b->start) {
+                b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+                b->pos = b->start;
+
+            } else {
+                /* a reply larger than the buffer */
+
+                size = 2 * (b->end - b->start);
+
+                p = ngx_alloc(size, c->log);
+                if (p == NULL) {
+                    ngx_stream_redis_conn_close(cn, NGX_ERROR);
+                    return;
+                }
+
+                b->last = ngx_cpymem(p, b->pos, b->last - b->pos);
+                ngx_free(b->start);
+
+                b->start = p;
+                b->pos = p;
+                b->end = p + size;
+            }
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if ((n == NGX_ERROR || n == 0) && cn->nmsgs == 0) {
+            /* the node's timeout closed an idle connection */
+            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "[redis_proxy] %V closed an idle connection",
+                           &cn->name);
+            ngx_stream_redis_conn_close(cn, NGX_OK);
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "[redis_proxy] %V closed the connection, "
+                          "%ui commands lost", &cn->name, cn->nmsgs);
+            ngx_stream_redis_conn_close(cn, NGX_ERROR);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_stream_redis_conn_process(cn) != NGX_OK) {
+            ngx_stream_redis_conn_close(cn, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_redis_conn_close(cn, NGX_ERROR);
+        return;
+    }
+
+    if (cn->nmsgs == 0) {
+        if (nmsgs || !rev->timer_set) {
+            ngx_add_timer(rev, ngx_stream_redis_pool_conf->pool_idle_timeout);
+        }
+
+    } else if (cn->nmsgs != nmsgs && cn->read_timeout) {
+        /* a reply came in, the next one has the whole timeout again */
+        ngx_add_timer(rev, cn->read_timeout);
+    }
+}
+
+
+/* hands every complete reply in the buffer to the oldest in-flight message */
+static ngx_int_t
+ngx_stream_redis_conn_process(ngx_stream_redis_conn_t *cn)
+{
+    u_char                  *end;
+    ngx_int_t                rc;
+    ngx_buf_t               *b;
+    ngx_queue_t             *q;
+    msg_type_t               type;
+    ngx_stream_redis_msg_t  *msg;
+
+    b = &cn->buf;
+
+    for ( ;; ) {
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+            return NGX_OK;
+        }
+
+        rc = redis_parse_rsp(b, &cn->rsp, &end, &type);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_OK;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, cn->peer.connection->log, 0,
+                          "[redis_proxy] %V sent an invalid reply",
+                          &cn->name);
+            return NGX_ERROR;
+        }
+
+        if (type == MSG_RSP_REDIS_PUSH) {
+            /* not a reply to any command */
+            b->pos = end;
+            continue;
+        }
+
+        if (cn->ro_reply) {
+            /* READONLY goes first, its reply does too */
+            cn->ro_reply = 0;
+
+            if (type != MSG_RSP_REDIS_STATUS) {
+                ngx_log_error(NGX_LOG_ERR, cn->peer.connection->log, 0,
+                              "[redis_proxy] %V refused READONLY",
+                              &cn->name);
+                return NGX_ERROR;
+            }
+
+            b->pos = end;
+            continue;
+        }
+
+        if (ngx_queue_empty(&cn->inflight)) {
+            ngx_log_error(NGX_LOG_ERR, cn->peer.connection->log, 0,
+                          "[redis_proxy] %V sent an unexpected reply",
+                          &cn->name);
+            return NGX_ERROR;
+        }
+
+        q = ngx_queue_head(&cn->inflight);
+        msg = ngx_queue_data(q, ngx_stream_redis_msg_t, link);
+
+        /* any reply, redirects included, shows the node is healthy */
+        cn->np->fails = 0;
+
+        if (msg->ask_reply) {
+            /* the +OK of ASKING */
+            msg->ask_reply = 0;
+            b->pos = end;
+            continue;
+        }
+
+        if (msg->nreplies > 1) {
+            /* a pipelined sub-request, one reply per command */
+            msg->nreplies--;
+
+            if (msg->session
+                && ngx_stream_redis_msg_append(msg, b->pos, end - b->pos,
+                                               cn->peer.connection->log)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            b->pos = end;
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        cn->nmsgs--;
+
+        msg->conn = NULL;
+
+        ngx_stream_redis_node_rtt(cn->np, ngx_current_msec - msg->sent);
+
+        if (msg->session == NULL) {
+            ngx_stream_redis_msg_free(msg);
+            b->pos = end;
+            continue;
+        }
+
+        if (ngx_stream_redis_msg_append(msg, b->pos, end - b->pos,
+                                        cn->peer.connection->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        msg->rsp_type = type;
+
+        b->pos = end;
+
+        msg->handler(msg);
+    }
+}
+
+
+/*
+ * copies a reply out of the connection buffer; the replies of a pipelined
+ * sub-request go one after another into one buffer, which doubles while
+ * more of them are expected
+ */
+static ngx_int_t
+ngx_stream_redis_msg_append(ngx_stream_redis_msg_t *msg, u_char *data,
+    size_t len, ngx_log_t *log)
+{
+    size_t   size, used;
+    u_char  *p;
+
+    used = msg->rsp.last - msg->rsp.pos;
+
+    if ((size_t) (msg->rsp.end - msg->rsp.last) < len) {
+
+        size = used + len;
+
+        if (msg->nreplies > 1) {
+            size *= 2;
+        }
+
+        p = ngx_alloc(size, log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (used) {
+            ngx_memcpy(p, msg->rsp.pos, used);
+        }
+
+        if (msg->rsp.temporary) {
+            ngx_free(msg->rsp.start);
+        }
+
+        msg->rsp.start = p;
+        msg->rsp.pos = p;
+        msg->rsp.last = p + used;
+        msg->rsp.end = p + size;
+        msg->rsp.temporary = 1;
+    }
+
+    msg->rsp.last = ngx_cpymem(msg->rsp.last, data, len);
+
+    return NGX_OK;
+}
+
+
+/*
+ * every message still queued gets an error reply; handlers must not free
+ * other messages synchronously, so walking a detached queue is safe
+ */
+static void
+ngx_stream_redis_conn_close(ngx_stream_redis_conn_t *cn, ngx_int_t rc)
+{
+    ngx_queue_t              failed, *q;
+    ngx_stream_redis_msg_t  *msg;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, ngx_cycle->log, 0,
+                   "[redis_proxy] pool close %V, %ui commands pending",
+                   &cn->name, cn->nmsgs);
+
+    ngx_queue_remove(&cn->queue);
+    cn->np->nconns--;
+
+    ngx_queue_init(&failed);
+
+    while (!ngx_queue_empty(&cn->inflight)) {
+        q = ngx_queue_head(&cn->inflight);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&failed, q);
+    }
+
+    while (!ngx_queue_empty(&cn->send)) {
+        q = ngx_queue_head(&cn->send);
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&failed, q);
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_stream_redis_node_failed(cn->node, cn->np);
+    }
+
+    ngx_close_connection(cn->peer.connection);
+    ngx_free(cn->buf.start);
+    ngx_free(cn);
+
+    if (rc == NGX_ERROR) {
+        ngx_stream_redis_cluster_refresh_stale();
+    }
+
+    while (!ngx_queue_empty(&failed)) {
+        q = ngx_queue_head(&failed);
+        ngx_queue_remove(q);
+
+        msg = ngx_queue_data(q, ngx_stream_redis_msg_t, link);
+        msg->conn = NULL;
+
+        if (msg->session == NULL || rc == NGX_ABORT) {
+            ngx_stream_redis_msg_free(msg);
+            continue;
+        }
+
+        if (msg->rsp.temporary) {
+            /* the replies of a sub-request collected so far */
+            ngx_free(msg->rsp.start);
+            msg->rsp.temporary = 0;
+        }
+
+        msg->rsp.start = ngx_stream_redis_conn_lost;
+        msg->rsp.pos = msg->rsp.start;
+        msg->rsp.last = msg->rsp.start + sizeof(ngx_stream_redis_conn_lost) - 1;
+        msg->rsp.end = msg->rsp.last;
+        msg->rsp.memory = 1;
+        msg->rsp_type = MSG_RSP_REDIS_ERROR;
+
+        msg->handler(msg);
+    }
+}
+
+
+/*
+ * after max_fails transport errors in a row the node gets no commands
+ * for fail_timeout, then one is let through to probe it
+ */
+static ngx_int_t
+ngx_stream_redis_node_down(ngx_stream_redis_node_peer_t *np)
+{
+    ngx_uint_t  max_fails;
+
+    if (ngx_stream_redis_node_resting(np)) {
+        return 1;
+    }
+
+    max_fails = ngx_stream_redis_pool_conf->max_fails;
+
+    if (max_fails && np->fails >= max_fails) {
+        /* fail_timeout is over, this command probes the node */
+        np->checked = ngx_current_msec;
+    }
+
+    return 0;
+}
+
+
+/* as node_down(), but leaves the probe to whoever sends the command */
+static ngx_int_t
+ngx_stream_redis_node_resting(ngx_stream_redis_node_peer_t *np)
+{
+    ngx_uint_t  max_fails;
+
+    max_fails = ngx_stream_redis_pool_conf->max_fails;
+
+    if (max_fails == 0 || np->fails < max_fails) {
+        return 0;
+    }
+
+    return ngx_current_msec - np->checked
+           <= ngx_stream_redis_pool_conf->fail_timeout;
+}
+
+
+static void
+ngx_stream_redis_node_failed(ngx_stream_redis_node_t *node,
+    ngx_stream_redis_node_peer_t *np)
+{
+    np->fails++;
+    np->checked = ngx_current_msec;
+
+    if (np->fails == ngx_stream_redis_pool_conf->max_fails) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "[redis_proxy] %*s is unavailable for %M",
+                      node->addr_len, node->addr,
+                      ngx_stream_redis_pool_conf->fail_timeout);
+    }
+}
+
+
+/* srtt += rtt - srtt / 8, as TCP does, kept times 8 */
+static void
+ngx_stream_redis_node_rtt(ngx_stream_redis_node_peer_t *np, ngx_msec_t rtt)
+{
+    if (np->replied == 0) {
+        np->rtt = rtt << 3;
+
+    } else {
+        np->rtt = np->rtt - (np->rtt >> 3) + rtt;
+    }
+
+    np->replied = ngx_current_msec ? ngx_current_msec : 1;
+}
+
+
+/*
+ * reply time times the commands waiting on the node; the time halves with
+ * every NGX_STREAM_REDIS_RTT_DECAY without a reply, so a node that lost
+ * its traffic while slow is tried again
+ */
+static ngx_uint_t
+ngx_stream_redis_node_load(ngx_stream_redis_node_peer_t *np)
+{
+    ngx_uint_t                pending;
+    ngx_msec_t                rtt, age;
+    ngx_queue_t              *q;
+    ngx_stream_redis_conn_t  *cn;
+
+    rtt = np->rtt;
+
+    if (np->replied) {
+        age = (ngx_current_msec - np->replied) / NGX_STREAM_REDIS_RTT_DECAY;
+        rtt = (age < 32) ? rtt >> age : 0;
+    }
+
+    pending = 0;
+
+    if (np->conns.next != NULL) {
+        for (q = ngx_queue_head(&np->conns);
+             q != ngx_queue_sentinel(&np->conns);
+             q = ngx_queue_next(q))
+        {
+            cn = ngx_queue_data(q, ngx_stream_redis_conn_t, queue);
+            pending += cn->nmsgs;
+        }
+    }
+
+    return (rtt + 1) * (pending + 1);
+}
+
+
+/* xorshift64*, cheaper than random() and never reseeded */
+static uint64_t
+ngx_stream_redis_pool_random(void)
+{
+    uint64_t  x;
+
+    x = ngx_stream_redis_pool_seed;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    ngx_stream_redis_pool_seed = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
@@ -0,0 +1,54 @@
+#ifndef NGX_STREAM_REDIS_POOL_H
+#define NGX_STREAM_REDIS_POOL_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_stream_redis_proxy_module.h"
+#include "ngx_redis_proto.h"
+
+
+/*
+ * a connection to a cluster node shared by all sessions of the worker,
+ * replies come back in the order the requests were written; one for reads
+ * from a replica sends READONLY ahead of everything else
+ */
+struct ngx_stream_redis_conn_s {
+    ngx_queue_t                            queue;
+    ngx_peer_connection_t                  peer;
+    ngx_stream_redis_node_t               *node;
+    ngx_stream_redis_node_peer_t          *np;
+
+    ngx_queue_t                            send;
+    ngx_queue_t                            inflight;
+    ngx_uint_t                             nmsgs;
+    ngx_msec_t                             read_timeout; /* 0 waits forever */
+
+    ngx_buf_t                              buf;
+    redis_rsp_parser_t                     rsp;
+    ngx_str_t                              name;
+
+    ngx_chain_t                            ro_out;
+    ngx_buf_t                              ro;
+
+    unsigned                               connected:1;
+    unsigned                               readonly:1;
+    unsigned                               ro_reply:1;  /* +OK to drop */
+};
+
+
+ngx_int_t ngx_stream_redis_pool_init(ngx_cycle_t *cycle);
+void ngx_stream_redis_pool_exit(ngx_cycle_t *cycle);
+
+ngx_int_t ngx_stream_redis_pool_send(ngx_stream_redis_msg_t *msg,
+    ngx_msec_t connect_timeout, ngx_msec_t read_timeout);
+void ngx_stream_redis_pool_cancel(ngx_stream_redis_msg_t *msg);
+ngx_stream_redis_node_t *ngx_stream_redis_pool_read_node(
+    ngx_stream_redis_node_t *master, ngx_uint_t read_from);
+
+ngx_stream_redis_msg_t *ngx_stream_redis_msg_alloc(void);
+void ngx_stream_redis_msg_free(ngx_stream_redis_msg_t *msg);
+
+
+#endif /* NGX_STREAM_REDIS_POOL_H */
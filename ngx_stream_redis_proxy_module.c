@@ -2,6 +2,9 @@
 #include "ngx_stream_redis_interface.h"
 #include "common.h"
 #include "ngx_redis_proto.h"
+#include "ngx_stream_redis_fanout.h"
+#include "ngx_stream_redis_cache.h"
+#include "ngx_stream_redis_hotkeys.h"
 
 typedef struct {
 
@@ -9,14 +12,14 @@ typedef struct {
     ngx_msec_t                       upstream_read_timeout;
     ngx_msec_t                       connect_timeout;
     ngx_msec_t                       timeout;
-    ngx_msec_t                       next_upstream_timeout;
     size_t                           buffer_size;
     size_t                           upload_rate;
     size_t                           download_rate;
     ngx_uint_t                       responses;
-    ngx_uint_t                       next_upstream_tries;
-    ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
+    ngx_flag_t                       msetnx_split;
+    ngx_uint_t                       read_from;
+    ngx_msec_t                       read_your_writes;
     ngx_addr_t                      *local;
 
     ngx_stream_upstream_srv_conf_t  *upstream;
@@ -29,35 +32,47 @@ static void
 ngx_stream_redis_proxy_exit_process(ngx_cycle_t *cycle);
 
 
-static void
-ngx_stream_redis_read_request_handler(ngx_event_t *rev);
-static void
-ngx_stream_redis_write_request_handler(ngx_event_t *wev);
-
-static void ngx_stream_redis_proxy_connect_handler(ngx_event_t *ev);
-
-static void ngx_stream_redis_proxy_upstream_read_handler(ngx_event_t *rev);
-static void ngx_stream_redis_proxy_upstream_write_handler(ngx_event_t *rev);
-
-
 static void ngx_stream_redis_proxy_handler(ngx_stream_session_t *s);
-static void ngx_stream_redis_proxy_connect(ngx_stream_session_t *s);
-static void ngx_stream_redis_proxy_init_upstream(ngx_stream_session_t *s);
-static void ngx_stream_redis_proxy_process_connection(ngx_event_t *ev,
-    ngx_uint_t from_upstream);
-static ngx_int_t ngx_stream_redis_proxy_test_connect(ngx_connection_t *c);
-
-static void ngx_stream_redis_proxy_next_upstream(ngx_stream_session_t *s);
-static void ngx_stream_redis_proxy_finalize(ngx_stream_session_t *s, ngx_int_t rc);
+static ngx_int_t ngx_stream_redis_proxy_read_request(ngx_stream_session_t *s);
+static void ngx_stream_redis_read_request_handler(ngx_event_t *rev);
+static void ngx_stream_redis_write_request_handler(ngx_event_t *wev);
+static void ngx_stream_redis_proxy_process_requests(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_redis_proxy_dispatch(ngx_stream_session_t *s);
+static void ngx_stream_redis_proxy_compact(ngx_stream_redis_proxy_ctx_t *ctx);
+static ngx_int_t ngx_stream_redis_proxy_scatter(ngx_stream_redis_msg_t *msg);
+static void ngx_stream_redis_proxy_forward(ngx_stream_redis_msg_t *msg);
+static void ngx_stream_redis_proxy_delay(ngx_stream_redis_msg_t *msg);
+static void ngx_stream_redis_proxy_retry_handler(ngx_event_t *ev);
+static void ngx_stream_redis_proxy_wrote(ngx_stream_redis_proxy_ctx_t *ctx,
+    ngx_uint_t slot);
+static ngx_uint_t ngx_stream_redis_proxy_written(ngx_stream_redis_msg_t *msg,
+    ngx_msec_t window);
+static void ngx_stream_redis_proxy_reply_handler(ngx_stream_redis_msg_t *msg);
+static void ngx_stream_redis_proxy_complete(ngx_stream_redis_msg_t *msg);
+static void ngx_stream_redis_proxy_reply_local(ngx_stream_redis_msg_t *msg,
+    ngx_str_t *rsp);
+static void ngx_stream_redis_proxy_hotkeys(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p);
+static void ngx_stream_redis_proxy_finalize(ngx_stream_session_t *s,
+    ngx_int_t rc);
 static u_char *ngx_stream_redis_proxy_log_error(ngx_log_t *log, u_char *buf,
     size_t len);
 
+static void *ngx_stream_redis_proxy_create_main_conf(ngx_conf_t *cf);
+static char *ngx_stream_redis_proxy_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_stream_redis_proxy_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_stream_redis_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_stream_redis_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 
+static ngx_conf_enum_t  ngx_stream_redis_read_from[] = {
+    { ngx_string("master"), NGX_STREAM_REDIS_READ_MASTER },
+    { ngx_string("prefer_replicas"), NGX_STREAM_REDIS_READ_PREFER_REPLICAS },
+    { ngx_string("replicas"), NGX_STREAM_REDIS_READ_REPLICAS },
+    { ngx_null_string, 0 }
+};
+
 static ngx_conf_deprecated_t  ngx_conf_deprecated_proxy_downstream_buffer = {
     ngx_conf_deprecated, "proxy_downstream_buffer", "proxy_buffer_size"
 };
@@ -125,25 +140,130 @@ static ngx_command_t  ngx_stream_redis_proxy_commands[] = {
       offsetof(ngx_stream_redis_proxy_srv_conf_t, buffer_size),
       &ngx_conf_deprecated_proxy_upstream_buffer },
 
-    { ngx_string("redis_proxy_next_upstream"),
+    { ngx_string("redis_msetnx_split"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
       NGX_STREAM_SRV_CONF_OFFSET,
-      offsetof(ngx_stream_redis_proxy_srv_conf_t, next_upstream),
+      offsetof(ngx_stream_redis_proxy_srv_conf_t, msetnx_split),
       NULL },
 
-    { ngx_string("redis_proxy_next_upstream_tries"),
+    { ngx_string("redis_read_from"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_num_slot,
+      ngx_conf_set_enum_slot,
       NGX_STREAM_SRV_CONF_OFFSET,
-      offsetof(ngx_stream_redis_proxy_srv_conf_t, next_upstream_tries),
-      NULL },
+      offsetof(ngx_stream_redis_proxy_srv_conf_t, read_from),
+      &ngx_stream_redis_read_from },
 
-    { ngx_string("redis_proxy_next_upstream_timeout"),
+    { ngx_string("redis_read_your_writes"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
       NGX_STREAM_SRV_CONF_OFFSET,
-      offsetof(ngx_stream_redis_proxy_srv_conf_t, next_upstream_timeout),
+      offsetof(ngx_stream_redis_proxy_srv_conf_t, read_your_writes),
+      NULL },
+
+    { ngx_string("redis_cluster_refresh_interval"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, refresh_interval),
+      NULL },
+
+    { ngx_string("redis_cluster_refresh_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, refresh_timeout),
+      NULL },
+
+    { ngx_string("redis_cluster_pool_max"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, pool_max),
+      NULL },
+
+    { ngx_string("redis_cluster_pool_min"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, pool_min),
+      NULL },
+
+    { ngx_string("redis_cluster_pool_idle_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, pool_idle_timeout),
+      NULL },
+
+    { ngx_string("redis_cluster_max_fails"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, max_fails),
+      NULL },
+
+    { ngx_string("redis_cluster_fail_timeout"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, fail_timeout),
+      NULL },
+
+    { ngx_string("redis_cluster_replica_max_lag"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, replica_max_lag),
+      NULL },
+
+    { ngx_string("redis_cluster_replica_max_lag_bytes"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, replica_max_lag_bytes),
+      NULL },
+
+    { ngx_string("redis_cluster_near_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, near_cache),
+      NULL },
+
+    { ngx_string("redis_cluster_near_cache_ttl"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, near_cache_ttl),
+      NULL },
+
+    { ngx_string("redis_cluster_near_cache_prefix"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, near_cache_prefixes),
+      NULL },
+
+    { ngx_string("redis_cluster_hotkeys"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, hotkeys),
+      NULL },
+
+    { ngx_string("redis_cluster_hotkeys_window"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, hotkeys_window),
+      NULL },
+
+    { ngx_string("redis_cluster_hotkeys_threshold"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_MAIN_CONF_OFFSET,
+      offsetof(ngx_stream_redis_cluster_conf_t, hotkeys_threshold),
       NULL },
 
       ngx_null_command
@@ -153,8 +273,8 @@ static ngx_command_t  ngx_stream_redis_proxy_commands[] = {
 static ngx_stream_module_t  ngx_stream_redis_proxy_module_ctx = {
     NULL,                                  /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_stream_redis_proxy_create_main_conf,     /* create main configuration */
+    ngx_stream_redis_proxy_init_main_conf,       /* init main configuration */
 
     ngx_stream_redis_proxy_create_srv_conf,      /* create server configuration */
     ngx_stream_redis_proxy_merge_srv_conf        /* merge server configuration */
@@ -177,98 +297,97 @@ ngx_module_t  ngx_stream_redis_proxy_module = {
 };
 
 
-static ngx_int_t
-ngx_stream_redis_proxy_send_buffer(ngx_stream_session_t *s,ngx_connection_t *dst,
-        ngx_buf_t *b, ngx_msec_t send_timeout)
-{
-    size_t                          size;
-    ssize_t                         n = 0;
-    ngx_connection_t                *c;
-
-    c = s->connection;
-
-    for ( ;; ) {
-
-        size = b->last - b->pos;
+static ngx_str_t  ngx_stream_redis_pong = ngx_string("+PONG\r\n");
+static ngx_str_t  ngx_stream_redis_ok = ngx_string("+OK\r\n");
+static ngx_str_t  ngx_stream_redis_noauth =
+    ngx_string("-ERR Client sent AUTH, but no password is set\r\n");
+static ngx_str_t  ngx_stream_redis_crossslot =
+    ngx_string("-CROSSSLOT Keys in request don't hash to the same slot\r\n");
+static ngx_str_t  ngx_stream_redis_clusterdown =
+    ngx_string("-CLUSTERDOWN Hash slot not served\r\n");
+static ngx_str_t  ngx_stream_redis_unavailable =
+    ngx_string("-ERR redis_proxy: cluster node unavailable\r\n");
+static ngx_str_t  ngx_stream_redis_invalid =
+    ngx_string("-ERR redis_proxy: invalid reply from cluster node\r\n");
+static ngx_str_t  ngx_stream_redis_hotkeys_off =
+    ngx_string("-ERR redis_proxy: redis_cluster_hotkeys is not set\r\n");
+static ngx_str_t  ngx_stream_redis_syntax =
+    ngx_string("-ERR syntax error\r\n");
+static ngx_str_t  ngx_stream_redis_oom =
+    ngx_string("-OOM redis_proxy: out of memory\r\n");
 
-        // 条件是有数据，且dst连接是可写的
-        //if (size && dst && dst->write->ready) {
-        if (size && dst ) {
 
-            if (size <= 0) {
-                 ngx_log_error(NGX_LOG_ERR, dst->log, 0,
-                         "[stream_redis_proxy] send buffer_size is too small for"
-                         "the request");
+static void
+ngx_stream_redis_proxy_handler(ngx_stream_session_t *s)
+{
+    ngx_connection_t                        *c;
+    ngx_stream_redis_proxy_ctx_t            *ctx;
+    ngx_stream_redis_proxy_srv_conf_t       *pscf;
 
-                 return NGX_ERROR;
-             }
+    c = s->connection;
 
-             n = dst->send(dst, b->pos, size);
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                   "proxy connection handler");
 
-             ngx_log_debug1(NGX_LOG_DEBUG_STREAM, dst->log, 0,
-                     "[stream_redis_proxy] send returns %z", n);
+    ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_redis_proxy_ctx_t));
+    if (ctx == NULL) {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
+    }
+    ngx_stream_set_ctx(s, ctx, ngx_stream_redis_proxy_module);
 
-             if (n > 0) {
-                 b->pos += n;
+    ngx_queue_init(&ctx->msgs);
 
-                 if (b->pos == b->last) {
+    ctx->buffer_in = ngx_create_temp_buf(c->pool, pscf->buffer_size);
+    if (ctx->buffer_in == NULL) {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
+    }
 
-                     b->pos = b->start;
-                     b->last = b->start;
+    if (ngx_array_init(&ctx->parser.args, c->pool, 8,
+                       sizeof(ngx_stream_redis_arg_t))
+        != NGX_OK)
+    {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
+    }
 
-                    break;
-                 }
+    if (ngx_array_init(&ctx->parser.slots, c->pool, 8, sizeof(uint16_t))
+        != NGX_OK)
+    {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
+    }
 
-                 continue;
-             }
-        }
-        break;
-    }//
+    s->log_handler = ngx_stream_redis_proxy_log_error;
+    c->log->action = "proxying connection";
 
-    if (n == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, dst->log, 0,
-                "[stream_redis_proxy] n is  error");
+    c->write->handler = ngx_stream_redis_write_request_handler;
+    c->read->handler = ngx_stream_redis_read_request_handler;
 
-        ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
-        return NGX_DONE;
+    if (c->read->ready) {
+        ngx_post_event(c->read, &ngx_posted_events);
     }
 
-    if ( n == NGX_AGAIN ) {
-
-        if (!dst->write->timer_set) {
-            ngx_add_timer(dst->write, send_timeout);
-        }
-
-        if ( !dst->shared && ngx_handle_write_event(dst->write, 0) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    ngx_add_timer(c->read, pscf->client_read_timeout);
 
-        return NGX_AGAIN;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
     }
-
-    return NGX_OK;
 }
 
 
 static ngx_int_t
 ngx_stream_redis_proxy_read_request(ngx_stream_session_t *s)
 {
-    off_t                                   *received;
-    ngx_buf_t                               *b;
-    size_t                                  size;
     ssize_t                                 n;
-    ngx_int_t                               rc;
-    ngx_connection_t                        *c, *src;
+    ngx_buf_t                               *b;
+    ngx_connection_t                        *c;
     ngx_stream_redis_proxy_ctx_t            *ctx;
-    ngx_stream_redis_proxy_srv_conf_t       *pscf;
 
     c = s->connection;
-    src = c;
-
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-    if (pscf == NULL) {
-        return NGX_ERROR;
-    }
 
     ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
     if (ctx == NULL) {
@@ -276,897 +395,847 @@ ngx_stream_redis_proxy_read_request(ngx_stream_session_t *s)
     }
 
     b = ctx->buffer_in;
-    received = &s->received;
 
     for ( ;; ) {
 
-        size = b->end - b->last;
+        if (b->last == b->end) {
+            ngx_stream_redis_proxy_compact(ctx);
 
-        if (size <= 0) {
-            ngx_log_error(NGX_LOG_ERR, src->log, 0,
-                    "[stream_redis_proxy] read request_buffer_size is too small for"
-                    "the request");
-
-            return NGX_ERROR;
+            if (b->last == b->end) {
+                break;
+            }
         }
 
-        n = src->recv(src, b->last, size);
+        n = c->recv(c, b->last, b->end - b->last);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, src->log, 0,
-                "[stream_redis_proxy] recv returns %z", n);
+        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                "[redis_proxy] recv returns %z", n);
 
-        if (n > 0) {
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-            ctx->client_read = 0;
+        if (n == 0) {
+            // 客户端半关闭, 已发来的命令仍然要回复
+            break;
+        }
 
-            //增加接收的数据字节数
-            *received += n;
+        s->received += n;
+        b->last += n;
+    }
 
-            //缓冲区的末尾指针移动，表示收到了n字节新数据
-            b->last += n;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, src->log, 0,
-                    "[stream_redis_proxy] recv buffer=[%s]", b->pos);
+    return NGX_OK;
+}
 
-            rc = redis_parse_req(s);
-            if (rc == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, src->log, 0,
-                        "[stream_redis_proxy] redis_parse_req data=[%s]", b->pos);
-                return NGX_ERROR;
-            }
 
-            if (rc == NGX_AGAIN) {
-                //NGX_AGAIN 协议不完整
-                continue;
-            }
+static void
+ngx_stream_redis_read_request_handler(ngx_event_t *rev)
+{
+    ngx_connection_t                    *c;
+    ngx_stream_session_t                *s;
+    ngx_stream_redis_proxy_ctx_t        *ctx;
 
-            rc = ngx_stream_redis_process_request(s);
-            if (rc == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, src->log, 0,
-                        "[stream_redis_proxy] ngx_stream_redis_process_request data=[%s]", b->pos);
-                return NGX_ERROR;
-            }
+    c = rev->data;
+    s = c->data;
 
-            ctx->client_read = 1;
-            break;
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_read_request_handler");
 
-        break;
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
+    if (ctx == NULL) {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
     }
 
-    if (n == NGX_AGAIN) {
-
-        if (!src->read->timer_set) {
-            ngx_add_timer(src->read, pscf->client_read_timeout);
-        }
+    if (rev->timedout) {
+        c->timedout = 1;
 
-        if (ngx_handle_read_event(src->read, 0) != NGX_OK) {
-             return NGX_ERROR;
+        if (ctx->nmsgs) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "[redis_proxy] upstream timed out");
+        } else {
+            ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
         }
 
-        return NGX_AGAIN;
+        ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
+        return;
     }
 
-    if (n == NGX_ERROR) {
-        src->read->eof = 1;
-        return NGX_OK;
+    if (ngx_stream_redis_proxy_read_request(s) != NGX_OK) {
+        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        return;
     }
 
-    return NGX_OK;
+    ngx_stream_redis_proxy_process_requests(s);
 }
 
-static ngx_int_t
-ngx_stream_redis_proxy_read_upstream(ngx_stream_session_t *s)
+
+/*
+ * turns every complete command in buffer_in into a message and routes it
+ * on its own; replies are written back in the order of ctx->msgs
+ */
+static void
+ngx_stream_redis_proxy_process_requests(ngx_stream_session_t *s)
 {
     ngx_int_t                               rc;
-    off_t                                   *received;
-    ssize_t                                 size, n;
     ngx_buf_t                               *b;
-    ngx_connection_t                        *c, *dst, *pc, *src;
-    ngx_stream_upstream_t                   *u;
+    ngx_connection_t                        *c;
     ngx_stream_redis_proxy_ctx_t            *ctx;
     ngx_stream_redis_proxy_srv_conf_t       *pscf;
 
-    u = s->upstream;
     c = s->connection;
-    pc = u->connected ? u->peer.connection : NULL;
-    src = pc;
-    dst = c;
 
     pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-    if (pscf == NULL) {
-        return NGX_ERROR;
-    }
-
     ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        return NGX_ERROR;
-    }
 
-    b = &u->upstream_buf;
-    received = &u->received;
+    b = ctx->buffer_in;
 
     for ( ;; ) {
 
-        size = b->end - b->last;
-
-        if (size <= 0) {
-            ngx_log_error(NGX_LOG_ERR, src->log, 0,
-                    "[stream_redis_proxy] read upstream_buffer_size is too small for"
-                    "the request");
+        if (ctx->eof) {
+            // QUIT 之后的命令不再处理, 回复写完即关闭
+            if (ctx->nmsgs == 0) {
+                ngx_stream_redis_proxy_finalize(s, NGX_OK);
+                return;
+            }
 
-            return NGX_ERROR;
+            break;
         }
 
-        n = src->recv(src, b->last, size);
-
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, src->log, 0,
-                "[stream_redis_proxy] recv returns %z", n);
-
-        if (n > 0) {
-
-            ctx->upstream_read = 0;
+        if (ctx->nmsgs >= NGX_STREAM_REDIS_MAX_PIPELINE) {
+            break;
+        }
 
-            //增加接收的数据字节数
-             *received += n;
+        if (b->pos == b->last && ctx->nmsgs == 0) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
 
-            // 缓冲区的末尾指针移动，表示收到了n字节新数据
-            b->last += n;
+        rc = redis_parse_req(s);
 
-            ngx_log_debug1(NGX_LOG_DEBUG_STREAM, src->log, 0,
-                    "[stream_redis_proxy] recv buffer=[%s]", b->pos);
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "[redis_proxy] invalid request from client");
+            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+            return;
+        }
 
-            rc = redis_parse_rsp(s);
-            if (rc == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, src->log, 0,
-                        "[stream_redis_proxy] redis_parse_rsp data=[%s]", b->pos);
-                return NGX_ERROR;
-            }
+        if (rc == NGX_AGAIN) {
 
-            if (rc == NGX_AGAIN) {
-                //NGX_AGAIN 协议不完整
-                continue;
+            if ((c->read->eof || c->read->error) && ctx->nmsgs == 0) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0, "client disconnected");
+                ngx_stream_redis_proxy_finalize(s, NGX_OK);
+                return;
             }
 
-            rc = ngx_stream_redis_process_response(s, b);
-            if (rc == NGX_ERROR) {
-                ngx_log_error(NGX_LOG_ERR, src->log, 0,
-                        "[stream_redis_proxy] ngx_stream_redis_process_response data=[%s]", b->pos);
-                return NGX_ERROR;
+            if (b->last == b->end && b->pos == b->start) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "[redis_proxy] request is larger than "
+                              "redis_proxy_buffer_size");
+                ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+                return;
             }
 
-            ctx->upstream_read = 1;
             break;
         }
 
-        break;
-    }
-
-    if (n == NGX_ERROR) {
-        src->read->eof = 1;
-        return NGX_OK;
-    }
-
-    if (n == NGX_AGAIN) {
-
-        if (!src->read->timer_set) {
-            ngx_add_timer(src->read, pscf->timeout);
-        }
-
-        if ( !src->shared &&  ngx_handle_read_event(src->read, 0) != NGX_OK) {
-            return NGX_ERROR;
+        if (ngx_stream_redis_proxy_dispatch(s) != NGX_OK) {
+            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+            return;
         }
+    }
 
-        return NGX_AGAIN;
+    if (b->last == b->end) {
+        ngx_stream_redis_proxy_compact(ctx);
     }
 
-    //重试
-    if ( ctx->type == MSG_RSP_REDIS_ERROR_ASK  || ctx->type == MSG_RSP_REDIS_ERROR_MOVED  ||
-            ctx->type == MSG_RSP_REDIS_ERROR_TRYAGAIN ) {
-        ngx_stream_redis_proxy_next_upstream(s);
-        return NGX_OK;
+    // 缓冲区满或命令积压时没有读完的数据, 腾出空间后继续读
+    if (c->read->ready && !c->read->posted && b->last != b->end
+        && ctx->nmsgs < NGX_STREAM_REDIS_MAX_PIPELINE)
+    {
+        ngx_post_event(c->read, &ngx_posted_events);
     }
 
-    return NGX_OK;
+    ngx_add_timer(c->read, ctx->nmsgs ? pscf->timeout
+                                      : pscf->client_read_timeout);
 }
 
 
-static void
-ngx_stream_redis_proxy_handler(ngx_stream_session_t *s)
+static ngx_int_t
+ngx_stream_redis_proxy_dispatch(ngx_stream_session_t *s)
 {
-    ngx_connection_t                        *c;
+    uint16_t                                *slots;
+    ngx_uint_t                               i;
+    ngx_buf_t                               *b;
+    ngx_stream_redis_msg_t                  *msg;
+    ngx_stream_redis_arg_t                  *arg;
+    ngx_stream_redis_node_t                 *node;
     ngx_stream_redis_proxy_ctx_t            *ctx;
+    const ngx_stream_redis_command_t        *cmd;
     ngx_stream_redis_proxy_srv_conf_t       *pscf;
 
-    ctx = NULL;
-    c = s->connection;
-
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                   "proxy connection handler");
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
+    b = ctx->buffer_in;
 
-    ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_redis_proxy_ctx_t));
-    if (ctx == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
+    msg = ngx_stream_redis_msg_alloc();
+    if (msg == NULL) {
+        return NGX_ERROR;
     }
-    ngx_stream_set_ctx(s, ctx, ngx_stream_redis_proxy_module);
 
-    ctx->upstream_connect = 1;
-    ctx->buffer_in = ngx_create_temp_buf(c->pool, pscf->buffer_size);
-    if (ctx->buffer_in == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
+    msg->session = s;
+    msg->handler = ngx_stream_redis_proxy_reply_handler;
+    msg->type = ctx->type;
+    msg->command = ctx->command;
+    msg->slotid = ctx->slotid;
 
-    c->write->handler = ngx_stream_redis_write_request_handler;
-    c->read->handler = ngx_stream_redis_read_request_handler;
+    msg->start = b->pos;
+    msg->req.pos = b->pos;
+    msg->req.last = ctx->request_end;
+    msg->req.memory = 1;
 
-    if (c->read->ready) {
-        ngx_post_event(c->read, &ngx_posted_events);
-    }
+    b->pos = ctx->request_end;
 
-    ngx_add_timer(s->connection->write, 60000);
+    ngx_queue_insert_tail(&ctx->msgs, &msg->queue);
+    ctx->nmsgs++;
 
-    if (!c->shared && ngx_handle_read_event(c->read, 0) != NGX_OK) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
+    switch (msg->type) {
 
-}
+    case MSG_REQ_REDIS_PING:
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_pong);
+        return NGX_OK;
 
-static ngx_int_t
-ngx_stream_redis_read_request_check(ngx_stream_session_t *s, ngx_connection_t *src, ngx_connection_t *dst, ngx_stream_upstream_t *u)
-{
-    // 这时应该是src已经读完，数据也发送完
-    if (src && src->read->eof && u &&  (u->upstream_buf.pos == u->upstream_buf.last || (dst && dst->read->eof))) {
-
-        // 这时应该是src已经读完，数据也发送完
-        ngx_log_error(NGX_LOG_INFO, src->log, 0,
-                            "%s%s disconnected"
-                            ", bytes from/to client:%O/%O"
-                            ", bytes from/to upstream:%O/%O",
-                            "",
-                            "client",
-                            s->received, src->sent, u->received, dst->sent);
-
-        // 在这里记录访问日志
+    case MSG_REQ_REDIS_QUIT:
+        ctx->eof = 1;
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_ok);
         return NGX_OK;
-    }
 
-    return NGX_AGAIN;
-}
+    case MSG_REQ_REDIS_AUTH:
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_noauth);
+        return NGX_OK;
 
+    case MSG_REQ_REDIS_HOTKEYS:
+        ngx_stream_redis_proxy_hotkeys(msg, &ctx->parser);
+        return NGX_OK;
 
+    default:
+        break;
+    }
 
+    // 统计本 worker 的热点 key
+    ngx_stream_redis_hotkeys_sample(msg, &ctx->parser);
 
-static void
-ngx_stream_redis_read_request_handler(ngx_event_t *rev)
-{
-    ngx_int_t                           rc;
-    ngx_connection_t                    *c, *pc = NULL, *src = NULL, *dst = NULL;
-    ngx_stream_session_t                *s;
-    ngx_stream_upstream_t                   *u;
-    ngx_stream_redis_proxy_ctx_t        *ctx;
-    ngx_stream_redis_proxy_srv_conf_t       *pscf;
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
 
-    c = rev->data;
-    s = c->data;
-    u = s->upstream;
-    src = c;
+    // 记下本会话写过的 slot, 之后一段时间内读这些 slot 不走从节点
+    if (pscf->read_your_writes
+        && pscf->read_from != NGX_STREAM_REDIS_READ_MASTER
+        && (msg->command->flags & NGX_STREAM_REDIS_CMD_WRITE)
+        && msg->slotid >= 0)
+    {
+        if (ctx->crossslot) {
+            slots = ctx->parser.slots.elts;
 
-    if ( u ) {
-        pc = u->connected ? u->peer.connection : NULL;
-        dst = pc;
-    }
+            for (i = 0; i < ctx->parser.slots.nelts; i++) {
+                ngx_stream_redis_proxy_wrote(ctx, slots[i]);
+            }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_read_request_handler");
+        } else {
+            ngx_stream_redis_proxy_wrote(ctx, msg->slotid);
+        }
+    }
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        return;
+    // 写命令一经转发, 本 worker 近端缓存里对应的 key 立即失效
+    if (msg->command->flags & NGX_STREAM_REDIS_CMD_WRITE) {
+        ngx_stream_redis_cache_invalidate(msg, &ctx->parser);
     }
 
-    if (rev->timedout) {
-        c->timedout = 1;
+    // MGET/DEL 等可以按 slot 拆开分别发送, 其余跨 slot 的命令直接拒绝
+    if (ctx->crossslot) {
 
-        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
-        ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
-        return;
-    }
+        // MSETNX 拆开后不再是原子的, 需要显式打开
+        if (msg->command->keys == NGX_STREAM_REDIS_KEYS_SPLIT
+            || (msg->type == MSG_REQ_REDIS_MSETNX && pscf->msetnx_split))
+        {
+            if (ngx_stream_redis_fanout_split(msg, &ctx->parser) != NGX_OK) {
+                return NGX_ERROR;
+            }
 
-    rc = ngx_stream_redis_proxy_read_request(s);
-    if ( rc == NGX_ERROR ) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
+            return ngx_stream_redis_proxy_scatter(msg);
+        }
+
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_crossslot);
+        return NGX_OK;
     }
 
-    if ( rc == NGX_AGAIN ) {
-        return;
+    // GET/HGET/HGETALL 命中近端缓存时直接回复, 不经过上游
+    if (ngx_stream_redis_cache_lookup(msg, &ctx->parser) == NGX_OK) {
+        ngx_stream_redis_proxy_complete(msg);
+        return NGX_OK;
     }
 
-    if ( ctx->slotids == NULL || ctx->slotids->nelts == 0 ) {
-        rc = ngx_stream_redis_read_request_check(s, src, dst, u);
-        if ( rc == NGX_OK ) {
-            ngx_stream_redis_proxy_finalize(s, NGX_OK);
-            return;
-        }
+    ctx->slotid = msg->slotid;
 
-        ngx_stream_redis_proxy_connect(s);
-        return;
+    if (ngx_stream_redis_process_request(s) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    if ( ctx->slotids->nelts == 1 ) {
-        rc = ngx_stream_redis_read_request_check(s, src, dst, u);
-        if ( rc == NGX_OK ) {
-            ngx_stream_redis_proxy_finalize(s, NGX_OK);
-            return;
-        }
+    msg->node = ctx->node ? ctx->node : ngx_stream_redis_cluster_any();
 
-        ctx->slotid = *(size_t *)ctx->slotids->elts;
-        rc = ngx_stream_redis_process_request(s);
-        if ( rc != NGX_OK ) {
-            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-            return;
+    // slot 正在迁移, 已知迁走的 key 直接带 ASKING 发到目标节点, 省一次 ASK
+    cmd = msg->command;
+
+    if (cmd->first > 0 && cmd->first == cmd->last
+        && (ngx_uint_t) cmd->first < ctx->parser.args.nelts)
+    {
+        arg = ctx->parser.args.elts;
+        arg += cmd->first;
+
+        node = ngx_stream_redis_cluster_ask_route(msg->slotid,
+                                                  msg->start + arg->pos,
+                                                  arg->len);
+        if (node != NULL) {
+            msg->node = node;
+            msg->asking = 1;
         }
-        ngx_stream_redis_proxy_connect(s);
-        return;
     }
 
-    ngx_stream_redis_proxy_finalize(s, NGX_OK);
-    return;
+    ngx_stream_redis_proxy_forward(msg);
+
+    return NGX_OK;
+}
+
 
 /*
-    size_t i = 0;
-    for ( i = ctx->request_num; i < ctx->client_buffers->nelts; i++) {
-        rc = ngx_stream_redis_read_request_check(s, src, dst, u);
-        if ( rc != NGX_OK && ctx->request_num > 0) {
-             return;
-         }
-
-        ctx->slotid = *(size_t *)ctx->slotids->elts + i;
-        rc = ngx_stream_redis_process_request(s);
-        if ( rc != NGX_OK ) {
-            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-            return;
-        }
-        ngx_str_t *buffers = (ngx_str_t *) ctx->client_buffers->elts + i;
+ * moves unparsed bytes and the requests of outstanding messages to the
+ * start of buffer_in; queued and in-flight messages point into it, so
+ * their pointers are shifted by the same amount
+ */
+static void
+ngx_stream_redis_proxy_compact(ngx_stream_redis_proxy_ctx_t *ctx)
+{
+    off_t                                    delta;
+    u_char                                  *keep;
+    ngx_buf_t                               *b;
+    ngx_queue_t                             *q;
+    ngx_stream_redis_msg_t                  *msg;
 
-        ngx_log_error(NGX_LOG_INFO, c->log, 0, "%V", buffers);
+    b = ctx->buffer_in;
+    keep = b->pos;
+
+    if (!ngx_queue_empty(&ctx->msgs)) {
+        q = ngx_queue_head(&ctx->msgs);
+        msg = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+        keep = msg->start;
+    }
 
-        ctx->buffer_in->pos = buffers->data;
-        ctx->buffer_in->last = buffers->data + buffers->len;
-        ctx->buffer_in->memory = 1;
-        ctx->buffer_in->last_buf = 1;
+    delta = keep - b->start;
 
-        ngx_stream_redis_proxy_connect(s);
-        ctx->request_num++;
+    if (delta == 0) {
+        return;
     }
-*/
-}
 
+    ngx_memmove(b->start, keep, b->last - keep);
 
-static void
-ngx_stream_redis_write_request_handler(ngx_event_t *wev)
-{
-    ngx_connection_t                    *c;
-    ngx_stream_session_t                *s;
-    ngx_stream_redis_proxy_srv_conf_t       *pscf;
+    b->pos -= delta;
+    b->last -= delta;
+
+    for (q = ngx_queue_head(&ctx->msgs);
+         q != ngx_queue_sentinel(&ctx->msgs);
+         q = ngx_queue_next(q))
+    {
+        msg = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+
+        msg->start -= delta;
+        msg->req.pos -= delta;
+        msg->req.last -= delta;
+    }
+}
 
-    c = wev->data;
-    s = c->data;
 
+/*
+ * sends the sub-requests of msg not sent yet, each to the node fanout
+ * chose; those rebuilt after TRYAGAIN wait a little first
+ */
+static ngx_int_t
+ngx_stream_redis_proxy_scatter(ngx_stream_redis_msg_t *msg)
+{
+    ngx_queue_t             *q;
+    ngx_stream_redis_msg_t  *child;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_write_request_handler");
+    for (q = ngx_queue_head(&msg->children);
+         q != ngx_queue_sentinel(&msg->children);
+         q = ngx_queue_next(q))
+    {
+        child = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
+        if (child->done || child->conn || child->held
+            || child->retry.timer_set)
+        {
+            continue;
+        }
 
-    if (wev->timedout) {
-        c->timedout = 1;
+        if (child->tryagain) {
+            child->tryagain = 0;
+            ngx_stream_redis_proxy_delay(child);
+            continue;
+        }
 
-        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
-        ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
-        return;
+        ngx_stream_redis_proxy_forward(child);
     }
 
-    ngx_stream_redis_proxy_process_connection(wev, 1);
+    return NGX_OK;
 }
 
 
-
 static void
-ngx_stream_redis_proxy_connect(ngx_stream_session_t *s)
+ngx_stream_redis_proxy_forward(ngx_stream_redis_msg_t *msg)
 {
-    ngx_int_t                     rc;
-    ngx_connection_t             *c, *pc;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_redis_proxy_ctx_t            *ctx;
-    ngx_stream_redis_proxy_srv_conf_t       *pscf;
-    ngx_stream_upstream_srv_conf_t          *uscf;
-
-    ctx = NULL;
-    c = s->connection;
-    u = s->upstream;
+    ngx_stream_redis_node_t            *node;
+    ngx_stream_redis_proxy_srv_conf_t  *pscf;
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-    if (pscf == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+    if (msg->node == NULL) {
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_clusterdown);
         return;
     }
 
-    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
+    pscf = ngx_stream_get_module_srv_conf(msg->session,
+                                          ngx_stream_redis_proxy_module);
+
+    // 只读命令可以发到从节点; 重定向过的命令和 MSETNX 的检查仍然走主节点
+    msg->readonly = 0;
+
+    if (pscf->read_from != NGX_STREAM_REDIS_READ_MASTER
+        && msg->command != NULL
+        && (msg->command->flags & NGX_STREAM_REDIS_CMD_READONLY)
+        && msg->slotid >= 0
+        && msg->redirects == 0
+        && !msg->asking
+        && (msg->parent == NULL || msg->parent->type != MSG_REQ_REDIS_MSETNX)
+        && !ngx_stream_redis_proxy_written(msg, pscf->read_your_writes))
+    {
+        node = ngx_stream_redis_pool_read_node(msg->node, pscf->read_from);
+
+        if (node != NULL && node != msg->node) {
+            msg->node = node;
+            msg->readonly = 1;
+        }
     }
 
-    // 创建连接上游的结构体
-    // 里面有如何获取负载均衡server、上下游buf等
-    u = ngx_pcalloc(c->pool, sizeof(ngx_stream_upstream_t));
-    if (u == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
+    if (ngx_stream_redis_pool_send(msg, pscf->connect_timeout,
+                                   pscf->upstream_read_timeout)
+        != NGX_OK)
+    {
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_unavailable);
     }
-    s->upstream = u;
-    u->downstream_buf = *ctx->buffer_in;
+}
 
-    s->log_handler = ngx_stream_redis_proxy_log_error;
-    u->peer.log = c->log;
-    u->peer.log_error = NGX_ERROR_ERR;
 
-    u->peer.local = pscf->local;
-    u->peer.type = c->type;
+/* resends msg later, the delay doubles with every redirect it had */
+static void
+ngx_stream_redis_proxy_delay(ngx_stream_redis_msg_t *msg)
+{
+    ngx_event_t  *ev;
 
-    // 获取上游的配置结构体
-    // 在ngx_stream_proxy_pass里设置的
-    uscf = pscf->upstream;
+    ev = &msg->retry;
 
-    // 负载均衡算法初始化
-    if (uscf->peer.init(s, uscf) != NGX_OK) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
+    ev->handler = ngx_stream_redis_proxy_retry_handler;
+    ev->data = msg;
+    ev->log = msg->session->connection->log;
 
-    // 准备开始连接，设置开始时间，毫秒
-    u->peer.start_time = ngx_current_msec;
+    ngx_add_timer(ev, (ngx_msec_t) NGX_STREAM_REDIS_TRYAGAIN_DELAY
+                      << (msg->redirects ? msg->redirects - 1 : 0));
+}
 
-    // 设置负载均衡的重试次数
-    if (pscf->next_upstream_tries
-        && u->peer.tries > pscf->next_upstream_tries)
-    {
-        u->peer.tries = pscf->next_upstream_tries;
-    }
 
-    u->proxy_protocol = pscf->proxy_protocol;
+static void
+ngx_stream_redis_proxy_retry_handler(ngx_event_t *ev)
+{
+    ngx_stream_redis_proxy_forward(ev->data);
+}
 
-    // 准备开始连接，设置开始时间，秒数，没有毫秒
-    u->start_sec = ngx_time();
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                   "proxy connection handler");
+static void
+ngx_stream_redis_proxy_wrote(ngx_stream_redis_proxy_ctx_t *ctx,
+    ngx_uint_t slot)
+{
+    ngx_uint_t                  i;
+    ngx_stream_redis_write_t   *w, *oldest;
 
-    c->log->action = "connecting to upstream";
+    oldest = &ctx->writes[0];
 
-    u = s->upstream;
+    for (i = 0; i < NGX_STREAM_REDIS_RECENT_WRITES; i++) {
+        w = &ctx->writes[i];
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_sream_redis_proxy_connect ");
+        if (w->time && w->slot == slot) {
+            oldest = w;
+            break;
+        }
 
-    rc = ngx_event_connect_peer(&u->peer);
+        if (ngx_current_msec - w->time > ngx_current_msec - oldest->time) {
+            oldest = w;
+        }
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "proxy connect: %i", rc);
+    oldest->slot = slot;
+    oldest->time = ngx_current_msec;
+}
 
-    if (rc == NGX_ERROR) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
 
-    if (rc == NGX_BUSY) {
-        ngx_log_error(NGX_LOG_ERR, c->log, 0, "no live upstreams");
-        ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
-        return;
-    }
+/* a slot of msg was written by its session less than window ago */
+static ngx_uint_t
+ngx_stream_redis_proxy_written(ngx_stream_redis_msg_t *msg, ngx_msec_t window)
+{
+    ngx_uint_t                       i, k, n;
+    ngx_stream_redis_write_t        *w;
+    ngx_stream_redis_proxy_ctx_t    *ctx;
 
-    if (rc == NGX_DECLINED) {
-        ngx_log_error(NGX_LOG_ERR, c->log, 0, "rc  NGX_DECLINED");
-        ngx_stream_redis_proxy_next_upstream(s);
-        return;
+    if (window == 0) {
+        return 0;
     }
 
-    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
-    pc = u->peer.connection;
+    ctx = ngx_stream_get_module_ctx(msg->session, ngx_stream_redis_proxy_module);
 
-    pc->data = s;
-    pc->log = c->log;
-    pc->pool = c->pool;
-    pc->read->log = c->log;
-    pc->write->log = c->log;
+    n = msg->groups ? msg->ngroups : 1;
 
-    if (rc != NGX_AGAIN) {
-        ngx_stream_redis_proxy_init_upstream(s);
-        return;
-    }
+    for (i = 0; i < NGX_STREAM_REDIS_RECENT_WRITES; i++) {
+        w = &ctx->writes[i];
 
-    pc->read->handler = ngx_stream_redis_proxy_connect_handler;
-    pc->write->handler = ngx_stream_redis_proxy_connect_handler;
+        if (w->time == 0 || ngx_current_msec - w->time >= window) {
+            continue;
+        }
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
+        for (k = 0; k < n; k++) {
+            if (w->slot == (msg->groups ? msg->groups[k].slot
+                                        : (ngx_uint_t) msg->slotid))
+            {
+                return 1;
+            }
+        }
+    }
 
-    ngx_add_timer(pc->write, pscf->connect_timeout);
+    return 0;
 }
 
+
+/* called by the pool with the reply, must not finalize the session */
 static void
-ngx_stream_redis_proxy_connect_handler(ngx_event_t *ev)
+ngx_stream_redis_proxy_reply_handler(ngx_stream_redis_msg_t *msg)
 {
-    ngx_connection_t      *c;
-    ngx_stream_session_t  *s;
-    ngx_stream_redis_proxy_ctx_t *ctx;
-
-    c = ev->data;
-    s = c->data;
+    ngx_int_t                n;
+    ngx_connection_t        *c;
+    ngx_stream_redis_msg_t  *parent;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_proxy_connect_handler");
-
-    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
+    parent = msg->parent;
 
-    if (ev->timedout) {
-        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out");
-        ngx_stream_redis_proxy_next_upstream(s);
-        return;
-    }
+    if (parent != NULL) {
+        /* the redirected commands of a sub-request go out again */
+        n = ngx_stream_redis_fanout_redirect(msg);
 
-    ngx_del_timer(c->write);
+        ngx_stream_redis_proxy_complete(msg);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                   "stream proxy connect upstream");
+        if (n != 0) {
+            /* on error some may have been built before */
+            ngx_stream_redis_proxy_scatter(parent);
+        }
 
-    if (ngx_stream_redis_proxy_test_connect(c) != NGX_OK) {
-        ctx->upstream_connect = 0;
-        ngx_stream_redis_proxy_next_upstream(s);
         return;
     }
 
-    ctx->upstream_connect = 1;
-    ngx_stream_redis_proxy_init_upstream(s);
-}
+    if ((msg->rsp_type == MSG_RSP_REDIS_ERROR_MOVED
+         || msg->rsp_type == MSG_RSP_REDIS_ERROR_ASK
+         || msg->rsp_type == MSG_RSP_REDIS_ERROR_TRYAGAIN)
+        && msg->redirects < NGX_STREAM_REDIS_MAX_REDIRECTS
+        && ngx_stream_redis_process_response(msg) == NGX_OK)
+    {
+        c = msg->session->connection;
 
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "[redis_proxy] redirect slot %i to %*s",
+                       msg->slotid, msg->node->addr_len, msg->node->addr);
 
-static void
-ngx_stream_redis_proxy_init_upstream(ngx_stream_session_t *s)
-{
-    ngx_int_t                    rc;
-    int                           tcp_nodelay;
-    u_char                       *p;
-    ngx_connection_t             *c, *pc;
-    ngx_log_handler_pt            handler;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_core_srv_conf_t   *cscf;
-    ngx_stream_redis_proxy_srv_conf_t  *pscf;
+        msg->redirects++;
 
-    u = s->upstream;
-    pc = u->peer.connection;
+        // ASK 要在同一连接上先发 ASKING, MOVED 之后按新的 slot 表直接发
+        if (msg->rsp_type == MSG_RSP_REDIS_ERROR_ASK) {
+            msg->asking = 1;
 
-    cscf = ngx_stream_get_module_srv_conf(s, ngx_stream_core_module);
+        } else if (msg->rsp_type == MSG_RSP_REDIS_ERROR_MOVED) {
+            msg->asking = 0;
+        }
 
-    if (pc->type == SOCK_STREAM
-        && cscf->tcp_nodelay
-        && pc->tcp_nodelay == NGX_TCP_NODELAY_UNSET)
-    {
-        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0, "tcp_nodelay");
+        if (msg->rsp.temporary) {
+            ngx_free(msg->rsp.start);
+        }
 
-        tcp_nodelay = 1;
+        ngx_memzero(&msg->rsp, sizeof(ngx_buf_t));
 
-        if (setsockopt(pc->fd, IPPROTO_TCP, TCP_NODELAY,
-                       (const void *) &tcp_nodelay, sizeof(int)) == -1)
-        {
-            ngx_connection_error(pc, ngx_socket_errno,
-                                 "setsockopt(TCP_NODELAY) failed");
-            ngx_stream_redis_proxy_next_upstream(s);
+        // TRYAGAIN 说明 key 还在迁移, 立刻重发只会把重试次数用完
+        if (msg->rsp_type == MSG_RSP_REDIS_ERROR_TRYAGAIN) {
+            ngx_stream_redis_proxy_delay(msg);
             return;
         }
 
-        pc->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        ngx_stream_redis_proxy_forward(msg);
+        return;
     }
 
-    if (u->proxy_protocol) {
+    ngx_stream_redis_cache_store(msg);
 
-        u->proxy_protocol = 0;
-    }
+    ngx_stream_redis_proxy_complete(msg);
+}
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
 
-    c = s->connection;
+/*
+ * a sub-request only counts down its parent, the last one to finish
+ * builds the parent's reply
+ */
+static void
+ngx_stream_redis_proxy_complete(ngx_stream_redis_msg_t *msg)
+{
+    ngx_int_t                rc;
+    ngx_connection_t        *c;
+    ngx_stream_redis_msg_t  *parent;
 
-    if (c->log->log_level >= NGX_LOG_INFO) {
-        ngx_str_t  str;
-        u_char     addr[NGX_SOCKADDR_STRLEN];
+    msg->done = 1;
 
-        str.len = NGX_SOCKADDR_STRLEN;
-        str.data = addr;
+    parent = msg->parent;
 
-        if (ngx_connection_local_sockaddr(pc, &str, 1) == NGX_OK) {
-            handler = c->log->handler;
-            c->log->handler = NULL;
-/*
-            ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                          "%sproxy %V connected to %V",
-                          pc->type == SOCK_DGRAM ? "udp " : "",
-                          &str, u->peer.name);
-*/
-            c->log->handler = handler;
+    if (parent != NULL) {
+
+        if (--parent->pending) {
+            return;
         }
-    }
 
-    c->log->action = "proxying connection";
+        rc = ngx_stream_redis_fanout_merge(parent);
 
-    if (u->upstream_buf.start == NULL) {
-        p = ngx_pnalloc(c->pool, pscf->buffer_size);
-        if (p == NULL) {
-            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        if (rc == NGX_AGAIN) {
+            /* msg may be gone with the phase it belonged to */
+            ngx_stream_redis_proxy_scatter(parent);
             return;
         }
 
-        u->upstream_buf.start = p;
-        u->upstream_buf.end = p + pscf->buffer_size;
-        u->upstream_buf.pos = p;
-        u->upstream_buf.last = p;
-    }
-
-    u->connected = 1;
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, parent->session->connection->log, 0,
+                          "[redis_proxy] cannot merge replies of a "
+                          "split command");
 
-    pc->read->handler = ngx_stream_redis_proxy_upstream_read_handler;
-    pc->write->handler = ngx_stream_redis_proxy_upstream_write_handler;
+            ngx_stream_redis_proxy_reply_local(parent,
+                                               &ngx_stream_redis_invalid);
+            return;
+        }
 
-    if (pc->read->ready || pc->read->eof) {
-        ngx_post_event(pc->read, &ngx_posted_events);
+        msg = parent;
+        msg->done = 1;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_proxy_init_upstream");
-    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "[redis_proxy] send buffer downstream_buf=[%s]", u->downstream_buf.pos);
+    c = msg->session->connection;
 
-    rc = ngx_stream_redis_proxy_send_buffer(s, pc, &u->downstream_buf, pscf->timeout);
-    if (rc == NGX_ERROR ) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
+    if (!c->write->posted) {
+        ngx_post_event(c->write, &ngx_posted_events);
     }
 }
 
-static void
-ngx_stream_redis_proxy_upstream_write_handler(ngx_event_t *wev)
-{
-    ngx_stream_redis_proxy_process_connection(wev, 0);
-}
 
 static void
-ngx_stream_redis_proxy_upstream_read_handler(ngx_event_t *rev)
+ngx_stream_redis_proxy_reply_local(ngx_stream_redis_msg_t *msg, ngx_str_t *rsp)
 {
-    ngx_stream_redis_proxy_process_connection(rev, 1);
+    msg->rsp.start = rsp->data;
+    msg->rsp.pos = rsp->data;
+    msg->rsp.last = rsp->data + rsp->len;
+    msg->rsp.end = msg->rsp.last;
+    msg->rsp.memory = 1;
+
+    msg->conn = NULL;
+
+    ngx_stream_redis_proxy_complete(msg);
 }
 
 
+/* HOTKEYS [count], the hot keys this worker has seen */
 static void
-ngx_stream_redis_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
+ngx_stream_redis_proxy_hotkeys(ngx_stream_redis_msg_t *msg,
+    ngx_stream_redis_parser_t *p)
 {
-    ngx_int_t                    rc;
-    ngx_connection_t             *c, *pc, *src, *dst;
-    ngx_stream_session_t         *s;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_redis_proxy_ctx_t *ctx;
-    ngx_stream_redis_proxy_srv_conf_t  *pscf;
-
-    c = ev->data;
-    s = c->data;
-    u = s->upstream;
-    c = s->connection;
-    pc = u->peer.connection;
-    src = pc;
-    dst = c;
+    ngx_int_t                n;
+    ngx_stream_redis_arg_t  *args;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_upstream ev %d", ev->write);
-
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
-
-    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
+    args = p->args.elts;
+    n = 0;
 
-    if (ev->timedout) {
-        ev->timedout = 0;
-        if (ev->delayed) {
-            ev->delayed = 0;
-            if (!ev->ready) {
-                if (ngx_handle_read_event(ev, 0) != NGX_OK) {
-                    ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-                    return;
-                }
-                if (u->connected && !c->read->delayed && !pc->read->delayed) {
-                    ngx_add_timer(c->write, pscf->timeout);
-                }
-                return;
-            }
-        } else {
-            ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
-            ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
-            return;
-        }
-    } else if (ev->delayed) {
-        ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
-                       "stream connection delayed");
-        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
-            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        }
-        return;
-    }
-    if (from_upstream && !u->connected) {
+    if (p->args.nelts > 2) {
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_syntax);
         return;
     }
 
-    if (from_upstream && !ev->write) {
+    if (p->args.nelts == 2) {
+        n = ngx_atoi(msg->start + args[1].pos, args[1].len);
 
-        rc = ngx_stream_redis_proxy_read_upstream(s);
-        if ( rc == NGX_ERROR ) {
-             ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-            return;
-        }
-        if ( rc == NGX_AGAIN ) {
+        if (n == NGX_ERROR) {
+            ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_syntax);
             return;
         }
-        return;
     }
 
-    if (ctx->upstream_read) {
-        rc = ngx_stream_redis_proxy_send_buffer(s, c, &u->upstream_buf, pscf->timeout);
-        if (rc == NGX_ERROR ) {
-            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-            return;
-        }
-        if ( rc != NGX_OK ) {
-            return;
-        }
-        ctx->buffer_in->pos = ctx->buffer_in->start;
-        ctx->buffer_in->last = ctx->buffer_in->start;
-    }
+    switch (ngx_stream_redis_hotkeys_reply(msg, n)) {
 
-    // 这时应该是src已经读完，数据也发送完
-    if (src->read->eof && (u->upstream_buf.pos == u->upstream_buf.last || (dst && dst->read->eof))) {
+    case NGX_OK:
+        ngx_stream_redis_proxy_complete(msg);
+        return;
 
-        // 这时应该是src已经读完，数据也发送完
-        ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                            "%s%s disconnected"
-                            ", bytes from/to client:%O/%O"
-                            ", bytes from/to upstream:%O/%O",
-                            c->type == SOCK_DGRAM ? "udp " : "",
-                            from_upstream ? "upstream" : "client",
-                            s->received, c->sent, u->received, pc ? pc->sent : 0);
+    case NGX_DECLINED:
+        ngx_stream_redis_proxy_reply_local(msg,
+                                           &ngx_stream_redis_hotkeys_off);
+        return;
 
-        // 在这里记录访问日志
-        ngx_stream_redis_proxy_finalize(s, NGX_OK);
+    default:
+        ngx_stream_redis_proxy_reply_local(msg, &ngx_stream_redis_oom);
     }
 }
 
-static ngx_int_t
-ngx_stream_redis_proxy_test_connect(ngx_connection_t *c)
+
+static void
+ngx_stream_redis_write_request_handler(ngx_event_t *wev)
 {
-    int        err;
-    socklen_t  len;
+    ngx_uint_t                           n;
+    ngx_queue_t                         *q;
+    ngx_chain_t                         *out, **ll, *rv;
+    ngx_connection_t                    *c;
+    ngx_stream_session_t                *s;
+    ngx_stream_redis_msg_t              *msg;
+    ngx_stream_redis_proxy_ctx_t        *ctx;
+    ngx_stream_redis_proxy_srv_conf_t   *pscf;
 
-#if (NGX_HAVE_KQUEUE)
+    c = wev->data;
+    s = c->data;
 
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
-        err = c->write->kq_errno ? c->write->kq_errno : c->read->kq_errno;
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "ngx_stream_redis_write_request_handler");
 
-        if (err) {
-            (void) ngx_connection_error(c, err,
-                                    "kevent() reported that connect() failed");
-            return NGX_ERROR;
-        }
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
 
-    } else
-#endif
-    {
-        err = 0;
-        len = sizeof(int);
+    if (wev->timedout) {
+        c->timedout = 1;
+
+        ngx_connection_error(c, NGX_ETIMEDOUT, "connection timed out");
+        ngx_stream_redis_proxy_finalize(s, NGX_DECLINED);
+        return;
+    }
+
+    rv = NULL;
 
-        /*
-         * BSDs and Linux return 0 and set a pending error in err
-         * Solaris returns -1 and sets errno
-         */
+    // 回复按客户端发送命令的顺序写回
+    while (!ngx_queue_empty(&ctx->msgs)) {
 
-        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
-            == -1)
+        out = NULL;
+        ll = &out;
+        n = 0;
+
+        for (q = ngx_queue_head(&ctx->msgs);
+             q != ngx_queue_sentinel(&ctx->msgs) && n < 64;
+             q = ngx_queue_next(q), n++)
         {
-            err = ngx_socket_errno;
+            msg = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
+
+            if (!msg->done) {
+                break;
+            }
+
+            msg->out.buf = &msg->rsp;
+            msg->out.next = NULL;
+
+            *ll = &msg->out;
+            ll = &msg->out.next;
         }
 
-        if (err) {
-            (void) ngx_connection_error(c, err, "connect() failed");
-            return NGX_ERROR;
+        if (out == NULL) {
+            break;
         }
-    }
 
-    return NGX_OK;
-}
+        rv = c->send_chain(c, out, 0);
 
-static void
-ngx_stream_redis_proxy_next_upstream(ngx_stream_session_t *s)
-{
-    ngx_msec_t                    timeout;
-    ngx_connection_t             *pc;
-    ngx_stream_upstream_t        *u;
-    ngx_stream_redis_proxy_srv_conf_t  *pscf;
-    ngx_stream_redis_proxy_ctx_t        *ctx;
+        if (rv == NGX_CHAIN_ERROR) {
+            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+            return;
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                   "stream proxy next upstream");
+        while (!ngx_queue_empty(&ctx->msgs)) {
+            q = ngx_queue_head(&ctx->msgs);
+            msg = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
 
-    u = s->upstream;
+            if (!msg->done || msg->rsp.pos != msg->rsp.last) {
+                break;
+            }
 
-    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_redis_proxy_module);
+            ngx_queue_remove(q);
+            ctx->nmsgs--;
 
-    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
-    if (ctx == NULL) {
-        ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
-        return;
-    }
+            ngx_stream_redis_msg_free(msg);
+        }
 
-    if (u->peer.sockaddr) {
-        u->peer.free(&u->peer, u->peer.data, NGX_PEER_FAILED);
-        u->peer.sockaddr = NULL;
+        if (rv != NULL) {
+            break;
+        }
     }
 
-    timeout = pscf->next_upstream_timeout;
-    pc = u->peer.connection;
+    if (rv != NULL) {
+        ngx_add_timer(wev, pscf->timeout);
+
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_stream_redis_proxy_finalize(s, NGX_ERROR);
+        }
 
-    if (pc) {
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                       "close proxy upstream connection: %d", pc->fd);
+        return;
+    }
 
-        ngx_close_connection(pc);
-        u->peer.connection = NULL;
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
     }
 
-    ngx_stream_redis_proxy_connect(s);
+    ngx_stream_redis_proxy_process_requests(s);
 }
 
 
 static void
 ngx_stream_redis_proxy_finalize(ngx_stream_session_t *s, ngx_int_t rc)
 {
-    ngx_connection_t       *pc;
-    ngx_stream_upstream_t  *u;
+    ngx_queue_t                    *q;
+    ngx_stream_redis_msg_t         *msg;
+    ngx_stream_redis_proxy_ctx_t   *ctx;
 
     ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
                    "finalize stream proxy: %i", rc);
 
-    u = s->upstream;
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
 
-    if (u == NULL) {
-        goto noupstream;
+    if (ctx == NULL || ctx->msgs.next == NULL) {
+        goto close;
     }
 
-    if (u->peer.free && u->peer.sockaddr) {
-        u->peer.free(&u->peer, u->peer.data, 0);
-        u->peer.sockaddr = NULL;
-    }
+    // 已发往上游的命令交给共享连接收尾, 不能随会话一起释放
+    while (!ngx_queue_empty(&ctx->msgs)) {
+        q = ngx_queue_head(&ctx->msgs);
+        ngx_queue_remove(q);
 
-    pc = u->peer.connection;
+        msg = ngx_queue_data(q, ngx_stream_redis_msg_t, queue);
 
-    if (pc) {
-        ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
-                       "close stream proxy upstream connection: %d", pc->fd);
+        if (msg->conn) {
+            ngx_stream_redis_pool_cancel(msg);
 
-        ngx_close_connection(pc);
-        u->peer.connection = NULL;
+        } else {
+            ngx_stream_redis_msg_free(msg);
+        }
     }
 
-noupstream:
+    ctx->nmsgs = 0;
+
+close:
 
     ngx_stream_close_connection(s->connection);
 }
@@ -1175,31 +1244,109 @@ noupstream:
 static u_char *
 ngx_stream_redis_proxy_log_error(ngx_log_t *log, u_char *buf, size_t len)
 {
-    u_char                 *p;
-    ngx_connection_t       *pc;
-    ngx_stream_session_t   *s;
-    ngx_stream_upstream_t  *u;
+    ngx_stream_session_t          *s;
+    ngx_stream_redis_proxy_ctx_t  *ctx;
 
     s = log->data;
 
-    u = s->upstream;
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_redis_proxy_module);
+
+    return ngx_snprintf(buf, len,
+                        ", bytes from/to client:%O/%O, commands pending:%ui",
+                        s->received, s->connection->sent,
+                        ctx ? ctx->nmsgs : 0);
+}
+
+
+static void *
+ngx_stream_redis_proxy_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_stream_redis_cluster_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_redis_cluster_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream = NULL;
+     *     conf->near_cache_prefixes = NULL;
+     */
+
+    conf->refresh_interval = NGX_CONF_UNSET_MSEC;
+    conf->refresh_timeout = NGX_CONF_UNSET_MSEC;
+    conf->pool_max = NGX_CONF_UNSET_UINT;
+    conf->pool_min = NGX_CONF_UNSET_UINT;
+    conf->pool_idle_timeout = NGX_CONF_UNSET_MSEC;
+    conf->max_fails = NGX_CONF_UNSET_UINT;
+    conf->fail_timeout = NGX_CONF_UNSET_MSEC;
+    conf->replica_max_lag = NGX_CONF_UNSET_MSEC;
+    conf->replica_max_lag_bytes = NGX_CONF_UNSET_SIZE;
+    conf->near_cache = NGX_CONF_UNSET_SIZE;
+    conf->near_cache_ttl = NGX_CONF_UNSET_MSEC;
+    conf->hotkeys = NGX_CONF_UNSET_UINT;
+    conf->hotkeys_window = NGX_CONF_UNSET_MSEC;
+    conf->hotkeys_threshold = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_redis_proxy_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_stream_redis_cluster_conf_t *rccf = conf;
+
+    ngx_conf_init_msec_value(rccf->refresh_interval, 10000);
+    ngx_conf_init_msec_value(rccf->refresh_timeout, 5000);
+    ngx_conf_init_uint_value(rccf->pool_max, 4);
+    ngx_conf_init_uint_value(rccf->pool_min, 0);
+    ngx_conf_init_msec_value(rccf->pool_idle_timeout, 60000);
+    ngx_conf_init_uint_value(rccf->max_fails, 1);
+    ngx_conf_init_msec_value(rccf->fail_timeout, 10000);
+    ngx_conf_init_msec_value(rccf->replica_max_lag, 0);
+    ngx_conf_init_size_value(rccf->replica_max_lag_bytes, 0);
+    ngx_conf_init_size_value(rccf->near_cache, 0);
+    ngx_conf_init_msec_value(rccf->near_cache_ttl, 10000);
+    ngx_conf_init_uint_value(rccf->hotkeys, 0);
+    ngx_conf_init_msec_value(rccf->hotkeys_window, 60000);
+    ngx_conf_init_uint_value(rccf->hotkeys_threshold, 10000);
+
+    if (rccf->pool_max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"redis_cluster_pool_max\" must be at least 1");
+        return NGX_CONF_ERROR;
+    }
 
-    p = buf;
+    if (rccf->near_cache && rccf->near_cache_ttl == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"redis_cluster_near_cache_ttl\" must not be 0");
+        return NGX_CONF_ERROR;
+    }
 
-    if (u->peer.name) {
-        p = ngx_snprintf(p, len, ", upstream: \"%V\"", u->peer.name);
-        len -= p - buf;
+    if (rccf->hotkeys > NGX_STREAM_REDIS_HOTKEYS_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"redis_cluster_hotkeys\" must not be more "
+                           "than %d", NGX_STREAM_REDIS_HOTKEYS_MAX);
+        return NGX_CONF_ERROR;
     }
 
-    pc = u->peer.connection;
+    if (rccf->hotkeys && rccf->hotkeys_window == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"redis_cluster_hotkeys_window\" must not be 0");
+        return NGX_CONF_ERROR;
+    }
 
-    p = ngx_snprintf(p, len,
-                     ", bytes from/to client:%O/%O"
-                     ", bytes from/to upstream:%O/%O",
-                     s->received, s->connection->sent,
-                     u->received, pc ? pc->sent : 0);
+    if (rccf->pool_min > rccf->pool_max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"redis_cluster_pool_min\" is greater than "
+                           "\"redis_cluster_pool_max\"");
+        return NGX_CONF_ERROR;
+    }
 
-    return p;
+    return NGX_CONF_OK;
 }
 
 
@@ -1232,14 +1379,15 @@ ngx_stream_redis_proxy_create_srv_conf(ngx_conf_t *cf)
 
     conf->connect_timeout = NGX_CONF_UNSET_MSEC;
     conf->timeout = NGX_CONF_UNSET_MSEC;
-    conf->next_upstream_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream_read_timeout = NGX_CONF_UNSET_MSEC;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
     conf->upload_rate = NGX_CONF_UNSET_SIZE;
     conf->download_rate = NGX_CONF_UNSET_SIZE;
     conf->responses = NGX_CONF_UNSET_UINT;
-    conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
-    conf->next_upstream = NGX_CONF_UNSET;
     conf->proxy_protocol = NGX_CONF_UNSET;
+    conf->msetnx_split = NGX_CONF_UNSET;
+    conf->read_from = NGX_CONF_UNSET_UINT;
+    conf->read_your_writes = NGX_CONF_UNSET_MSEC;
     conf->local = NGX_CONF_UNSET_PTR;
 
     return conf;
@@ -1261,8 +1409,8 @@ ngx_stream_redis_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->timeout,
                               prev->timeout, 10 * 60000);
 
-    ngx_conf_merge_msec_value(conf->next_upstream_timeout,
-                              prev->next_upstream_timeout, 0);
+    ngx_conf_merge_msec_value(conf->upstream_read_timeout,
+                              prev->upstream_read_timeout, 60000);
 
     ngx_conf_merge_size_value(conf->buffer_size,
                               prev->buffer_size, 1638400);
@@ -1276,12 +1424,15 @@ ngx_stream_redis_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_uint_value(conf->responses,
                               prev->responses, NGX_MAX_INT32_VALUE);
 
-    ngx_conf_merge_uint_value(conf->next_upstream_tries,
-                              prev->next_upstream_tries, 0);
+    ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
 
-    ngx_conf_merge_value(conf->next_upstream, prev->next_upstream, 1);
+    ngx_conf_merge_value(conf->msetnx_split, prev->msetnx_split, 0);
 
-    ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
+    ngx_conf_merge_uint_value(conf->read_from, prev->read_from,
+                              NGX_STREAM_REDIS_READ_MASTER);
+
+    ngx_conf_merge_msec_value(conf->read_your_writes,
+                              prev->read_your_writes, 0);
 
     ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
 
@@ -1295,9 +1446,10 @@ ngx_stream_redis_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_stream_redis_proxy_srv_conf_t *pscf = conf;
 
-    ngx_url_t                    u;
-    ngx_str_t                   *value, *url;
-    ngx_stream_core_srv_conf_t  *cscf;
+    ngx_url_t                         u;
+    ngx_str_t                        *value, *url;
+    ngx_stream_core_srv_conf_t       *cscf;
+    ngx_stream_redis_cluster_conf_t  *rccf;
 
     if (pscf->upstream) {
         return "is duplicate";
@@ -1321,6 +1473,16 @@ ngx_stream_redis_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_stream_redis_cluster_add_zone(cf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    // 第一个 redis_proxy_pass 的 upstream 作为拓扑刷新的种子节点
+    rccf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_redis_proxy_module);
+    if (rccf->upstream == NULL) {
+        rccf->upstream = pscf->upstream;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -5,26 +5,169 @@
 #include <ngx_core.h>
 #include <ngx_stream.h>
 #include "common.h"
+#include "ngx_stream_redis_cluster.h"
+
+
+#define NGX_STREAM_REDIS_MAX_REDIRECTS          5
+#define NGX_STREAM_REDIS_TRYAGAIN_DELAY         20      /* doubles per try */
+#define NGX_STREAM_REDIS_MAX_PIPELINE           1024
+#define NGX_STREAM_REDIS_RECENT_WRITES          16
+
+
+/* ngx_stream_redis_command_t.flags */
+#define NGX_STREAM_REDIS_CMD_READONLY           0x01    /* safe on a replica */
+#define NGX_STREAM_REDIS_CMD_WRITE              0x02
+#define NGX_STREAM_REDIS_CMD_LOCAL              0x04    /* answered by proxy */
+
+/* redis_read_from, where read-only commands go */
+#define NGX_STREAM_REDIS_READ_MASTER            0
+#define NGX_STREAM_REDIS_READ_PREFER_REPLICAS   1       /* live ones */
+#define NGX_STREAM_REDIS_READ_REPLICAS          2
+
+/* ngx_stream_redis_command_t.keys, how the keys may spread over slots */
+#define NGX_STREAM_REDIS_KEYS_NONE              0
+#define NGX_STREAM_REDIS_KEYS_SLOT              1       /* all in one slot */
+#define NGX_STREAM_REDIS_KEYS_SPLIT             2       /* per key group */
+
+/* ngx_stream_redis_command_t.aggregate, how split replies are merged */
+#define NGX_STREAM_REDIS_AGGR_NONE              0
+#define NGX_STREAM_REDIS_AGGR_ARRAY             1       /* in key order */
+#define NGX_STREAM_REDIS_AGGR_SUM               2       /* integer total */
+#define NGX_STREAM_REDIS_AGGR_OK                3       /* +OK if all are */
+
+
+/*
+ * a command known to the proxy; keys are the arguments first, first + step,
+ * ... up to last, a negative last counts from the end of the request and
+ * a zero last means the argument before first holds the number of keys
+ */
+typedef struct {
+    ngx_str_t                           name;
+    msg_type_t                          type;
+    int8_t                              first;
+    int8_t                              last;
+    uint8_t                             step;
+    uint8_t                             flags;
+    uint8_t                             keys;
+    uint8_t                             aggregate;
+} ngx_stream_redis_command_t;
+
+
+/* the keys of one slot in a sub-request, one command and one reply */
+typedef struct {
+    uint32_t                            start;      /* command, in req */
+    uint32_t                            len;
+    uint32_t                            keys;       /* first, in msg->keys */
+    uint32_t                            nkeys;
+    uint16_t                            slot;
+    uint16_t                            resent;     /* 1 MOVED, 2 ASK,
+                                                       3 TRYAGAIN */
+} ngx_stream_redis_group_t;
+
+
+typedef struct ngx_stream_redis_msg_s  ngx_stream_redis_msg_t;
+typedef struct ngx_stream_redis_conn_s  ngx_stream_redis_conn_t;
+
+typedef void (*ngx_stream_redis_msg_handler_pt)(ngx_stream_redis_msg_t *msg);
+
+
+/*
+ * one client command; it stays in the session queue until its reply is
+ * written back, and sits on the send or in-flight queue of a shared
+ * upstream connection while it is being served; a sub-request is linked
+ * into its parent's children by queue instead
+ */
+struct ngx_stream_redis_msg_s {
+    ngx_queue_t                         queue;
+    ngx_queue_t                         link;
+    ngx_stream_session_t               *session;    /* NULL once orphaned */
+    ngx_stream_redis_conn_t            *conn;
+    ngx_stream_redis_msg_handler_pt     handler;
+    const ngx_stream_redis_command_t   *command;
+
+    ngx_chain_t                         out;
+    ngx_chain_t                         ask_out;    /* ASKING, then out */
+    ngx_buf_t                           ask;
+    ngx_buf_t                           req;        /* pos advances on send */
+    u_char                             *start;      /* request, to resend */
+    u_char                             *orphan;     /* owned request bytes */
+
+    ngx_buf_t                           rsp;
+
+    ngx_stream_redis_node_t            *node;
+    ngx_int_t                           slotid;
+    msg_type_t                          type;       /* request command */
+    msg_type_t                          rsp_type;
+    ngx_uint_t                          redirects;
+    ngx_event_t                         retry;      /* after TRYAGAIN */
+    ngx_msec_t                          sent;       /* queued to a node */
+    uint32_t                            cache_seq;  /* of its cache bucket */
+
+    /*
+     * a command whose keys span slots is served by one sub-request per
+     * node, holding one command per slot
+     */
+    ngx_stream_redis_msg_t             *parent;
+    ngx_queue_t                         children;
+    ngx_uint_t                          pending;    /* children not done */
+    ngx_uint_t                          nkeys;
+    uint32_t                           *keys;       /* key index in parent */
+    ngx_uint_t                          ngroups;
+    ngx_stream_redis_group_t           *groups;
+    ngx_uint_t                          nreplies;   /* still expected */
+
+    unsigned                            done:1;
+    unsigned                            held:1;     /* a later phase */
+    unsigned                            asking:1;   /* after an ASK reply */
+    unsigned                            tryagain:1; /* resend after a delay */
+    unsigned                            ask_reply:1; /* +OK to drop */
+    unsigned                            readonly:1; /* sent to a replica */
+    unsigned                            cache:1;    /* reply may be cached */
+};
+
+
+/* an argument of the request being parsed, offset from its first byte */
+typedef struct {
+    size_t                              pos;
+    size_t                              len;
+} ngx_stream_redis_arg_t;
+
+
+/* request parser state, kept across reads of a partial request */
+typedef struct {
+    ngx_uint_t                          state;
+    size_t                              offset;     /* bytes scanned */
+    ngx_uint_t                          nargs;
+    size_t                              number;
+    ngx_array_t                         args;       /* ngx_stream_redis_arg_t */
+    ngx_array_t                         slots;      /* uint16_t, per key */
+    ngx_uint_t                          keys;       /* first key in args */
+    ngx_uint_t                          nkeys;      /* command->step apart */
+} ngx_stream_redis_parser_t;
+
+
+/* a slot the session wrote to, for redis_read_your_writes */
+typedef struct {
+    ngx_msec_t                          time;
+    ngx_uint_t                          slot;
+} ngx_stream_redis_write_t;
+
 
 typedef struct {
     unsigned                            eof:1;
-    unsigned                            client_read:1;
-    unsigned                            upstream_read:1;
-    unsigned                            init_router:1;
-    unsigned                            ask:1;
-    unsigned                            moved:1;
-    unsigned                            upstream:1;
-    unsigned                            upstream_connect:1;
-    ngx_int_t                           request_num;
+    unsigned                            crossslot:1;
     ngx_int_t                           slotid;
-    ngx_str_t                           cluster_name;
-    ngx_array_t                         *client_buffers;
-    ngx_array_t                         *slotids;
     msg_type_t                          type;            /* message type */
-    ngx_str_t                           node_ip;
-    ngx_buf_t                           *asking;
-    ngx_buf_t                           *cluster_nodes;
+    const ngx_stream_redis_command_t    *command;
+    ngx_stream_redis_node_t             *node;
     ngx_buf_t                           *buffer_in;
+    u_char                              *request_end;
+    ngx_stream_redis_parser_t           parser;
+    ngx_queue_t                         msgs;            /* in client order */
+    ngx_uint_t                          nmsgs;
+
+    /* the latest slots written, the oldest entry is replaced */
+    ngx_stream_redis_write_t            writes[NGX_STREAM_REDIS_RECENT_WRITES];
 } ngx_stream_redis_proxy_ctx_t;
 
 
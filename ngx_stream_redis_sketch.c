@@ -0,0 +1,122 @@
+
+#include "ngx_stream_redis_sketch.h"
+
+
+/* width is rounded up to a power of two */
+ngx_int_t
+ngx_stream_redis_sketch_init(ngx_stream_redis_sketch_t *sk, ngx_uint_t width,
+    ngx_uint_t limit, ngx_log_t *log)
+{
+    size_t      size;
+    ngx_uint_t  w;
+
+    for (w = 64; w < width; w <<= 1) { /* void */ }
+
+    size = NGX_STREAM_REDIS_SKETCH_DEPTH * w * sizeof(uint32_t);
+
+    sk->counters = ngx_alloc(size, log);
+    if (sk->counters == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sk->counters, size);
+
+    sk->mask = w - 1;
+    sk->samples = 0;
+    sk->limit = limit;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_stream_redis_sketch_free(ngx_stream_redis_sketch_t *sk)
+{
+    if (sk->counters) {
+        ngx_free(sk->counters);
+        sk->counters = NULL;
+    }
+}
+
+
+/*
+ * the counter of row i is h1 + i * h2, from the two halves of hash;
+ * only the smallest counters go up, which keeps the overestimate of a
+ * rare key sharing counters with hot ones low
+ */
+uint32_t
+ngx_stream_redis_sketch_add(ngx_stream_redis_sketch_t *sk, uint64_t hash)
+{
+    uint32_t    h1, h2, min, *c[NGX_STREAM_REDIS_SKETCH_DEPTH];
+    ngx_uint_t  i, w;
+
+    h1 = (uint32_t) hash;
+    h2 = (uint32_t) (hash >> 32) | 1;
+    w = sk->mask + 1;
+
+    min = (uint32_t) -1;
+
+    for (i = 0; i < NGX_STREAM_REDIS_SKETCH_DEPTH; i++) {
+        c[i] = &sk->counters[i * w + ((h1 + i * h2) & sk->mask)];
+
+        if (*c[i] < min) {
+            min = *c[i];
+        }
+    }
+
+    if (min != (uint32_t) -1) {
+        for (i = 0; i < NGX_STREAM_REDIS_SKETCH_DEPTH; i++) {
+            if (*c[i] == min) {
+                (*c[i])++;
+            }
+        }
+
+        min++;
+    }
+
+    if (sk->limit && ++sk->samples >= sk->limit) {
+        ngx_stream_redis_sketch_age(sk);
+    }
+
+    return min;
+}
+
+
+uint32_t
+ngx_stream_redis_sketch_estimate(ngx_stream_redis_sketch_t *sk, uint64_t hash)
+{
+    uint32_t    h1, h2, min, v;
+    ngx_uint_t  i, w;
+
+    h1 = (uint32_t) hash;
+    h2 = (uint32_t) (hash >> 32) | 1;
+    w = sk->mask + 1;
+
+    min = (uint32_t) -1;
+
+    for (i = 0; i < NGX_STREAM_REDIS_SKETCH_DEPTH; i++) {
+        v = sk->counters[i * w + ((h1 + i * h2) & sk->mask)];
+
+        if (v < min) {
+            min = v;
+        }
+    }
+
+    return min;
+}
+
+
+/* every count halves, what was seen long ago fades out */
+void
+ngx_stream_redis_sketch_age(ngx_stream_redis_sketch_t *sk)
+{
+    ngx_uint_t  i, n;
+
+    n = NGX_STREAM_REDIS_SKETCH_DEPTH * (sk->mask + 1);
+
+    for (i = 0; i < n; i++) {
+        sk->counters[i] >>= 1;
+    }
+
+    sk->samples /= 2;
+}
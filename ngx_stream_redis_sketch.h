@@ -0,0 +1,35 @@
+#ifndef NGX_STREAM_REDIS_SKETCH_H
+#define NGX_STREAM_REDIS_SKETCH_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_STREAM_REDIS_SKETCH_DEPTH          4
+
+
+/*
+ * count-min sketch of key frequencies, per worker; every counter halves
+ * once limit samples were added, or whenever the owner ages it with a
+ * zero limit, so the counts follow recent traffic and the memory stays
+ * depth * width counters whatever the keyspace
+ */
+typedef struct {
+    uint32_t                              *counters;   /* depth rows */
+    ngx_uint_t                             mask;       /* width - 1 */
+    ngx_uint_t                             samples;
+    ngx_uint_t                             limit;
+} ngx_stream_redis_sketch_t;
+
+
+ngx_int_t ngx_stream_redis_sketch_init(ngx_stream_redis_sketch_t *sk,
+    ngx_uint_t width, ngx_uint_t limit, ngx_log_t *log);
+void ngx_stream_redis_sketch_free(ngx_stream_redis_sketch_t *sk);
+uint32_t ngx_stream_redis_sketch_add(ngx_stream_redis_sketch_t *sk,
+    uint64_t hash);
+uint32_t ngx_stream_redis_sketch_estimate(ngx_stream_redis_sketch_t *sk,
+    uint64_t hash);
+void ngx_stream_redis_sketch_age(ngx_stream_redis_sketch_t *sk);
+
+
+#endif /* NGX_STREAM_REDIS_SKETCH_H */